@@ -3,16 +3,68 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <string.h>
-#include <ctype.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <termios.h>
+#include <sys/inotify.h>
+#include <ctype.h>
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#endif
+#if defined(__has_include) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+#define SHELL_HAVE_IO_URING 1
+#endif
 
 /* Configuration constants */
-#define MAX_COMMANDS 200
-#define MAX_ARGS 64 
 #define COMMAND_BUFFER_SIZE 1024
 #define LINE_BUFFER_SIZE 256
+#define MAX_JOBS 64
+#define FANOUT_MAX_PROCS 4096       // Ceiling for 'fanout -P' below the process limit
+#define ARENA_MIN_BLOCK 4096
+#define ARENA_ALIGN 16
+#define POOL_MAX_MSG 65536
+#define PIPE_GRACE_MS 100
+#define PIPE_KILL_FACTOR 4
+#define MEMO_TTL 60                 // Seconds (SHELL_MEMO_TTL)
+#define MEMO_MAX_BYTES (16 << 20)   // Total cached output (SHELL_MEMO_SIZE)
+#define MEMO_MIN_BUCKETS 64
+#define MEMO_DISK_MAGIC "SHMEMO1"
+#define CGROUP_CPU_PERIOD 100000    // cpu.max period for 'limit -c' (microseconds)
+#define CPU_CACHE_LEVELS 10         // cache/indexN entries probed per CPU
+
+/* 'time' report formats */
+#define TIME_TEXT 1
+#define TIME_JSON 2
+
+/* Throughput profiler: bytes moved per splice() call */
+#define RELAY_CHUNK 65536
+
+/* 'bulk' redirections: O_DIRECT write unit and alignment */
+#define DIRECT_CHUNK (1 << 20)
+#define DIRECT_ALIGN 4096
+#define DIRECT_RING_BUFS 4          // Registered buffers rotating through the io_uring sink
+#define URING_ENTRIES 8
 
 /* Return codes */
 #define SUCCESS 0
@@ -21,12 +73,151 @@
 #define ERROR_PIPE 3
 #define ERROR_FORK 4
 
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_close_range
+#define SYS_close_range 436
+#endif
+
+/* ioprio_set(2) and set_mempolicy(2) have no glibc wrappers */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#define SHELL_MPOL_BIND 2
+
 /* Global variables for signal handling */
 static volatile sig_atomic_t g_shell_running = 1;
 
+/* Status of the last pipeline run, for $? and the shell's own exit status */
+static int g_last_status = SUCCESS;
+
+/* Set by the SIGCHLD handler, consumed by the main loop reaper */
+static volatile sig_atomic_t g_sigchld_pending = 0;
+
 /* Global variable for testing mode */
 static int g_test_mode = 0;
 
+/* Global variable for debug mode (SHELL_DEBUG) */
+static int g_debug_mode = 0;
+
+/* Whether the shell shows prompts and job notifications */
+static int g_interactive = 0;
+
+/* Whether standard input is still the shell's own input (script or
+   terminal): not in forked children, nor while a built-in runs redirected */
+static int g_shell_stdin = 1;
+
+/* Event loop: signalfd and background job pidfds, -1 without signalfd support */
+static int g_event_fd = -1;
+static int g_signal_fd = -1;
+static int g_timer_fd = -1;         // Teardown of background jobs' orphaned producers
+static sigset_t g_saved_sigmask;    // Mask to restore in children
+
+/* epoll tags of the signalfd and the timerfd; job stages use (slot << 32) | stage */
+#define EVENT_SIGNAL UINT64_MAX
+#define EVENT_TIMER (UINT64_MAX - 1)
+#define INPUT_CHUNK 4096
+
+/* io_uring for the shell's own I/O: 1 = use when the kernel supports it,
+   0 = read/write only (SHELL_IO_URING=0) */
+static int g_io_uring = 1;
+
+/* Grace before orphaned producers get SIGTERM (SHELL_PIPE_GRACE_MS), < 0 disables */
+static int g_pipe_grace_ms = PIPE_GRACE_MS;
+
+/* Settings read from the environment, collected by one pass over environ at
+   startup so that no hot path calls getenv() */
+static struct {
+    const char* test_mode;          // SHELL_TEST_MODE
+    const char* debug;              // SHELL_DEBUG
+    const char* io_uring;           // SHELL_IO_URING
+    const char* pipe_grace_ms;      // SHELL_PIPE_GRACE_MS
+    const char* pool;               // SHELL_POOL
+    const char* memo_ttl;           // SHELL_MEMO_TTL
+    const char* memo_size;          // SHELL_MEMO_SIZE
+    const char* memo_env;           // SHELL_MEMO_ENV
+    const char* memo_file;          // SHELL_MEMO_FILE
+    const char* cgroup;             // SHELL_CGROUP
+    const char* history_file;       // SHELL_HISTORY_FILE
+    const char* line_editor;        // SHELL_LINE_EDITOR
+    const char* startup_profile;    // SHELL_STARTUP_PROFILE
+    const char* script_cache;       // SHELL_SCRIPT_CACHE
+    const char* home;               // HOME
+    const char* path;               // PATH
+} g_env;
+
+/* Startup phases timed by SHELL_STARTUP_PROFILE, in order */
+typedef enum {
+    STARTUP_LOADED,         // First constructor: exec and dynamic linking are done
+    STARTUP_MAIN,           // main() entered
+    STARTUP_ENV,            // Environment scanned
+    STARTUP_SIGNALS,        // Signal handlers and the signalfd installed
+    STARTUP_INIT,           // Subsystems initialized
+    STARTUP_STDIO,          // Banner and first prompt written
+    STARTUP_PHASES
+} startup_phase_t;
+
+static struct timespec g_startup[STARTUP_PHASES];
+static struct timespec g_startup_cpu;   // Thread CPU time at STARTUP_LOADED
+
+/**
+ * Runs before main(): everything the process did so far (exec, the dynamic
+ * loader, libc initialization) shows up as CPU time of this thread
+ */
+__attribute__((constructor)) static void startup_loaded(void) {
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &g_startup_cpu);
+    clock_gettime(CLOCK_MONOTONIC, &g_startup[STARTUP_LOADED]);
+}
+
+/**
+ * Record the end of a startup phase
+ */
+static inline void startup_mark(startup_phase_t phase) {
+    clock_gettime(CLOCK_MONOTONIC, &g_startup[phase]);
+}
+
+/* Resource accounting of one pipeline stage */
+typedef struct {
+    struct timespec start;  // Just before the stage was launched
+    struct timespec end;    // When the stage was reaped
+    struct rusage usage;    // From wait4()
+    int status;             // Raw wait status
+} stage_stats_t;
+
+/* Background job table entry */
+typedef enum { JOB_FREE = 0, JOB_RUNNING, JOB_DONE } job_state_t;
+
+/* 'time' accounting of one stage of a background job */
+typedef struct {
+    stage_stats_t stats;
+    pid_t pid;
+    int text_off;           // Stage text within the job's command
+    int text_len;
+} job_stage_time_t;
+
+typedef struct {
+    int id;                 // Job number shown to the user ([1], [2], ...)
+    job_state_t state;
+    pid_t* pids;            // One pid per pipeline stage (-1 once reaped), then helpers
+    int num_pids;
+    int num_stages;         // Pipeline stages at the front of pids
+    int remaining;          // Stages still running
+    int exit_status;        // Exit status of the last stage
+    struct timespec start;
+    struct timespec end;
+    char* command;
+    char* cgroup;           // Job cgroup from 'limit', removed once reported
+    int* pidfds;            // Per pid, registered with the event loop, -1 if none
+    int cut;                // Furthest stage that has exited
+    int teardown;           // Signals sent to orphaned producers: 0, 1 (SIGTERM), 2 (SIGKILL)
+    int armed;              // Teardown timer running until deadline
+    struct timespec deadline;
+    int timing;             // 'time &': 0, TIME_TEXT or TIME_JSON
+    job_stage_time_t* times;    // Per stage when timed, reported with the job
+} job_t;
+
+static job_t g_jobs[MAX_JOBS];
+
 /**
  * Signal handler for graceful shutdown
  * Handles SIGINT (Ctrl+C) and SIGTERM for clean exit
@@ -37,6 +228,86 @@ static void signal_handler(int sig) {
     write(STDOUT_FILENO, "\nShell shutting down...\n", 24);
 }
 
+/**
+ * SIGCHLD handler: only flags the event, reaping happens in the main loop
+ */
+static void sigchld_handler(int sig) {
+    (void)sig;
+    g_sigchld_pending = 1;
+}
+
+/**
+ * Collect the shell's settings from environ in one pass; redone whenever
+ * the shell installs a new environ, so g_env never points into a stale one
+ */
+static void env_scan(void) {
+    memset(&g_env, 0, sizeof(g_env));
+    static const struct {
+        const char* name;
+        const char** value;
+    } vars[] = {
+        { "SHELL_TEST_MODE", &g_env.test_mode },
+        { "SHELL_DEBUG", &g_env.debug },
+        { "SHELL_IO_URING", &g_env.io_uring },
+        { "SHELL_PIPE_GRACE_MS", &g_env.pipe_grace_ms },
+        { "SHELL_POOL", &g_env.pool },
+        { "SHELL_MEMO_TTL", &g_env.memo_ttl },
+        { "SHELL_MEMO_SIZE", &g_env.memo_size },
+        { "SHELL_MEMO_ENV", &g_env.memo_env },
+        { "SHELL_MEMO_FILE", &g_env.memo_file },
+        { "SHELL_CGROUP", &g_env.cgroup },
+        { "SHELL_HISTORY_FILE", &g_env.history_file },
+        { "SHELL_LINE_EDITOR", &g_env.line_editor },
+        { "SHELL_STARTUP_PROFILE", &g_env.startup_profile },
+        { "SHELL_SCRIPT_CACHE", &g_env.script_cache },
+        { "HOME", &g_env.home },
+        { "PATH", &g_env.path },
+    };
+    for (char** env = environ; *env; env++) {
+        const char* entry = *env;
+        // Most variables are rejected on their first byte
+        if (entry[0] != 'S' && entry[0] != 'H' && entry[0] != 'P') continue;
+        const char* eq = strchr(entry, '=');
+        if (!eq) continue;
+        size_t len = eq - entry;
+        for (size_t i = 0; i < sizeof(vars) / sizeof(vars[0]); i++) {
+            if (strncmp(vars[i].name, entry, len) == 0 && vars[i].name[len] == '\0') {
+                *vars[i].value = eq + 1;
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Microseconds between two timestamps
+ */
+static double startup_us(const struct timespec* from, const struct timespec* to) {
+    return (to->tv_sec - from->tv_sec) * 1e6 + (to->tv_nsec - from->tv_nsec) / 1e3;
+}
+
+/**
+ * SHELL_STARTUP_PROFILE: report the time to the first prompt (or, without
+ * prompts, to the first read of input) and how it splits into phases
+ */
+static void startup_report(void) {
+    static const char* const names[STARTUP_PHASES] = {
+        "exec + dynamic linking", "libc init to main", "environment scan",
+        "signal setup", "initialization", "stdio setup"
+    };
+    double phase[STARTUP_PHASES];
+    phase[STARTUP_LOADED] = g_startup_cpu.tv_sec * 1e6 + g_startup_cpu.tv_nsec / 1e3;
+    double total = phase[STARTUP_LOADED];
+    for (int p = STARTUP_MAIN; p < STARTUP_PHASES; p++) {
+        phase[p] = startup_us(&g_startup[p - 1], &g_startup[p]);
+        total += phase[p];
+    }
+    fprintf(stderr, "startup: %.1f us to first prompt\n", total);
+    for (int p = 0; p < STARTUP_PHASES; p++) {
+        fprintf(stderr, "startup:   %-24s %8.1f us\n", names[p], phase[p]);
+    }
+}
+
 /**
  * Setup signal handlers for graceful shutdown
  */
@@ -48,6 +319,69 @@ static void setup_signal_handlers(void) {
     
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
+    
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+}
+
+/**
+ * Route SIGCHLD, SIGINT and SIGTERM through a signalfd watched by the event
+ * loop. Without signalfd the handlers above stay in charge.
+ */
+static void events_init(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    
+    g_event_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (g_event_fd == -1) return;
+    sigprocmask(SIG_BLOCK, &mask, &g_saved_sigmask);
+    g_signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EVENT_SIGNAL };
+    if (g_signal_fd == -1 || epoll_ctl(g_event_fd, EPOLL_CTL_ADD, g_signal_fd, &ev) == -1) {
+        sigprocmask(SIG_SETMASK, &g_saved_sigmask, NULL);
+        if (g_signal_fd != -1) close(g_signal_fd);
+        close(g_event_fd);
+        g_event_fd = g_signal_fd = -1;
+        return;
+    }
+    
+    // Without a timer background jobs still run, only their teardown is lost
+    g_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    ev.data.u64 = EVENT_TIMER;
+    if (g_timer_fd != -1 && epoll_ctl(g_event_fd, EPOLL_CTL_ADD, g_timer_fd, &ev) == -1) {
+        close(g_timer_fd);
+        g_timer_fd = -1;
+    }
+}
+
+static void child_close_fds(void);
+static void path_index_detach(void);
+
+/**
+ * fork() for every child of the shell: the child leaves the event loop,
+ * drops the shell's own descriptors and gets the signal mask back, so
+ * exec'd programs see signals normally
+ */
+static pid_t shell_fork(void) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Close-on-exec is not enough: helpers, relays and built-ins never exec
+        child_close_fds();
+        g_shell_stdin = 0;
+        if (g_event_fd != -1) {
+            close(g_event_fd);
+            close(g_signal_fd);
+            if (g_timer_fd != -1) close(g_timer_fd);
+            g_event_fd = g_signal_fd = g_timer_fd = -1;
+            sigprocmask(SIG_SETMASK, &g_saved_sigmask, NULL);
+        }
+    }
+    return pid;
 }
 
 /**
@@ -65,489 +399,7614 @@ static char* safe_strdup(const char* str) {
     return dup;
 }
 
+/* Bump arena block; blocks are chained only until the next reset */
+typedef struct arena_block {
+    struct arena_block* next;
+    size_t size;
+    size_t used;
+    char data[];
+} arena_block_t;
+
+/* Per-line arena holding all parse and dispatch state of one input line */
+typedef struct {
+    arena_block_t* head;        // Block currently being bumped
+    size_t capacity;            // Sum of all block sizes
+    size_t line_bytes;          // Bytes handed out since the last reset
+    unsigned long line_allocs;  // Allocations served since the last reset
+    unsigned long sys_allocs;   // malloc() calls made by the arena (lifetime)
+} arena_t;
+
+static arena_t g_arena;
+
 /**
- * Trim whitespace from both ends of a string (in-place)
- * @param str String to trim (modified in place)
- * @return Pointer to trimmed string
+ * Allocate zeroed memory from the per-line arena
+ * Memory stays valid until the next arena_reset()
+ * @param size Number of bytes
+ * @return Pointer to memory or NULL on failure
  */
-char* trim(char* str) {
-    if (!str) return NULL;
-    
-    char *end;
-    
-    // Trim leading space
-    while(isspace((unsigned char)*str)) str++;
-    
-    if(*str == 0)  // All spaces?
-        return str;
+static void* arena_alloc(size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    arena_block_t* block = g_arena.head;
     
-    // Trim trailing space
-    end = str + strlen(str) - 1;
-    while(end > str && isspace((unsigned char)*end)) end--;
-    
-    // Write new null terminator character
-    end[1] = '\0';
+    if (!block || block->size - block->used < size) {
+        // Grow geometrically so a long line needs few blocks
+        size_t block_size = block ? block->size * 2 : ARENA_MIN_BLOCK;
+        while (block_size < size) block_size *= 2;
+        
+        block = malloc(sizeof(arena_block_t) + block_size);
+        if (!block) {
+            fprintf(stderr, "Error: Memory allocation failed in arena\n");
+            return NULL;
+        }
+        block->next = g_arena.head;
+        block->size = block_size;
+        block->used = 0;
+        g_arena.head = block;
+        g_arena.capacity += block_size;
+        g_arena.sys_allocs++;
+    }
     
-    return str;
+    void* ptr = block->data + block->used;
+    block->used += size;
+    g_arena.line_bytes += size;
+    g_arena.line_allocs++;
+    memset(ptr, 0, size);
+    return ptr;
 }
 
 /**
- * Parse command line into arguments with quote handling and bounds checking
- * This function properly handles:
- * - Arguments without quotes: ls | grep .zip
- * - Arguments with quotes: ls | grep ".zip"
- * - Arguments with spaces inside quotes: ls | grep ".png .zip"
- * - Error detection for unclosed quotes
- * 
- * @param command Command string to parse
- * @param args Array to store argument pointers
- * @return Number of arguments parsed, or -1 on error, -2 on unclosed quotes
+ * Release everything allocated for the current line
+ * If the line needed several blocks they are merged into a single block
+ * of the combined size, so the next line of similar size needs no malloc
  */
-int parse_args(char* command, char** args) {
-    if (!command || !args) return -1;
-    
-    int argc = 0;
-    char* ptr = command;
-    char* start;
-    
-    // Skip leading whitespace
-    while (*ptr && (*ptr == ' ' || *ptr == '\t' || *ptr == '\n')) {
-        ptr++;
+static void arena_reset(void) {
+    if (g_debug_mode) {
+        fprintf(stderr, "Arena: %lu allocations, %zu bytes, %lu mallocs total, %zu bytes capacity\n",
+                g_arena.line_allocs, g_arena.line_bytes, g_arena.sys_allocs, g_arena.capacity);
     }
     
-    // Parse arguments up to MAX_ARGS (leaving space for NULL terminator)
-    while (*ptr && argc < MAX_ARGS) {
-        start = ptr;
-        
-        // Handle quoted arguments
-        if (*ptr == '"') {
-            ptr++; // Skip opening quote
-            start = ptr; // Start after the quote
-            
-            // Find closing quote
-            while (*ptr && *ptr != '"') {
-                ptr++;
-            }
-            
-            if (*ptr == '"') {
-                *ptr = '\0'; // Null-terminate the argument (remove closing quote)
-                ptr++; // Move past the closing quote
-            } else {
-                // Unclosed quote - this is an error
-                return -2;
-            }
-        } else {
-            // Handle unquoted arguments
-            while (*ptr && *ptr != ' ' && *ptr != '\t' && *ptr != '\n' && *ptr != '"') {
-                ptr++;
-            }
-            
-            if (*ptr) {
-                *ptr = '\0'; // Null-terminate
-                ptr++;
-            }
-        }
-        
-        // Store the argument if it's not empty
-        if (strlen(start) > 0) {
-            args[argc++] = start;
+    arena_block_t* head = g_arena.head;
+    if (head && head->next) {
+        size_t capacity = g_arena.capacity;
+        while (head) {
+            arena_block_t* next = head->next;
+            free(head);
+            head = next;
         }
+        g_arena.head = NULL;
+        g_arena.capacity = 0;
         
-        // Skip whitespace before next argument
-        while (*ptr && (*ptr == ' ' || *ptr == '\t' || *ptr == '\n')) {
-            ptr++;
+        head = malloc(sizeof(arena_block_t) + capacity);
+        if (head) {
+            head->next = NULL;
+            head->size = capacity;
+            g_arena.head = head;
+            g_arena.capacity = capacity;
+            g_arena.sys_allocs++;
         }
     }
     
-    // Check if there are more arguments that couldn't be processed
-    // Skip any remaining whitespace to see if there are more arguments
-    while (*ptr && (*ptr == ' ' || *ptr == '\t' || *ptr == '\n')) {
-        ptr++;
-    }
-    if (*ptr) {
-        // There are more arguments that couldn't be processed - overflow
-        return -1;
-    }
-    
-    args[argc] = NULL;
-    return argc;
+    if (head) head->used = 0;
+    g_arena.line_bytes = 0;
+    g_arena.line_allocs = 0;
 }
 
 /**
- * Execute a single command with proper error handling
- * @param args Null-terminated array of command arguments
- * @return SUCCESS on success, error code on failure
+ * Free the arena completely (shell shutdown)
  */
-int execute_command(char** args) {
-    if (!args || !args[0]) {
-        return ERROR_GENERAL; // Empty command
+static void arena_destroy(void) {
+    while (g_arena.head) {
+        arena_block_t* next = g_arena.head->next;
+        free(g_arena.head);
+        g_arena.head = next;
     }
+    g_arena.capacity = 0;
+}
+
+/**
+ * Grow the most recent arena allocation, in place when it is still at the
+ * top of the current block, otherwise by copying (amortized by doubling)
+ * @param ptr Previous allocation (may be NULL)
+ * @param old_size Size of the previous allocation
+ * @param new_size Requested size
+ * @return Pointer to memory or NULL on failure
+ */
+static void* arena_grow(void* ptr, size_t old_size, size_t new_size) {
+    arena_block_t* block = g_arena.head;
+    size_t old_aligned = (old_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    size_t new_aligned = (new_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
     
-    // Handle built-in commands
-    if (strcmp(args[0], "exit") == 0) {
-        g_shell_running = 0;
-        return SUCCESS;
+    if (ptr && block && (char*)ptr + old_aligned == block->data + block->used &&
+        block->size - block->used >= new_aligned - old_aligned) {
+        memset((char*)ptr + old_size, 0, new_size - old_size);
+        block->used += new_aligned - old_aligned;
+        g_arena.line_bytes += new_aligned - old_aligned;
+        return ptr;
     }
     
-    pid_t pid = fork();
-    if (pid == 0) {
-        // Child process
-        if (execvp(args[0], args) == -1) { 
-            fprintf(stderr, "Error executing '%s': %s\n", args[0], strerror(errno));
-            exit(EXIT_FAILURE);
-        }
-    } else if (pid > 0) {
-        // Parent process
-        int status;
-        if (waitpid(pid, &status, 0) == -1) {
-            perror("waitpid");
-            return ERROR_GENERAL;
-        }
-        return WEXITSTATUS(status);
-    } else {
-        perror("fork");
-        return ERROR_FORK;
-    }
-    return SUCCESS;
+    void* grown = arena_alloc(new_size);
+    if (grown && ptr) memcpy(grown, ptr, old_size);
+    return grown;
 }
 
+/* Token kinds produced by the lexer */
+typedef enum {
+    TOK_WORD,       // Argument, possibly containing "quoted" parts
+    TOK_PIPE,       // |
+    TOK_AMP,        // & (background terminator)
+    TOK_AND,        // && (run the next pipeline if this one succeeded)
+    TOK_OR,         // || (run the next pipeline if this one failed)
+    TOK_SEMI,       // ; (sequential terminator)
+    TOK_REDIR,      // <, >, >>, 2>, 2>> (the next word is the target)
+    TOK_PSUB,       // <( or >( opening a process substitution
+    TOK_RPAREN      // ) closing a process substitution
+} token_kind_t;
+
+/* Token flags */
+#define TOKF_QUOTED 0x01    // Word contains double quotes that must be removed
+#define TOKF_EXPAND 0x02    // Word contains $( ) substitutions, $VAR references or $?
+
+/* A token is a view into the source line: nothing is copied while lexing */
+typedef struct {
+    uint32_t start;
+    uint32_t len;
+    uint8_t kind;
+    uint8_t flags;
+} token_t;
+
+/* Result of lexing one input line */
+typedef struct {
+    const char* text;       // Source line (read-only)
+    token_t* tokens;
+    int num_tokens;
+    int cap;
+} lexed_line_t;
+
+/* Lexer character classes */
+enum { CC_WORD = 0, CC_SPACE, CC_QUOTE, CC_PIPE, CC_AMP, CC_REDIR, CC_RPAREN, CC_DOLLAR, CC_SEMI };
+
+static const unsigned char g_char_class[256] = {
+    [' '] = CC_SPACE, ['\t'] = CC_SPACE, ['\n'] = CC_SPACE,
+    ['\r'] = CC_SPACE, ['\v'] = CC_SPACE, ['\f'] = CC_SPACE,
+    ['"'] = CC_QUOTE, ['|'] = CC_PIPE, ['&'] = CC_AMP,
+    ['<'] = CC_REDIR, ['>'] = CC_REDIR, [')'] = CC_RPAREN, ['$'] = CC_DOLLAR,
+    [';'] = CC_SEMI,
+};
+
+/* Lexer return codes */
+#define LEX_UNCLOSED_QUOTE -2
+#define LEX_UNCLOSED_PAREN -3
+#define LEX_UNCLOSED_SUBST -4
+
 /**
- * Cleanup pipes in case of error
- * @param pipes Array of pipe file descriptors
- * @param num_pipes Number of pipes to clean up
+ * Scalar word scanner: skip plain word characters
+ * @return Pointer to the first special character, or end
  */
-static void cleanup_pipes(int pipes[][2], int num_pipes) {
-    for (int i = 0; i < num_pipes; i++) {
-        if (pipes[i][0] != -1) close(pipes[i][0]);
-        if (pipes[i][1] != -1) close(pipes[i][1]);
-    }
+static const char* scan_word_scalar(const char* p, const char* end) {
+    while (p < end && g_char_class[(unsigned char)*p] == CC_WORD) p++;
+    return p;
 }
 
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
 /**
- * Wait for all valid child processes and handle cleanup
- * @param pids Array of process IDs
- * @param num_processes Number of processes
- * @return SUCCESS or error code
+ * SSE2 word scanner: test 16 bytes per step for any possible delimiter
+ * (bytes <= 0x20, '"', '|', '&', '<', '>', ')', '$', ';') and confirm candidates with the class table
  */
-static int wait_for_children(pid_t* pids, int num_processes) {
-    int exit_status = SUCCESS;
+static const char* scan_word_sse2(const char* p, const char* end) {
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i pipe = _mm_set1_epi8('|');
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i less = _mm_set1_epi8('<');
+    const __m128i greater = _mm_set1_epi8('>');
+    const __m128i paren = _mm_set1_epi8(')');
+    const __m128i dollar = _mm_set1_epi8('$');
+    const __m128i semi = _mm_set1_epi8(';');
     
-    for (int i = 0; i < num_processes; i++) {
-        if (pids[i] > 0) { 
-            int status;
-            if (waitpid(pids[i], &status, 0) == -1) {
-                perror("waitpid");
-                exit_status = ERROR_GENERAL;
-            } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
-                exit_status = ERROR_GENERAL;
-            }
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i hit = _mm_cmpeq_epi8(_mm_max_epu8(v, space), space);
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, quote));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, pipe));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, amp));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, less));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, greater));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, paren));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, dollar));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, semi));
+        
+        unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+        while (mask) {
+            int i = __builtin_ctz(mask);
+            if (g_char_class[(unsigned char)p[i]] != CC_WORD) return p + i;
+            mask &= mask - 1;
         }
+        p += 16;
     }
-    return exit_status;
+    return scan_word_scalar(p, end);
 }
 
 /**
- * Execute commands connected by pipes with robust error handling
- * @param commands Array of command strings
- * @param num_commands Number of commands in pipeline
- * @return SUCCESS on success, error code on failure
+ * AVX2 word scanner: same as the SSE2 version with 32-byte steps
  */
-int execute_pipe(char** commands, int num_commands) {
-    if (!commands || num_commands <= 0) {
-        return ERROR_GENERAL;
-    }
-    
-    // Allocate and initialize arrays
-    int pipes[num_commands - 1][2];
-    pid_t* pids = calloc(num_commands, sizeof(pid_t));
-    char** cmd_copies = calloc(num_commands, sizeof(char*));
+__attribute__((target("avx2")))
+static const char* scan_word_avx2(const char* p, const char* end) {
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i pipe = _mm256_set1_epi8('|');
+    const __m256i amp = _mm256_set1_epi8('&');
+    const __m256i less = _mm256_set1_epi8('<');
+    const __m256i greater = _mm256_set1_epi8('>');
+    const __m256i paren = _mm256_set1_epi8(')');
+    const __m256i dollar = _mm256_set1_epi8('$');
+    const __m256i semi = _mm256_set1_epi8(';');
     
-    if (!pids || !cmd_copies) {
-        fprintf(stderr, "Error: Memory allocation failed\n");
-        free(pids);
-        free(cmd_copies);
-        return ERROR_MEMORY;
-    }
-    
-    // Initialize arrays
-    for (int i = 0; i < num_commands; i++) {
-        pids[i] = -1;
-        if (i < num_commands - 1) {
-            pipes[i][0] = pipes[i][1] = -1;
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        __m256i hit = _mm256_cmpeq_epi8(_mm256_max_epu8(v, space), space);
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, quote));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, pipe));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, amp));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, less));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, greater));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, paren));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, dollar));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, semi));
+        
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        while (mask) {
+            int i = __builtin_ctz(mask);
+            if (g_char_class[(unsigned char)p[i]] != CC_WORD) return p + i;
+            mask &= mask - 1;
         }
+        p += 32;
     }
-    
-    // Create all pipes first
-    for (int i = 0; i < num_commands - 1; i++) {
-        if (pipe(pipes[i]) == -1) {
-            perror("pipe");
-            cleanup_pipes(pipes, i);  
-            goto cleanup_and_exit;
-        }
+    return scan_word_sse2(p, end);
+}
+#endif
+
+static const char* scan_word_resolve(const char* p, const char* end);
+
+/* Word scanner for the running CPU, picked on first use */
+static const char* (*g_scan_word)(const char*, const char*) = scan_word_resolve;
+
+/**
+ * Pick the fastest word scanner supported by the CPU
+ */
+static void lexer_init(void) {
+    g_scan_word = scan_word_scalar;
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+    __builtin_cpu_init();
+    g_scan_word = __builtin_cpu_supports("avx2") ? scan_word_avx2 : scan_word_sse2;
+#endif
+}
+
+/**
+ * Initial scanner: runs the CPU detection on the first word instead of at
+ * startup, then hands over to the selected scanner
+ */
+static const char* scan_word_resolve(const char* p, const char* end) {
+    lexer_init();
+    return g_scan_word(p, end);
+}
+
+/**
+ * Append a token to the lexed line, growing the array geometrically
+ * @return 0 on success, -1 on allocation failure
+ */
+static int lex_emit(lexed_line_t* lex, token_kind_t kind, const char* start, const char* end, int flags) {
+    if (lex->num_tokens == lex->cap) {
+        int cap = lex->cap ? lex->cap * 2 : 32;
+        token_t* grown = arena_grow(lex->tokens, lex->cap * sizeof(token_t), cap * sizeof(token_t));
+        if (!grown) return -1;
+        lex->tokens = grown;
+        lex->cap = cap;
     }
-    
-    // Create copies of command strings for parsing
-    for (int i = 0; i < num_commands; i++) {
-        cmd_copies[i] = safe_strdup(commands[i]);
-        if (!cmd_copies[i]) {
-            goto cleanup_and_exit;
+    token_t* tok = &lex->tokens[lex->num_tokens++];
+    tok->start = (uint32_t)(start - lex->text);
+    tok->len = (uint32_t)(end - start);
+    tok->kind = (uint8_t)kind;
+    tok->flags = (uint8_t)flags;
+    return 0;
+}
+
+/**
+ * Check whether a character can start a variable name
+ */
+static inline int is_name_start(char c) {
+    return isalpha((unsigned char)c) || c == '_';
+}
+
+/**
+ * Find the ')' closing a $( ) command substitution. Nested parentheses
+ * are balanced and double-quoted text is skipped, so the inner command
+ * may contain pipes, quotes and further substitutions
+ * @param p Pointer just past the "$("
+ * @param end End of the line
+ * @return Pointer just past the closing ')', or NULL if it is missing
+ */
+static const char* lex_subst_end(const char* p, const char* end) {
+    int depth = 1;
+    int quoted = 0;
+    while (p < end) {
+        char c = *p++;
+        if (c == '"') {
+            quoted = !quoted;
+        } else if (!quoted) {
+            if (c == '(') depth++;
+            else if (c == ')' && --depth == 0) return p;
         }
     }
+    return NULL;
+}
+
+/**
+ * Single-pass lexer: split a line into words and operators in one scan.
+ * The source is never modified; tokens are (offset, length) views and
+ * quote removal is deferred until an argument is materialized. Adjacent
+ * quoted and unquoted parts form one word, as in bash: a"b c"d -> ab cd
+ * 
+ * @param text Input line
+ * @param len Length of the line
+ * @param lex Output token array (arena backed)
+ * @return Number of tokens, -1 on allocation failure, LEX_UNCLOSED_QUOTE on unclosed
+ *         quotes, LEX_UNCLOSED_PAREN on an unterminated <( or >(, LEX_UNCLOSED_SUBST
+ *         on an unterminated $(
+ */
+static int lex_line(const char* text, size_t len, lexed_line_t* lex) {
+    const char* p = text;
+    const char* end = text + len;
+    int depth = 0;          // Open process substitutions; ')' is plain text outside them
     
-    // Create child processes
-    for (int i = 0; i < num_commands; i++) {
-        pids[i] = fork();
-        
-        if (pids[i] == -1) {
-            perror("fork");
-            goto cleanup_and_exit;
+    memset(lex, 0, sizeof(*lex));
+    lex->text = text;
+    
+    while (p < end) {
+        switch (g_char_class[(unsigned char)*p]) {
+        case CC_SPACE:
+            p++;
+            break;
+        case CC_PIPE:
+        case CC_AMP: {
+            // '|' and '&' doubled are the list operators || and &&
+            int twice = p + 1 < end && p[1] == *p;
+            token_kind_t kind = *p == '|' ? (twice ? TOK_OR : TOK_PIPE) : (twice ? TOK_AND : TOK_AMP);
+            if (lex_emit(lex, kind, p, p + 1 + twice, 0) == -1) return -1;
+            p += 1 + twice;
+            break;
         }
-        
-        if (pids[i] == 0) {
-            // Child process i
-            char* args[MAX_ARGS];
-            
-            // Parse the command arguments
-            int parse_result = parse_args(cmd_copies[i], args);
-            if (parse_result <= 0) {
-                if (parse_result == -1) {
-                    fprintf(stderr, "Error: Too many arguments in command '%s' (maximum %d)\n", cmd_copies[i], MAX_ARGS);
-                } else if (parse_result == -2) {
-                    fprintf(stderr, "Error: Unclosed quotes in command '%s'\n", cmd_copies[i]);
-                } else {
-                    fprintf(stderr, "Error: Invalid command '%s'\n", cmd_copies[i]); // if this is reached, there is an error in the command (I hope xD)
-                }
-                exit(EXIT_FAILURE);
+        case CC_SEMI:
+            if (lex_emit(lex, TOK_SEMI, p, p + 1, 0) == -1) return -1;
+            p++;
+            break;
+        case CC_REDIR: {
+            const char* start = p++;
+            if (p < end && *p == '(') {
+                p++;
+                depth++;
+                if (lex_emit(lex, TOK_PSUB, start, p, 0) == -1) return -1;
+                break;
             }
-            
-            // Handle built-in commands in pipeline
-            if (strcmp(args[0], "exit") == 0) {
-                // Exit command in pipeline - just exit silently
-                exit(EXIT_SUCCESS);
+            if (*start == '>' && p < end && *p == '>') p++;
+            if (lex_emit(lex, TOK_REDIR, start, p, 0) == -1) return -1;
+            break;
+        }
+        case CC_RPAREN:
+            if (depth > 0) {
+                depth--;
+                if (lex_emit(lex, TOK_RPAREN, p, p + 1, 0) == -1) return -1;
+                p++;
+                break;
             }
-            
-            // Set up pipes for this command
-            if (i > 0) {
-                // Not the first command: read from previous pipe
-                if (dup2(pipes[i-1][0], STDIN_FILENO) == -1) {
-                    perror("dup2 stdin");
-                    exit(EXIT_FAILURE);
+            // A plain ')' starts a word
+            __attribute__((fallthrough));
+        default: {
+            const char* start = p;
+            int flags = 0;
+            for (;;) {
+                p = g_scan_word(p, end);
+                if (p < end && *p == '"') {
+                    const char* close = memchr(p + 1, '"', end - p - 1);
+                    if (!close) return LEX_UNCLOSED_QUOTE;
+                    if (memchr(p + 1, '$', close - p - 1)) {
+                        // A quoted $( ) may itself contain quotes
+                        close = p + 1;
+                        while (close < end && *close != '"') {
+                            if (*close == '$' && close + 1 < end && close[1] == '(') {
+                                close = lex_subst_end(close + 2, end);
+                                if (!close) return LEX_UNCLOSED_SUBST;
+                                flags |= TOKF_EXPAND;
+                            } else {
+                                close++;
+                                if (close[-1] == '$' && close < end &&
+                                    (*close == '{' || *close == '?' || is_name_start(*close))) {
+                                    flags |= TOKF_EXPAND;
+                                }
+                            }
+                        }
+                        if (close == end) return LEX_UNCLOSED_QUOTE;
+                    }
+                    flags |= TOKF_QUOTED;
+                    p = close + 1;
+                    continue;
                 }
-            }
-            
-            if (i < num_commands - 1) {
-                // Not the last command: write to next pipe
-                if (dup2(pipes[i][1], STDOUT_FILENO) == -1) {
-                    perror("dup2 stdout");
-                    exit(EXIT_FAILURE);
+                if (p < end && *p == '$') {
+                    if (p + 1 < end && p[1] == '(') {
+                        p = lex_subst_end(p + 2, end);
+                        if (!p) return LEX_UNCLOSED_SUBST;
+                        flags |= TOKF_EXPAND;
+                    } else {
+                        p++;
+                        if (p < end && (*p == '{' || *p == '?' || is_name_start(*p))) flags |= TOKF_EXPAND;
+                    }
+                    continue;
                 }
+                if (p < end && *p == ')' && depth == 0) {
+                    p++;
+                    continue;
+                }
+                break;
             }
-            
-            // Close all pipe ends in child
-            for (int j = 0; j < num_commands - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
-            }
-            
-            // For long pipelines, disable buffering to improve flow
-            if (num_commands > 10) {
-                setvbuf(stdout, NULL, _IONBF, 0);
-                setvbuf(stdin, NULL, _IONBF, 0);
-            }
-            
-            // Execute the command
-            if (execvp(args[0], args) == -1) {
-                fprintf(stderr, "Error executing '%s': %s\n", args[0], strerror(errno));
-                exit(EXIT_FAILURE);
+            // A bare '2' glued to '>' selects stderr: 2> and 2>>
+            if (p < end && *p == '>' && p - start == 1 && *start == '2') {
+                p++;
+                if (p < end && *p == '>') p++;
+                if (lex_emit(lex, TOK_REDIR, start, p, 0) == -1) return -1;
+                break;
             }
+            if (lex_emit(lex, TOK_WORD, start, p, flags) == -1) return -1;
+            break;
         }
-        
-        // In parent: close pipes that are no longer needed as we create processes
-        // This ensures proper data flow in long pipelines
-        if (i > 0) {
-            // Close the read end of the previous pipe since the current process is now reading from it
-            close(pipes[i-1][0]);
-        }
-        if (i < num_commands - 1) {
-            // Close the write end of the current pipe since the current process is now writing to it
-            close(pipes[i][1]);
         }
     }
-    
-    // Parent process: close any remaining pipe ends
-    for (int i = 0; i < num_commands - 1; i++) {
-        if (pipes[i][0] != -1) close(pipes[i][0]);
-        if (pipes[i][1] != -1) close(pipes[i][1]);
-    }
-    
-    // Wait for all children
-    int result = wait_for_children(pids, num_commands);
-    
-    cleanup_and_exit:
-    // Cleanup
-    if (cmd_copies) {
-        for (int i = 0; i < num_commands; i++) {
-            free(cmd_copies[i]);
-        }
-        free(cmd_copies);
+    if (depth > 0) {
+        return LEX_UNCLOSED_PAREN;
     }
-    free(pids);
-    
-    return result;
+    return lex->num_tokens;
 }
 
 /**
- * Parse a full command line into separate commands divided by pipes
- * @param line Input command line
- * @param commands Array to store command strings
- * @return Number of commands found, or -1 on error
+ * Materialize a word token as a NUL-terminated argument, removing quote
+ * characters
+ * @param dest Destination with room for at least tok->len + 1 bytes
+ * @return Pointer just past the terminating NUL
  */
-int parse_pipe_commands(char* line, char** commands) {
-    if (!line || !commands) return -1;
-    
-    int num_commands = 0;
-    char* start = line;
-    char* ptr = line;
-    int in_quotes = 0;
+static char* token_copy_arg(const lexed_line_t* lex, const token_t* tok, char* dest) {
+    const char* src = lex->text + tok->start;
     
-    while (*ptr && num_commands < MAX_COMMANDS - 1) {
-        if (*ptr == '"' && (ptr == line || *(ptr-1) != '\\')) {
-            in_quotes = !in_quotes;
-        } else if (*ptr == '|' && !in_quotes) {
-            // Found a pipe separator outside of quotes
-            *ptr = '\0';  // Null-terminate the current command
-            commands[num_commands] = trim(start);
-            
-            // Debug output if SHELL_DEBUG is set
-            if (getenv("SHELL_DEBUG")) {
-                printf("Command %d: %s\n", num_commands, commands[num_commands]);
-                fflush(stdout);
-            }
-            
-            num_commands++;
-            start = ptr + 1;  // Start of next command
+    if (!(tok->flags & TOKF_QUOTED)) {
+        memcpy(dest, src, tok->len);
+        dest += tok->len;
+    } else {
+        for (uint32_t i = 0; i < tok->len; i++) {
+            if (src[i] != '"') *dest++ = src[i];
         }
-        ptr++;
     }
-    
-    // Add the last command
-    if (start && num_commands < MAX_COMMANDS - 1) {
-        commands[num_commands] = trim(start);
-        
-        // Debug output if SHELL_DEBUG is set
-        if (getenv("SHELL_DEBUG")) {
-            printf("Command %d: %s\n", num_commands, commands[num_commands]);
-            fflush(stdout);
+    *dest++ = '\0';
+    return dest;
+}
+
+/**
+ * Seconds elapsed between two monotonic timestamps
+ */
+static double timespec_elapsed(const struct timespec* start, const struct timespec* end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * Advance a timestamp by a number of milliseconds
+ */
+static void timespec_add_ms(struct timespec* ts, long ms) {
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/**
+ * Convert a wait status into a shell exit status (128+N for signals)
+ */
+static int status_to_exit_code(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return ERROR_GENERAL;
+}
+
+/* Per-stage rlimits from the 'limit' prefix, applied in the child before exec */
+typedef struct {
+    rlim_t cpu;             // RLIMIT_CPU seconds (-t), RLIM_INFINITY if unset
+    rlim_t as;              // RLIMIT_AS bytes (-v)
+    rlim_t nofile;          // RLIMIT_NOFILE (-n)
+    int cgroup_procs;       // cgroup.procs of the job cgroup to join, or -1
+} stage_limits_t;
+
+/* Placement and scheduling of one stage from the 'sched' prefix or 'pin' */
+typedef struct {
+    int has_cpus;           // cpus is set (-C, -M or automatic placement)
+    cpu_set_t cpus;
+    int node;               // NUMA node for memory (-M), -1 if unset
+    int nice;               // setpriority() value (-n), INT_MIN if unset
+    int policy;             // SCHED_BATCH (-b) or SCHED_IDLE (-i), -1 if unset
+    int ioprio;             // ioprio_set() value (-I), -1 if unset
+} stage_sched_t;
+
+/* Job-wide cgroup v2 limits from 'limit' prefixes, 0 where unset */
+typedef struct {
+    int requested;          // Some stage carried a 'limit' prefix
+    unsigned long long memory_max;  // memory.max bytes (-m)
+    int cpu_percent;        // cpu.max as a percentage of one CPU (-c)
+    unsigned long long pids_max;    // pids.max (-p)
+} job_limits_t;
+
+static char g_cgroup_base[PATH_MAX];    // Parent of the job cgroups (SHELL_CGROUP)
+static int g_cgroup_controllers = 0;    // CGROUP_* enabled for the job cgroups
+static unsigned long g_cgroup_seq = 0;
+
+#define CGROUP_MEMORY 1
+#define CGROUP_CPU 2
+#define CGROUP_PIDS 4
+
+/**
+ * Write a value to a cgroup interface file
+ * @return 0 on success, -1 with errno set on failure
+ */
+static int cgroup_write(const char* dir, const char* file, const char* value) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    ssize_t n = write(fd, value, strlen(value));
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return n == (ssize_t)strlen(value) ? 0 : -1;
+}
+
+/**
+ * Read a cgroup interface file into a NUL-terminated buffer
+ * @return Number of bytes read, or -1 if the file is missing
+ */
+static ssize_t cgroup_read(const char* dir, const char* file, char* buf, size_t size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    buf[n > 0 ? n : 0] = '\0';
+    return n;
+}
+
+/**
+ * Locate the cgroup v2 directory job cgroups are created under, and enable
+ * the memory, cpu and pids controllers for them where the kernel allows it.
+ * Defaults to the shell's own cgroup on the cgroup2 mount; SHELL_CGROUP
+ * names a delegated directory instead.
+ * @return Non-zero if job cgroups can be created
+ */
+static int cgroup_init(void) {
+    static int state = 0;   // 0 unknown, 1 ready, -1 unavailable
+    if (state) return state == 1;
+    state = -1;
+    
+    const char* base = g_env.cgroup;
+    if (base && *base) {
+        snprintf(g_cgroup_base, sizeof(g_cgroup_base), "%s", base);
+    } else {
+        // cgroup2 mount point from mountinfo, own path from the "0::" line
+        char mount[PATH_MAX] = "", own[PATH_MAX] = "", line[4096];
+        FILE* f = fopen("/proc/self/mountinfo", "re");
+        while (f && fgets(line, sizeof(line), f)) {
+            char point[PATH_MAX];
+            const char* sep = strstr(line, " - cgroup2 ");
+            if (sep && sscanf(line, "%*s %*s %*s %*s %4095s", point) == 1) {
+                snprintf(mount, sizeof(mount), "%s", point);
+                break;
+            }
+        }
+        if (f) fclose(f);
+        f = fopen("/proc/self/cgroup", "re");
+        while (f && fgets(line, sizeof(line), f)) {
+            if (strncmp(line, "0::", 3) == 0) {
+                line[strcspn(line, "\n")] = '\0';
+                snprintf(own, sizeof(own), "%s", strcmp(line + 3, "/") ? line + 3 : "");
+                break;
+            }
+        }
+        if (f) fclose(f);
+        if (!*mount || strlen(mount) + strlen(own) >= sizeof(g_cgroup_base)) return 0;
+        memcpy(g_cgroup_base, mount, strlen(mount));
+        memcpy(g_cgroup_base + strlen(mount), own, strlen(own) + 1);
+    }
+    if (access(g_cgroup_base, W_OK) == -1) return 0;
+    
+    // A controller may be missing or refused (processes in a non-root
+    // cgroup); job cgroups then still provide the usage report
+    static const struct { const char* name; int flag; } controllers[] = {
+        { "memory", CGROUP_MEMORY }, { "cpu", CGROUP_CPU }, { "pids", CGROUP_PIDS },
+    };
+    char enabled[256];
+    for (size_t i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++) {
+        char change[32];
+        snprintf(change, sizeof(change), "+%s", controllers[i].name);
+        cgroup_write(g_cgroup_base, "cgroup.subtree_control", change);
+    }
+    if (cgroup_read(g_cgroup_base, "cgroup.subtree_control", enabled, sizeof(enabled)) >= 0) {
+        for (char* word = strtok(enabled, " \n"); word; word = strtok(NULL, " \n")) {
+            for (size_t i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++) {
+                if (strcmp(word, controllers[i].name) == 0) g_cgroup_controllers |= controllers[i].flag;
+            }
+        }
+    }
+    state = 1;
+    return 1;
+}
+
+/**
+ * Create the cgroup of one job and set its limits
+ * Limits whose controller is unavailable are reported and skipped.
+ * @param limits Job-wide limits
+ * @param procs Output: cgroup.procs descriptor children write themselves to, or -1
+ * @return Path of the new cgroup (malloc'ed), or NULL without cgroup support
+ */
+static char* cgroup_create(const job_limits_t* limits, int* procs) {
+    *procs = -1;
+    if (!cgroup_init()) {
+        if (limits->memory_max || limits->cpu_percent || limits->pids_max) {
+            fprintf(stderr, "limit: no writable cgroup v2 hierarchy, -m/-c/-p not applied\n");
+        }
+        return NULL;
+    }
+    
+    char path[PATH_MAX + 64];
+    snprintf(path, sizeof(path), "%s/shell-%d-job%lu", g_cgroup_base, (int)getpid(), ++g_cgroup_seq);
+    if (mkdir(path, 0755) == -1) {
+        fprintf(stderr, "limit: cannot create cgroup '%s': %s\n", path, strerror(errno));
+        return NULL;
+    }
+    
+    char value[64];
+    char missing[32] = "";
+    if (limits->memory_max) {
+        snprintf(value, sizeof(value), "%llu", limits->memory_max);
+        if (!(g_cgroup_controllers & CGROUP_MEMORY) || cgroup_write(path, "memory.max", value) == -1) {
+            strcat(missing, " -m");
+        } else {
+            cgroup_write(path, "memory.swap.max", "0");
+        }
+    }
+    if (limits->cpu_percent) {
+        snprintf(value, sizeof(value), "%llu %d",
+                 (unsigned long long)limits->cpu_percent * CGROUP_CPU_PERIOD / 100, CGROUP_CPU_PERIOD);
+        if (!(g_cgroup_controllers & CGROUP_CPU) || cgroup_write(path, "cpu.max", value) == -1) {
+            strcat(missing, " -c");
+        }
+    }
+    if (limits->pids_max) {
+        snprintf(value, sizeof(value), "%llu", limits->pids_max);
+        if (!(g_cgroup_controllers & CGROUP_PIDS) || cgroup_write(path, "pids.max", value) == -1) {
+            strcat(missing, " -p");
+        }
+    }
+    if (*missing) {
+        fprintf(stderr, "limit: controller not enabled under %s,%s not applied\n",
+                g_cgroup_base, missing);
+    }
+    
+    char procs_path[PATH_MAX + 80];
+    snprintf(procs_path, sizeof(procs_path), "%s/cgroup.procs", path);
+    *procs = open(procs_path, O_WRONLY | O_CLOEXEC);
+    return strdup(path);
+}
+
+/**
+ * Look up one "key value" line of a flat-keyed cgroup file
+ * @return The value, or -1 if the key is not present
+ */
+static long long cgroup_stat(const char* text, const char* key) {
+    size_t len = strlen(key);
+    for (const char* p = text; p && *p; p = strchr(p, '\n'), p = p ? p + 1 : NULL) {
+        if (strncmp(p, key, len) == 0 && p[len] == ' ') return strtoll(p + len + 1, NULL, 10);
+    }
+    return -1;
+}
+
+/**
+ * Report the usage of a finished job from its cgroup, then remove the cgroup
+ * @param path Job cgroup (freed here), NULL for none
+ * @param label Command text of the job
+ * @param label_len Length of the command text
+ */
+static void cgroup_finish(char* path, const char* label, int label_len) {
+    if (!path) return;
+    
+    // Only counters the kernel actually provides are shown
+    char buf[4096];
+    int fields = 0;
+    fprintf(stderr, "limit: %.*s:", label_len, label);
+    if (cgroup_read(path, "cpu.stat", buf, sizeof(buf)) > 0) {
+        long long usage = cgroup_stat(buf, "usage_usec");
+        long long user = cgroup_stat(buf, "user_usec");
+        long long sys = cgroup_stat(buf, "system_usec");
+        long long throttled = cgroup_stat(buf, "nr_throttled");
+        long long throttled_usec = cgroup_stat(buf, "throttled_usec");
+        if (usage >= 0) {
+            fprintf(stderr, "%scpu %.3fs", fields++ ? ", " : " ", usage / 1e6);
+            if (user >= 0 && sys >= 0) fprintf(stderr, " (user %.3fs, sys %.3fs)", user / 1e6, sys / 1e6);
+        }
+        if (throttled > 0) {
+            fprintf(stderr, "%sthrottled %lld times", fields++ ? ", " : " ", throttled);
+            if (throttled_usec >= 0) fprintf(stderr, " for %.3fs", throttled_usec / 1e6);
+        }
+    }
+    if (cgroup_read(path, "memory.peak", buf, sizeof(buf)) > 0) {
+        fprintf(stderr, "%smemory peak %llu KiB", fields++ ? ", " : " ", strtoull(buf, NULL, 10) / 1024);
+    }
+    long long oom = cgroup_read(path, "memory.events", buf, sizeof(buf)) > 0 ? cgroup_stat(buf, "oom_kill") : -1;
+    if (oom >= 0) {
+        fprintf(stderr, "%s%lld OOM kills", fields++ ? ", " : " ", oom);
+    }
+    if (cgroup_read(path, "pids.peak", buf, sizeof(buf)) > 0) {
+        fprintf(stderr, "%spids peak %llu", fields++ ? ", " : " ", strtoull(buf, NULL, 10));
+    }
+    fprintf(stderr, "%s\n", fields ? "" : " no usage statistics available");
+    
+    if (rmdir(path) == -1 && g_debug_mode) {
+        fprintf(stderr, "limit: cannot remove cgroup '%s': %s\n", path, strerror(errno));
+    }
+    free(path);
+}
+
+/**
+ * Parse a CPU list such as "0-3,8" (the sysfs cpulist format)
+ * @return 0 on success, -1 if the list is malformed or empty
+ */
+static int parse_cpu_list(const char* text, cpu_set_t* set) {
+    CPU_ZERO(set);
+    const char* p = text;
+    while (*p && *p != '\n') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0) return -1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) return -1;
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        p = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',' && *end != '\n') return -1;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+/**
+ * First CPU sharing the cache of the given level with cpu, or cpu itself
+ * when sysfs does not describe that level
+ */
+static int cpu_cache_leader(int cpu, int level) {
+    char dir[96], buf[256];
+    for (int index = 0; index < CPU_CACHE_LEVELS; index++) {
+        snprintf(dir, sizeof(dir), "/sys/devices/system/cpu/cpu%d/cache/index%d", cpu, index);
+        if (cgroup_read(dir, "level", buf, sizeof(buf)) <= 0) break;
+        if (atoi(buf) != level) continue;
+        if (cgroup_read(dir, "shared_cpu_list", buf, sizeof(buf)) > 0) return atoi(buf);
+    }
+    return cpu;
+}
+
+/**
+ * CPUs the shell may run on, ordered so that neighbours share a cache:
+ * grouped by L3 domain, then by L2 (SMT siblings / cluster), then by number.
+ * Read from sysfs once.
+ * @param count Output: number of CPUs in the order
+ * @return The order, or NULL if the affinity mask is unavailable
+ */
+static const int* cpu_placement_order(int* count) {
+    static int* order = NULL;
+    static int num_cpus = 0;
+    if (order) {
+        *count = num_cpus;
+        return order;
+    }
+    
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) return NULL;
+    num_cpus = CPU_COUNT(&allowed);
+    order = malloc(num_cpus * sizeof(int));
+    long* keys = malloc(num_cpus * sizeof(long));
+    if (!order || !keys) {
+        free(order);
+        free(keys);
+        order = NULL;
+        return NULL;
+    }
+    
+    int n = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && n < num_cpus; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        long key = ((long)cpu_cache_leader(cpu, 3) << 32) | ((long)cpu_cache_leader(cpu, 2) << 16) | cpu;
+        // Insertion sort: a few hundred CPUs at most, done once
+        int j = n++;
+        while (j > 0 && keys[j - 1] > key) {
+            keys[j] = keys[j - 1];
+            order[j] = order[j - 1];
+            j--;
+        }
+        keys[j] = key;
+        order[j] = cpu;
+    }
+    free(keys);
+    *count = num_cpus;
+    return order;
+}
+
+/**
+ * Child side of 'sched' and 'pin': affinity, NUMA memory node, nice value,
+ * scheduling class and I/O priority, installed before exec
+ */
+static void apply_stage_sched(const stage_sched_t* sched) {
+    if (!sched) return;
+    if (sched->has_cpus && sched_setaffinity(0, sizeof(sched->cpus), &sched->cpus) == -1) {
+        perror("sched: sched_setaffinity");
+    }
+    if (sched->node >= 0) {
+        unsigned long mask[16] = { 0 };
+        if (sched->node < (int)(sizeof(mask) * 8)) {
+            mask[sched->node / (8 * sizeof(long))] |= 1UL << (sched->node % (8 * sizeof(long)));
+        }
+        if (syscall(SYS_set_mempolicy, SHELL_MPOL_BIND, mask, sizeof(mask) * 8) == -1) {
+            perror("sched: set_mempolicy");
+        }
+    }
+    if (sched->nice != INT_MIN && setpriority(PRIO_PROCESS, 0, sched->nice) == -1) {
+        perror("sched: setpriority");
+    }
+    if (sched->policy != -1) {
+        struct sched_param param = { 0 };
+        if (sched_setscheduler(0, sched->policy, &param) == -1) {
+            perror("sched: sched_setscheduler");
+        }
+    }
+    if (sched->ioprio != -1 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, sched->ioprio) == -1) {
+        perror("sched: ioprio_set");
+    }
+}
+
+/**
+ * Child side of 'limit': join the job cgroup and install the rlimits
+ * Runs after fork and before exec, so only the new process is affected.
+ */
+static void apply_stage_limits(const stage_limits_t* limits) {
+    if (!limits) return;
+    if (limits->cgroup_procs != -1 && write(limits->cgroup_procs, "0", 1) != 1) {
+        perror("limit: cgroup.procs");
+    }
+    
+    struct { int resource; rlim_t value; } rlimits[] = {
+        { RLIMIT_CPU, limits->cpu }, { RLIMIT_AS, limits->as }, { RLIMIT_NOFILE, limits->nofile },
+    };
+    for (size_t i = 0; i < sizeof(rlimits) / sizeof(rlimits[0]); i++) {
+        if (rlimits[i].value == RLIM_INFINITY) continue;
+        struct rlimit rl = { rlimits[i].value, rlimits[i].value };
+        if (setrlimit(rlimits[i].resource, &rl) == -1) {
+            perror("limit: setrlimit");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * Open a pidfd for a child, or -1 if the kernel does not support it
+ */
+static int pidfd_open_child(pid_t pid) {
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+}
+
+/**
+ * Stop watching one stage of a job. The pidfd is removed from the epoll set
+ * explicitly: a copy held by another process would keep it registered.
+ */
+static void job_close_pidfd(job_t* job, int index) {
+    if (job->pidfds[index] == -1) return;
+    if (g_event_fd != -1) epoll_ctl(g_event_fd, EPOLL_CTL_DEL, job->pidfds[index], NULL);
+    close(job->pidfds[index]);
+    job->pidfds[index] = -1;
+}
+
+/**
+ * Release a job table slot, reporting and removing its cgroup
+ */
+static void job_free(job_t* job) {
+    if (job->cgroup) cgroup_finish(job->cgroup, job->command, (int)strlen(job->command));
+    for (int j = 0; job->pidfds && j < job->num_pids; j++) {
+        job_close_pidfd(job, j);
+    }
+    free(job->pidfds);
+    free(job->pids);
+    free(job->command);
+    free(job->times);
+    memset(job, 0, sizeof(*job));
+}
+
+/**
+ * Register a launched pipeline in the job table
+ * @param pids Stage pids followed by helper pids (copied into the job table)
+ * @param num_pids Number of pids
+ * @param num_stages Number of stages at the front of pids
+ * @param command Command text shown by 'jobs'
+ * @param command_len Length of the command text
+ * @return The new job, or NULL if the table is full
+ */
+static job_t* job_add(pid_t* pids, int num_pids, int num_stages, const char* command, int command_len) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        job_t* job = &g_jobs[i];
+        if (job->state != JOB_FREE) continue;
+        
+        job->command = strndup(command, command_len);
+        job->pids = malloc(num_pids * sizeof(pid_t));
+        job->pidfds = malloc(num_pids * sizeof(int));
+        job->num_pids = num_pids;
+        if (!job->command || !job->pids || !job->pidfds) {
+            free(job->pidfds);
+            job->pidfds = NULL;
+            job_free(job);
+            return NULL;
+        }
+        memcpy(job->pids, pids, num_pids * sizeof(pid_t));
+        job->id = i + 1;
+        job->state = JOB_RUNNING;
+        job->num_pids = num_pids;
+        job->num_stages = num_stages;
+        job->remaining = 0;
+        job->exit_status = SUCCESS;
+        for (int j = 0; j < num_pids; j++) {
+            job->pidfds[j] = -1;
+            if (job->pids[j] <= 0) continue;
+            job->remaining++;
+            
+            // Each stage exit wakes the event loop, which reaps just that pid
+            if (g_event_fd != -1 && (job->pidfds[j] = pidfd_open_child(job->pids[j])) != -1) {
+                struct epoll_event ev = { .events = EPOLLIN, .data.u64 = ((uint64_t)i << 32) | j };
+                epoll_ctl(g_event_fd, EPOLL_CTL_ADD, job->pidfds[j], &ev);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &job->start);
+        if (job->remaining == 0) {
+            job->state = JOB_DONE;
+            job->end = job->start;
+        }
+        return job;
+    }
+    return NULL;
+}
+
+/**
+ * Point the teardown timer at the earliest deadline of any job
+ */
+static void jobs_arm_timer(void) {
+    if (g_timer_fd == -1) return;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));   // Zero disarms
+    for (int i = 0; i < MAX_JOBS; i++) {
+        const job_t* job = &g_jobs[i];
+        if (job->state != JOB_RUNNING || !job->armed) continue;
+        if ((its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) ||
+            timespec_elapsed(&job->deadline, &its.it_value) > 0) {
+            its.it_value = job->deadline;
+        }
+    }
+    timerfd_settime(g_timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void teardown_producers(const pid_t* pids, int cut, int sig);
+
+/**
+ * Teardown timer expired: every job whose orphaned producers outlived
+ * their grace gets the next signal, as in wait_for_children
+ */
+static void jobs_teardown(void) {
+    uint64_t expirations;
+    if (read(g_timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < MAX_JOBS; i++) {
+        job_t* job = &g_jobs[i];
+        if (job->state != JOB_RUNNING || !job->armed || timespec_elapsed(&now, &job->deadline) > 0) continue;
+        job->teardown++;
+        teardown_producers(job->pids, job->cut, job->teardown == 1 ? SIGTERM : SIGKILL);
+        job->armed = job->teardown < 2;
+        job->deadline = now;
+        timespec_add_ms(&job->deadline, (long)g_pipe_grace_ms * PIPE_KILL_FACTOR);
+    }
+    jobs_arm_timer();
+}
+
+/**
+ * Record the termination of one stage of a job
+ * @param job Job owning the stage
+ * @param index Stage index
+ * @param status Wait status returned by waitpid
+ */
+static void job_note_exit(job_t* job, int index, int status) {
+    job->pids[index] = -1;
+    job_close_pidfd(job, index);
+    if (index == job->num_stages - 1) {
+        job->exit_status = status_to_exit_code(status);
+    }
+    
+    // Stages upstream of an exited one lost their reader: the same grace,
+    // SIGTERM, SIGKILL sequence as in a foreground pipeline
+    if (index < job->num_stages && index > job->cut) {
+        job->cut = index;
+        for (int j = 0; !job->armed && job->teardown == 0 && g_pipe_grace_ms >= 0 && j < job->cut; j++) {
+            if (job->pids[j] <= 0) continue;
+            clock_gettime(CLOCK_MONOTONIC, &job->deadline);
+            timespec_add_ms(&job->deadline, g_pipe_grace_ms);
+            job->armed = 1;
+            jobs_arm_timer();
+        }
+    }
+    if (--job->remaining == 0) {
+        job->state = JOB_DONE;
+        clock_gettime(CLOCK_MONOTONIC, &job->end);
+    }
+}
+
+/**
+ * waitpid() for one pid of a job; a timed job's stages are accounted
+ * @return As waitpid
+ */
+static pid_t job_waitpid(job_t* job, int index, int* status, int options) {
+    struct rusage usage;
+    pid_t r = wait4(job->pids[index], status, options, &usage);
+    if (r > 0 && job->times && index < job->num_stages) {
+        clock_gettime(CLOCK_MONOTONIC, &job->times[index].stats.end);
+        job->times[index].stats.usage = usage;
+        job->times[index].stats.status = *status;
+    }
+    return r;
+}
+
+/**
+ * Non-blocking reaper for background jobs, run from the main loop
+ * after SIGCHLD. Only the pids owned by jobs are polled so foreground
+ * pipelines keep exclusive control over their own children.
+ */
+static void jobs_reap(void) {
+    g_sigchld_pending = 0;
+    
+    for (int i = 0; i < MAX_JOBS; i++) {
+        job_t* job = &g_jobs[i];
+        if (job->state != JOB_RUNNING) continue;
+        
+        for (int j = 0; j < job->num_pids; j++) {
+            if (job->pids[j] <= 0) continue;
+            
+            int status;
+            pid_t r = job_waitpid(job, j, &status, WNOHANG);
+            if (r == job->pids[j]) {
+                job_note_exit(job, j, status);
+            } else if (r == -1 && errno == ECHILD) {
+                job_note_exit(job, j, 0);
+            }
+        }
+    }
+}
+
+/**
+ * Handle pending shell events: SIGINT/SIGTERM shut the shell down, SIGCHLD
+ * and job pidfds collect background stages in completion order, the
+ * timerfd tears down their orphaned producers
+ * @param timeout_ms How long to wait for a first event (0 polls, -1 blocks)
+ */
+static void events_dispatch(int timeout_ms) {
+    if (g_event_fd == -1) {
+        if (g_sigchld_pending) jobs_reap();
+        return;
+    }
+    
+    struct epoll_event events[16];
+    int n = epoll_wait(g_event_fd, events, 16, timeout_ms);
+    for (int e = 0; e < n; e++) {
+        uint64_t tag = events[e].data.u64;
+        if (tag == EVENT_TIMER) {
+            jobs_teardown();
+            continue;
+        }
+        if (tag == EVENT_SIGNAL) {
+            struct signalfd_siginfo info;
+            while (read(g_signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo == SIGCHLD) {
+                    jobs_reap(); // Stages without a pidfd
+                } else if (g_shell_running) {
+                    g_shell_running = 0;
+                    write(STDOUT_FILENO, "\nShell shutting down...\n", 24);
+                }
+            }
+            continue;
+        }
+        
+        job_t* job = &g_jobs[tag >> 32];
+        int j = (int)(tag & 0xffffffffu);
+        if (job->state != JOB_RUNNING || j >= job->num_pids || job->pids[j] <= 0) continue;
+        int status;
+        if (job_waitpid(job, j, &status, WNOHANG) == job->pids[j]) {
+            job_note_exit(job, j, status);
+        }
+    }
+}
+
+/**
+ * Wait for one foreground child while the event loop keeps running
+ * @return Wait status, or -1 on error
+ */
+static int wait_foreground(pid_t pid) {
+    int fd = g_event_fd != -1 ? pidfd_open_child(pid) : -1;
+    while (fd != -1) {
+        struct pollfd pfds[2] = { { fd, POLLIN, 0 }, { g_event_fd, POLLIN, 0 } };
+        if (poll(pfds, 2, -1) == -1 && errno != EINTR) break;
+        if (pfds[1].revents) events_dispatch(0);
+        if (pfds[0].revents) break;
+    }
+    if (fd != -1) close(fd);
+    
+    int status;
+    pid_t r;
+    do {
+        r = waitpid(pid, &status, 0);
+    } while (r == -1 && errno == EINTR);
+    return r == -1 ? -1 : status;
+}
+
+static void job_report_times(const job_t* job);
+
+/**
+ * Report finished background jobs and free their slots
+ */
+static void jobs_notify(void) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        job_t* job = &g_jobs[i];
+        if (job->state != JOB_DONE) continue;
+        
+        if (g_interactive) {
+            printf("[%d]  Done (%d)\t%.3fs\t%s\n", job->id, job->exit_status,
+                   timespec_elapsed(&job->start, &job->end), job->command);
+            fflush(stdout);
+        }
+        job_report_times(job);
+        job_free(job);
+    }
+}
+
+/**
+ * Block until every stage of a job has terminated
+ * @return Exit status of the job's last stage
+ */
+static int job_wait(job_t* job) {
+    // Through the event loop, so orphaned producers are still torn down
+    while (g_event_fd != -1 && job->state == JOB_RUNNING && g_shell_running) {
+        events_dispatch(-1);
+    }
+    for (int j = 0; j < job->num_pids; j++) {
+        if (job->pids[j] <= 0) continue;
+        
+        int status;
+        pid_t r;
+        do {
+            r = job_waitpid(job, j, &status, 0);
+        } while (r == -1 && errno == EINTR);
+        job_note_exit(job, j, r == -1 ? 0 : status);
+    }
+    return job->exit_status;
+}
+
+/**
+ * Find a job by "%N" job number or by the pid of any of its stages
+ */
+static job_t* job_lookup(const char* spec) {
+    char* end;
+    int by_id = (spec[0] == '%');
+    long value = strtol(by_id ? spec + 1 : spec, &end, 10);
+    if (*end != '\0' || value <= 0) return NULL;
+    
+    for (int i = 0; i < MAX_JOBS; i++) {
+        job_t* job = &g_jobs[i];
+        if (job->state == JOB_FREE) continue;
+        if (by_id && job->id == value) return job;
+        for (int j = 0; !by_id && j < job->num_pids; j++) {
+            if (job->pids[j] == (pid_t)value) return job;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Built-in 'wait': wait for all background jobs, or for the given ones
+ * @param args "wait" followed by optional %job or pid specifiers
+ * @return Exit status of the last job waited for
+ */
+static int builtin_wait(char** args) {
+    int status = SUCCESS;
+    
+    if (!args[1]) {
+        for (int i = 0; i < MAX_JOBS; i++) {
+            if (g_jobs[i].state == JOB_FREE) continue;
+            status = job_wait(&g_jobs[i]);
+            job_report_times(&g_jobs[i]);
+            job_free(&g_jobs[i]);
+        }
+        return status;
+    }
+    
+    for (int i = 1; args[i]; i++) {
+        job_t* job = job_lookup(args[i]);
+        if (!job) {
+            fprintf(stderr, "wait: %s: no such job\n", args[i]);
+            status = 127;
+            continue;
+        }
+        status = job_wait(job);
+        job_report_times(job);
+        job_free(job);
+    }
+    return status;
+}
+
+/**
+ * Built-in 'jobs': list the job table with state, timing and pids
+ */
+static int builtin_jobs(char** args) {
+    (void)args;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    for (int i = 0; i < MAX_JOBS; i++) {
+        job_t* job = &g_jobs[i];
+        if (job->state == JOB_FREE) continue;
+        
+        const struct timespec* end = (job->state == JOB_DONE) ? &job->end : &now;
+        printf("[%d]  %s", job->id, job->state == JOB_DONE ? "Done" : "Running");
+        if (job->state == JOB_DONE) printf(" (%d)", job->exit_status);
+        printf("\t%.3fs\t%s", timespec_elapsed(&job->start, end), job->command);
+        
+        // Only processes still running: reaped ones and absent sinks are -1
+        int shown = 0;
+        for (int j = 0; j < job->num_pids; j++) {
+            if (job->pids[j] <= 0) continue;
+            printf("%s%d", shown++ ? " " : "\t[pids: ", job->pids[j]);
+        }
+        printf("%s\n", shown ? "]" : "");
+    }
+    fflush(stdout);
+    return SUCCESS;
+}
+
+/**
+ * Built-in 'exit [n]': stop the main loop
+ * @return n (low 8 bits), or the status of the last pipeline without one;
+ *         it becomes $? and the shell's exit status
+ */
+static int builtin_exit(char** args) {
+    int status = g_last_status;
+    if (args[1]) {
+        char* end;
+        long n = strtol(args[1], &end, 10);
+        if (end == args[1] || *end != '\0') {
+            fprintf(stderr, "exit: %s: numeric argument required\n", args[1]);
+            n = 2;
+        }
+        status = (int)(n & 0xff);
+    }
+    g_shell_running = 0;
+    return status;
+}
+
+static void exec_child(char** args) __attribute__((noreturn));
+
+/* One dispatched item of a 'fanout' run */
+typedef struct {
+    char* item;
+    int exit_status;
+    struct timespec start;
+    struct timespec end;
+    char* output;           // Buffered stdout (ordered mode only)
+    size_t output_len;
+    size_t output_cap;
+    int finished;
+} fanout_job_t;
+
+/* A concurrency slot: one running child */
+typedef struct {
+    pid_t pid;              // -1 when the slot is free
+    int job;                // Index into the job array
+    int out_fd;             // Read end of the child's stdout (ordered mode), -1 otherwise
+} fanout_slot_t;
+
+/**
+ * Write a whole buffer, retrying on short writes
+ */
+static int write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Build the argv of one fanout job: every "{}" in the template is replaced
+ * by the item; without any "{}" the item is appended as the last argument
+ * @return Newly allocated argv (strings owned by the caller), or NULL
+ */
+static char** fanout_build_argv(char** tmpl, int tmpl_argc, const char* item) {
+    char** argv = calloc(tmpl_argc + 2, sizeof(char*));
+    if (!argv) return NULL;
+    
+    size_t item_len = strlen(item);
+    int substituted = 0;
+    
+    for (int i = 0; i < tmpl_argc; i++) {
+        size_t len = strlen(tmpl[i]);
+        int count = 0;
+        for (const char* p = strstr(tmpl[i], "{}"); p; p = strstr(p + 2, "{}")) count++;
+        
+        argv[i] = malloc(len + count * item_len + 1);
+        if (!argv[i]) goto fail;
+        
+        char* out = argv[i];
+        for (const char* p = tmpl[i]; *p; ) {
+            if (p[0] == '{' && p[1] == '}') {
+                memcpy(out, item, item_len);
+                out += item_len;
+                p += 2;
+            } else {
+                *out++ = *p++;
+            }
+        }
+        *out = '\0';
+        substituted += count;
+    }
+    
+    if (!substituted) {
+        argv[tmpl_argc] = safe_strdup(item);
+        if (!argv[tmpl_argc]) goto fail;
+    }
+    return argv;
+    
+fail:
+    for (int i = 0; i <= tmpl_argc; i++) free(argv[i]);
+    free(argv);
+    return NULL;
+}
+
+/**
+ * Append data to a job's output buffer
+ */
+static int fanout_buffer(fanout_job_t* job, const char* data, size_t len) {
+    if (job->output_len + len > job->output_cap) {
+        size_t cap = job->output_cap ? job->output_cap : 4096;
+        while (cap < job->output_len + len) cap *= 2;
+        char* grown = realloc(job->output, cap);
+        if (!grown) return -1;
+        job->output = grown;
+        job->output_cap = cap;
+    }
+    memcpy(job->output + job->output_len, data, len);
+    job->output_len += len;
+    return 0;
+}
+
+/**
+ * Built-in 'fanout': run a command template once per input item with
+ * bounded concurrency (xargs -P style), always executed in a child so the
+ * scheduler can reap with waitpid(-1) without touching the shell's jobs.
+ *
+ *   fanout [-P N] [-k] [-a FILE] [-s FILE] command [args...]
+ *
+ * -P N     Maximum number of concurrent jobs (default: online CPUs); clamped
+ *          to the process limit and FANOUT_MAX_PROCS
+ * -k       Keep output in input order (buffered per job)
+ * -a FILE  Read items from FILE instead of stdin (one item per line)
+ * -s FILE  Write the per-job exit status summary to FILE (default: stderr)
+ *
+ * @return SUCCESS if every job succeeded, 123 otherwise (like xargs)
+ */
+static int builtin_fanout(char** args) {
+    long max_procs = sysconf(_SC_NPROCESSORS_ONLN);
+    int ordered = 0;
+    const char* input_path = NULL;
+    const char* summary_path = NULL;
+    int i = 1;
+    
+    // Parse options
+    for (; args[i] && args[i][0] == '-'; i++) {
+        const char* opt = args[i];
+        if (strcmp(opt, "--") == 0) { i++; break; }
+        if (strcmp(opt, "-k") == 0) { ordered = 1; continue; }
+        
+        const char* value = opt[2] ? opt + 2 : args[++i];
+        if (!value || (opt[1] != 'P' && opt[1] != 'a' && opt[1] != 's')) {
+            fprintf(stderr, "fanout: invalid option '%s'\n", opt);
+            return ERROR_GENERAL;
+        }
+        if (opt[1] == 'P') {
+            char* end;
+            max_procs = strtol(value, &end, 10);
+            if (end == value || *end != '\0' || max_procs <= 0) {
+                fprintf(stderr, "fanout: -P needs a positive number, got '%s'\n", value);
+                return ERROR_GENERAL;
+            }
+        }
+        if (opt[1] == 'a') input_path = value;
+        if (opt[1] == 's') summary_path = value;
+    }
+    
+    char** tmpl = &args[i];
+    int tmpl_argc = 0;
+    while (tmpl[tmpl_argc]) tmpl_argc++;
+    
+    if (tmpl_argc == 0 || max_procs <= 0) {
+        fprintf(stderr, "Usage: fanout [-P N] [-k] [-a FILE] [-s FILE] command [args...]\n");
+        return ERROR_GENERAL;
+    }
+    
+    // The slot and poll tables are sized by -P; more slots than the kernel
+    // lets us fork would only ever fail
+    long child_max = sysconf(_SC_CHILD_MAX);
+    if (child_max > 0 && max_procs > child_max) max_procs = child_max;
+    if (max_procs > FANOUT_MAX_PROCS) max_procs = FANOUT_MAX_PROCS;
+    
+    FILE* input = input_path ? fopen(input_path, "r") : stdin;
+    if (!input) {
+        fprintf(stderr, "fanout: %s: %s\n", input_path, strerror(errno));
+        return ERROR_GENERAL;
+    }
+    
+    // Sized by -P, so never on the stack
+    fanout_slot_t* slots = calloc(max_procs, sizeof(fanout_slot_t));
+    struct pollfd* pfds = ordered ? calloc(max_procs, sizeof(struct pollfd)) : NULL;
+    fanout_job_t* jobs = NULL;
+    int num_jobs = 0, jobs_cap = 0, active = 0, next_output = 0, failed = 0;
+    char* line = NULL;
+    size_t line_size = 0;
+    int input_done = 0;
+    
+    if (!slots || (ordered && !pfds)) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free(slots);
+        free(pfds);
+        if (input != stdin) fclose(input);
+        return ERROR_MEMORY;
+    }
+    for (int s = 0; s < max_procs; s++) {
+        slots[s].pid = -1;
+        slots[s].out_fd = -1;
+    }
+    
+    while (!input_done || active > 0) {
+        // Fill free slots with new items
+        for (int s = 0; s < max_procs && !input_done; s++) {
+            if (slots[s].pid != -1) continue;
+            
+            ssize_t len;
+            do {
+                len = getline(&line, &line_size, input);
+                if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+            } while (len == 0);
+            if (len == -1) {
+                input_done = 1;
+                break;
+            }
+            
+            if (num_jobs == jobs_cap) {
+                int cap = jobs_cap ? jobs_cap * 2 : 64;
+                fanout_job_t* grown = realloc(jobs, cap * sizeof(fanout_job_t));
+                if (!grown) { input_done = 1; break; }
+                jobs = grown;
+                jobs_cap = cap;
+            }
+            fanout_job_t* job = &jobs[num_jobs];
+            memset(job, 0, sizeof(*job));
+            job->item = safe_strdup(line);
+            char** argv = job->item ? fanout_build_argv(tmpl, tmpl_argc, job->item) : NULL;
+            if (!argv) {
+                free(job->item);
+                input_done = 1;
+                break;
+            }
+            
+            int out_pipe[2] = { -1, -1 };
+            if (ordered && pipe(out_pipe) == -1) {
+                perror("pipe");
+                out_pipe[0] = out_pipe[1] = -1;
+            }
+            
+            clock_gettime(CLOCK_MONOTONIC, &job->start);
+            pid_t pid = shell_fork();
+            if (pid == 0) {
+                if (out_pipe[1] != -1) {
+                    dup2(out_pipe[1], STDOUT_FILENO);
+                    close(out_pipe[0]);
+                    close(out_pipe[1]);
+                }
+                int devnull = open("/dev/null", O_RDONLY);
+                if (devnull != -1) {
+                    dup2(devnull, STDIN_FILENO);
+                    close(devnull);
+                }
+                exec_child(argv);
+            }
+            
+            for (int a = 0; argv[a]; a++) free(argv[a]);
+            free(argv);
+            if (out_pipe[1] != -1) close(out_pipe[1]);
+            
+            if (pid == -1) {
+                perror("fork");
+                if (out_pipe[0] != -1) close(out_pipe[0]);
+                job->exit_status = ERROR_FORK;
+                job->finished = 1;
+                job->end = job->start;
+                num_jobs++;
+                failed++;
+                continue;
+            }
+            
+            slots[s].pid = pid;
+            slots[s].job = num_jobs++;
+            slots[s].out_fd = out_pipe[0];
+            active++;
+        }
+        
+        if (active == 0) continue;
+        
+        pid_t done_pid = -1;
+        int status = 0;
+        
+        if (ordered) {
+            // Drain job outputs; the job at the head of the order streams straight through
+            int nfds = 0;
+            for (int s = 0; s < max_procs; s++) {
+                if (slots[s].pid != -1 && slots[s].out_fd != -1) {
+                    pfds[nfds].fd = slots[s].out_fd;
+                    pfds[nfds].events = POLLIN;
+                    nfds++;
+                }
+            }
+            if (nfds > 0 && poll(pfds, nfds, -1) == -1 && errno != EINTR) {
+                perror("poll");
+            }
+            
+            for (int s = 0; s < max_procs && done_pid == -1; s++) {
+                fanout_slot_t* slot = &slots[s];
+                if (slot->pid == -1) continue;
+                
+                if (slot->out_fd != -1) {
+                    int ready = 0;
+                    for (int p = 0; p < nfds; p++) {
+                        if (pfds[p].fd == slot->out_fd && pfds[p].revents) ready = 1;
+                    }
+                    if (!ready) continue;
+                    
+                    char buf[8192];
+                    ssize_t n = read(slot->out_fd, buf, sizeof(buf));
+                    if (n > 0) {
+                        if (slot->job == next_output) {
+                            write_all(STDOUT_FILENO, buf, n);
+                        } else {
+                            fanout_buffer(&jobs[slot->job], buf, n);
+                        }
+                        continue;
+                    }
+                    if (n == -1 && errno == EINTR) continue;
+                    close(slot->out_fd);
+                    slot->out_fd = -1;
+                }
+                
+                // Output closed: collect the child
+                while (waitpid(slot->pid, &status, 0) == -1 && errno == EINTR) {}
+                done_pid = slot->pid;
+            }
+            if (done_pid == -1) continue;
+        } else {
+            done_pid = waitpid(-1, &status, 0);
+            if (done_pid == -1) {
+                if (errno == EINTR) continue;
+                break;
+            }
+        }
+        
+        for (int s = 0; s < max_procs; s++) {
+            if (slots[s].pid != done_pid) continue;
+            
+            fanout_job_t* job = &jobs[slots[s].job];
+            clock_gettime(CLOCK_MONOTONIC, &job->end);
+            job->exit_status = status_to_exit_code(status);
+            job->finished = 1;
+            if (job->exit_status != 0) failed++;
+            slots[s].pid = -1;
+            active--;
+        }
+        
+        // Flush completed outputs that are now at the head of the order
+        while (ordered && next_output < num_jobs && jobs[next_output].finished) {
+            fanout_job_t* job = &jobs[next_output];
+            write_all(STDOUT_FILENO, job->output, job->output_len);
+            free(job->output);
+            job->output = NULL;
+            next_output++;
+            if (next_output < num_jobs) {
+                // The new head may have buffered data already
+                fanout_job_t* head = &jobs[next_output];
+                write_all(STDOUT_FILENO, head->output, head->output_len);
+                head->output_len = 0;
+            }
+        }
+    }
+    
+    // Per-job exit status summary
+    FILE* summary = summary_path ? fopen(summary_path, "w") : stderr;
+    if (!summary) {
+        fprintf(stderr, "fanout: %s: %s\n", summary_path, strerror(errno));
+        summary = stderr;
+    }
+    for (int j = 0; j < num_jobs; j++) {
+        fprintf(summary, "fanout: job %d exit %d %.3fs %s\n", j + 1, jobs[j].exit_status,
+                timespec_elapsed(&jobs[j].start, &jobs[j].end), jobs[j].item);
+        free(jobs[j].item);
+        free(jobs[j].output);
+    }
+    fprintf(summary, "fanout: %d jobs, %d failed\n", num_jobs, failed);
+    if (summary != stderr) fclose(summary);
+    
+    if (input != stdin) fclose(input);
+    free(line);
+    free(jobs);
+    free(slots);
+    free(pfds);
+    return failed ? 123 : SUCCESS;
+}
+
+/* Pre-forked launch helper ("zygote" pool member) */
+typedef struct {
+    pid_t pid;              // -1 when the slot is empty
+    int sock;               // Shell end of the helper's control socket
+} pool_helper_t;
+
+static pool_helper_t* g_pool = NULL;
+static int g_pool_size = 0;
+static unsigned long g_pool_launches = 0;
+static unsigned long g_pool_fallbacks = 0;
+
+/**
+ * Helper process body: wait for one launch request on the control socket,
+ * install the received stdio descriptors and exec the command
+ * @param sock Helper end of the control socket
+ */
+static void pool_helper_main(int sock) __attribute__((noreturn));
+static void pool_helper_main(int sock) {
+    static char buf[POOL_MAX_MSG];
+    union {
+        char data[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    
+    // Idle helpers must not run the shell's handlers
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    
+    // Keep the footprint small: drop the shell's parse state and every
+    // descriptor but the control socket and stdio for as long as the helper
+    // idles. shell_fork already closed the shell's own ones (other helpers'
+    // sockets, job pidfds); this also catches descriptors it does not track.
+    arena_destroy();
+    if (sock > 3) syscall(SYS_close_range, 3, sock - 1, 0);
+    syscall(SYS_close_range, sock + 1, ~0U, 0);
+    
+    struct iovec iov = { buf, sizeof(buf) - 1 };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data;
+    msg.msg_controllen = sizeof(control.data);
+    
+    ssize_t len;
+    do {
+        len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (len == -1 && errno == EINTR);
+    if (len <= 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        _exit(EXIT_SUCCESS); // Shell went away or sent garbage
+    }
+    buf[len] = '\0';
+    
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS) _exit(EXIT_FAILURE);
+    int fds[3];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    for (int i = 0; i < 3; i++) {
+        if (dup2(fds[i], i) == -1) _exit(EXIT_FAILURE);
+    }
+    
+    // Message layout: argc (uint32) followed by argc NUL-terminated strings
+    uint32_t argc;
+    memcpy(&argc, buf, sizeof(argc));
+    char* argv[argc + 1];
+    char* p = buf + sizeof(argc);
+    for (uint32_t i = 0; i < argc; i++) {
+        argv[i] = p;
+        p += strlen(p) + 1;
+    }
+    argv[argc] = NULL;
+    
+    execvp(argv[0], argv);
+    fprintf(stderr, "Error executing '%s': %s\n", argv[0], strerror(errno));
+    _exit(EXIT_FAILURE);
+}
+
+/**
+ * Fork a fresh helper into an empty pool slot
+ * @return 0 on success, -1 on failure
+ */
+static int pool_spawn_helper(int slot) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        return -1;
+    }
+    
+    fflush(stdout);
+    pid_t pid = shell_fork();
+    if (pid == -1) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        pool_helper_main(sv[1]);
+    }
+    
+    close(sv[1]);
+    g_pool[slot].pid = pid;
+    g_pool[slot].sock = sv[0];
+    return 0;
+}
+
+/**
+ * Create the helper pool (SHELL_POOL=N)
+ */
+static void pool_init(int size) {
+    g_pool = calloc(size, sizeof(pool_helper_t));
+    if (!g_pool) return;
+    
+    g_pool_size = size;
+    for (int i = 0; i < size; i++) {
+        g_pool[i].pid = -1;
+        g_pool[i].sock = -1;
+    }
+    for (int i = 0; i < size; i++) {
+        pool_spawn_helper(i);
+    }
+}
+
+/**
+ * Replace the helpers consumed by launches; called from the main loop
+ * between commands so refilling stays off the launch path
+ */
+static void pool_refill(void) {
+    for (int i = 0; i < g_pool_size; i++) {
+        if (g_pool[i].pid == -1) pool_spawn_helper(i);
+    }
+}
+
+/**
+ * Launch a command through an idle helper: one message carrying argv and
+ * the three stdio descriptors instead of a fork of the shell
+ * @param argv Null-terminated argument vector
+ * @param in_fd Descriptor to become the command's stdin
+ * @param out_fd Descriptor to become the command's stdout
+ * @param err_fd Descriptor to become the command's stderr
+ * @return Pid of the running command, or -1 if the caller must fork instead
+ */
+static pid_t pool_launch(char** argv, int in_fd, int out_fd, int err_fd) {
+    int slot = -1;
+    for (int i = 0; i < g_pool_size && slot == -1; i++) {
+        if (g_pool[i].pid != -1) slot = i;
+    }
+    if (slot == -1) {
+        if (g_pool_size > 0) g_pool_fallbacks++;
+        return -1;
+    }
+    
+    // Pack argc and the argument strings
+    size_t len = sizeof(uint32_t);
+    uint32_t argc = 0;
+    for (; argv[argc]; argc++) len += strlen(argv[argc]) + 1;
+    if (len > POOL_MAX_MSG - 1) {
+        g_pool_fallbacks++;
+        return -1;
+    }
+    char* buf = arena_alloc(len);
+    if (!buf) return -1;
+    memcpy(buf, &argc, sizeof(argc));
+    char* p = buf + sizeof(argc);
+    for (uint32_t i = 0; i < argc; i++) {
+        size_t n = strlen(argv[i]) + 1;
+        memcpy(p, argv[i], n);
+        p += n;
+    }
+    
+    union {
+        char data[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    int fds[3] = { in_fd, out_fd, err_fd };
+    
+    struct iovec iov = { buf, len };
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data;
+    msg.msg_controllen = sizeof(control.data);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    
+    pool_helper_t* helper = &g_pool[slot];
+    pid_t pid = helper->pid;
+    ssize_t sent = sendmsg(helper->sock, &msg, MSG_NOSIGNAL);
+    
+    // Either way this helper is used up: it now runs the command or is dead
+    close(helper->sock);
+    helper->sock = -1;
+    helper->pid = -1;
+    
+    if (sent != (ssize_t)len) {
+        waitpid(pid, NULL, 0);
+        g_pool_fallbacks++;
+        return -1;
+    }
+    g_pool_launches++;
+    return pid;
+}
+
+/**
+ * Dismiss the idle helpers: they were forked with an environment that is
+ * no longer current. pool_refill() replaces them between commands
+ */
+static void pool_retire(void) {
+    for (int i = 0; i < g_pool_size; i++) {
+        if (g_pool[i].pid == -1) continue;
+        close(g_pool[i].sock);
+        waitpid(g_pool[i].pid, NULL, 0);
+        g_pool[i].sock = -1;
+        g_pool[i].pid = -1;
+    }
+}
+
+/**
+ * Stop idle helpers: closing their socket makes them exit
+ */
+static void pool_shutdown(void) {
+    pool_retire();
+    free(g_pool);
+    g_pool = NULL;
+    g_pool_size = 0;
+}
+
+/**
+ * Built-in 'pool': report the launch helper pool state
+ */
+static int builtin_pool(char** args) {
+    (void)args;
+    int idle = 0;
+    for (int i = 0; i < g_pool_size; i++) {
+        if (g_pool[i].pid != -1) idle++;
+    }
+    printf("pool: %d helpers, %d idle, %lu launches, %lu fallbacks\n",
+           g_pool_size, idle, g_pool_launches, g_pool_fallbacks);
+    fflush(stdout);
+    return SUCCESS;
+}
+
+/* Memoized result of a pure command */
+typedef struct {
+    uint64_t hash;          // FNV-1a of the key, 0 = empty bucket
+    const char* key;        // argv, cwd, selected env and input hash
+    uint32_t key_len;
+    const char* out;        // Captured stdout
+    uint32_t out_len;
+    int status;             // Exit status
+    int owned;              // key/out malloc'ed (else they live in the disk mapping)
+    time_t created;
+    unsigned long last_used;
+} memo_entry_t;
+
+/* On-disk record header; key and output bytes follow, padded to 8 */
+typedef struct {
+    uint64_t hash;
+    uint32_t key_len;
+    uint32_t out_len;
+    int64_t created;
+    int32_t status;
+    uint32_t pad;
+} memo_record_t;
+
+static memo_entry_t* g_memo = NULL;     // Open-addressing table
+static int g_memo_buckets = 0;
+static int g_memo_entries = 0;
+static size_t g_memo_bytes = 0;
+static unsigned long g_memo_clock = 0;  // LRU tick
+static unsigned long g_memo_hits = 0;
+static unsigned long g_memo_misses = 0;
+static unsigned long g_memo_evictions = 0;
+static int g_memo_ttl = MEMO_TTL;
+static size_t g_memo_max = MEMO_MAX_BYTES;
+static int g_memo_loaded = 0;           // memo_init() has run
+static char* g_memo_env = NULL;         // Names and values of the SHELL_MEMO_ENV variables
+static size_t g_memo_env_len = 0;       // as they enter every key
+static int g_memo_disk = -1;            // Append descriptor (SHELL_MEMO_FILE)
+static void* g_memo_map = MAP_FAILED;
+static size_t g_memo_map_len = 0;
+
+/**
+ * 64-bit FNV-1a, chained through h
+ */
+static uint64_t fnv1a(uint64_t h, const void* data, size_t len) {
+    const unsigned char* p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+
+/**
+ * Drop one entry from the table, keeping the probe chains intact
+ */
+static void memo_remove(int slot) {
+    memo_entry_t* e = &g_memo[slot];
+    g_memo_bytes -= e->key_len + e->out_len;
+    g_memo_entries--;
+    if (e->owned) {
+        free((void*)e->key);
+        free((void*)e->out);
+    }
+    memset(e, 0, sizeof(*e));
+    
+    // Backward-shift deletion for linear probing
+    int mask = g_memo_buckets - 1;
+    for (int i = (slot + 1) & mask; g_memo[i].hash; i = (i + 1) & mask) {
+        int home = (int)(g_memo[i].hash & mask);
+        if (((i - home) & mask) >= ((i - slot) & mask)) {
+            g_memo[slot] = g_memo[i];
+            memset(&g_memo[i], 0, sizeof(g_memo[i]));
+            slot = i;
+        }
+    }
+}
+
+/**
+ * Find the slot holding key, or the empty slot where it would go
+ */
+static int memo_slot(uint64_t hash, const char* key, size_t key_len) {
+    int mask = g_memo_buckets - 1;
+    int i = (int)(hash & mask);
+    while (g_memo[i].hash) {
+        if (g_memo[i].hash == hash && g_memo[i].key_len == key_len &&
+            memcmp(g_memo[i].key, key, key_len) == 0) {
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+/**
+ * Insert an entry, evicting least recently used ones past the size limit
+ * @return 0 on success, -1 if the table cannot grow
+ */
+static int memo_insert(const memo_entry_t* entry) {
+    while (g_memo_entries > 0 && g_memo_bytes + entry->key_len + entry->out_len > g_memo_max) {
+        int lru = -1;
+        for (int i = 0; i < g_memo_buckets; i++) {
+            if (g_memo[i].hash && (lru == -1 || g_memo[i].last_used < g_memo[lru].last_used)) lru = i;
+        }
+        memo_remove(lru);
+        g_memo_evictions++;
+    }
+    
+    if ((g_memo_entries + 1) * 2 > g_memo_buckets) {
+        // Keep the load factor under 1/2
+        int old_buckets = g_memo_buckets;
+        memo_entry_t* old = g_memo;
+        int buckets = old_buckets ? old_buckets * 2 : MEMO_MIN_BUCKETS;
+        memo_entry_t* grown = calloc(buckets, sizeof(memo_entry_t));
+        if (!grown) return -1;
+        g_memo = grown;
+        g_memo_buckets = buckets;
+        for (int i = 0; i < old_buckets; i++) {
+            if (old[i].hash) g_memo[memo_slot(old[i].hash, old[i].key, old[i].key_len)] = old[i];
+        }
+        free(old);
+    }
+    
+    int slot = memo_slot(entry->hash, entry->key, entry->key_len);
+    if (g_memo[slot].hash) {
+        memo_remove(slot);
+        slot = memo_slot(entry->hash, entry->key, entry->key_len);
+    }
+    g_memo[slot] = *entry;
+    g_memo[slot].last_used = ++g_memo_clock;
+    g_memo_entries++;
+    g_memo_bytes += entry->key_len + entry->out_len;
+    return 0;
+}
+
+/**
+ * Append bytes to a growable buffer
+ * @return 0 on success, -1 when out of memory
+ */
+static int buffer_append(char** buf, size_t* len, size_t* cap, const void* data, size_t n) {
+    if (*len + n > *cap) {
+        size_t grown = *cap ? *cap : 256;
+        while (grown < *len + n) grown *= 2;
+        char* p = realloc(*buf, grown);
+        if (!p) return -1;
+        *buf = p;
+        *cap = grown;
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    return 0;
+}
+
+static const char* env_get(const char* name, size_t len);
+
+/**
+ * Resolve the SHELL_MEMO_ENV variables (PATH by default) into the key
+ * fragment once instead of on every lookup; redone only when the
+ * environment changes
+ */
+static void memo_env_key(void) {
+    const char* env = g_env.memo_env;
+    size_t cap = 0;
+    free(g_memo_env);
+    g_memo_env = NULL;
+    g_memo_env_len = 0;
+    for (const char* name = env ? env : "PATH"; *name; ) {
+        size_t n = strcspn(name, ",");
+        if (n > 0) {
+            const char* value = env_get(name, n);
+            buffer_append(&g_memo_env, &g_memo_env_len, &cap, name, n);
+            buffer_append(&g_memo_env, &g_memo_env_len, &cap, "", 1);
+            buffer_append(&g_memo_env, &g_memo_env_len, &cap, value ? value : "",
+                          value ? strlen(value) + 1 : 1);
+        }
+        name += n + (name[n] == ',');
+    }
+}
+
+/**
+ * Replace the on-disk store with an empty one. The new store is written
+ * to a temporary file and renamed over the old one, never truncated in
+ * place: other shells serve hits from their mapping of the old file.
+ * @param path Store path
+ * @return Append descriptor of the new store, or -1 (g_memo_disk is closed)
+ */
+static int memo_disk_reset(const char* path) {
+    if (g_memo_disk != -1) close(g_memo_disk);
+    g_memo_disk = -1;
+    size_t len = strlen(path) + 32;
+    char* tmp = malloc(len);
+    if (!tmp) return -1;
+    snprintf(tmp, len, "%s.%d.tmp", path, (int)getpid());
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (fd != -1 && (write_all(fd, MEMO_DISK_MAGIC, sizeof(MEMO_DISK_MAGIC)) == -1 ||
+                     rename(tmp, path) == -1)) {
+        fprintf(stderr, "Error: cannot reset memo store '%s': %s\n", path, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        fd = -1;
+    }
+    free(tmp);
+    return g_memo_disk = fd;
+}
+
+/**
+ * Load the configuration and the optional on-disk store on first use
+ * The store is mapped read-only and indexed in place: cached output from
+ * earlier sessions is served straight from the mapping.
+ */
+static void memo_init(void) {
+    if (g_memo_loaded) return;
+    g_memo_loaded = 1;
+    
+    const char* ttl = g_env.memo_ttl;
+    const char* size = g_env.memo_size;
+    const char* path = g_env.memo_file;
+    if (ttl && *ttl) g_memo_ttl = atoi(ttl);
+    if (size && *size) g_memo_max = strtoull(size, NULL, 10);
+    
+    memo_env_key();
+    if (!path || !*path) return;
+    
+    g_memo_disk = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (g_memo_disk == -1) {
+        fprintf(stderr, "Error: cannot open memo store '%s': %s\n", path, strerror(errno));
+        return;
+    }
+    struct stat st;
+    if (fstat(g_memo_disk, &st) == -1) return;
+    if (st.st_size == 0) {
+        // New store
+        if (write_all(g_memo_disk, MEMO_DISK_MAGIC, sizeof(MEMO_DISK_MAGIC)) == -1) {
+            close(g_memo_disk);
+            g_memo_disk = -1;
+        }
+        return;
+    }
+    if (st.st_size > (off_t)g_memo_max * 4) {
+        // The store outgrew its budget: start over
+        memo_disk_reset(path);
+        return;
+    }
+    
+    g_memo_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, g_memo_disk, 0);
+    if (g_memo_map == MAP_FAILED) return;
+    g_memo_map_len = st.st_size;
+    if (memcmp(g_memo_map, MEMO_DISK_MAGIC, sizeof(MEMO_DISK_MAGIC)) != 0) return;
+    
+    time_t now = time(NULL);
+    size_t off = sizeof(MEMO_DISK_MAGIC);
+    while (off + sizeof(memo_record_t) <= g_memo_map_len) {
+        const memo_record_t* rec = (const memo_record_t*)((const char*)g_memo_map + off);
+        size_t body = ((size_t)rec->key_len + rec->out_len + 7) & ~(size_t)7;
+        if (off + sizeof(*rec) + body > g_memo_map_len) break; // Torn tail
+        const char* key = (const char*)(rec + 1);
+        if (g_memo_ttl < 0 || now - rec->created <= g_memo_ttl) {
+            // Later records for the same key replace earlier ones
+            memo_entry_t entry = { rec->hash, key, rec->key_len, key + rec->key_len,
+                                   rec->out_len, rec->status, 0, (time_t)rec->created, 0 };
+            memo_insert(&entry);
+        }
+        off += sizeof(*rec) + body;
+    }
+}
+
+/**
+ * Look up a key; expired entries count as misses and are dropped
+ * @return The entry, or NULL on a miss
+ */
+static const memo_entry_t* memo_lookup(uint64_t hash, const char* key, size_t key_len) {
+    if (g_memo_buckets > 0) {
+        int slot = memo_slot(hash, key, key_len);
+        memo_entry_t* e = &g_memo[slot];
+        if (e->hash) {
+            if (g_memo_ttl < 0 || time(NULL) - e->created <= g_memo_ttl) {
+                e->last_used = ++g_memo_clock;
+                g_memo_hits++;
+                return e;
+            }
+            memo_remove(slot);
+        }
+    }
+    g_memo_misses++;
+    return NULL;
+}
+
+/**
+ * Remember a command result in memory and, if configured, on disk
+ * @param out Captured output (ownership taken)
+ */
+static void memo_store(uint64_t hash, const char* key, size_t key_len, char* out, size_t out_len,
+                       int status) {
+    if (key_len + out_len > g_memo_max) {
+        free(out);
+        return;
+    }
+    char* key_copy = malloc(key_len);
+    if (!key_copy) {
+        free(out);
+        return;
+    }
+    memcpy(key_copy, key, key_len);
+    memo_entry_t entry = { hash, key_copy, (uint32_t)key_len, out, (uint32_t)out_len, status, 1,
+                           time(NULL), 0 };
+    if (memo_insert(&entry) == -1) {
+        free(key_copy);
+        free(out);
+        return;
+    }
+    
+    if (g_memo_disk != -1) {
+        // One write per record, so concurrent shells appending stay consistent
+        memo_record_t rec = { hash, (uint32_t)key_len, (uint32_t)out_len, entry.created, status, 0 };
+        size_t body = (key_len + out_len + 7) & ~(size_t)7;
+        char* buf = calloc(1, sizeof(rec) + body);
+        if (buf) {
+            memcpy(buf, &rec, sizeof(rec));
+            memcpy(buf + sizeof(rec), key, key_len);
+            memcpy(buf + sizeof(rec) + key_len, out, out_len);
+            write_all(g_memo_disk, buf, sizeof(rec) + body);
+            free(buf);
+        }
+    }
+}
+
+/**
+ * Release the cache and the on-disk mapping
+ */
+static void memo_shutdown(void) {
+    for (int i = 0; i < g_memo_buckets; i++) {
+        if (g_memo[i].hash && g_memo[i].owned) {
+            free((void*)g_memo[i].key);
+            free((void*)g_memo[i].out);
+        }
+    }
+    free(g_memo);
+    free(g_memo_env);
+    if (g_memo_map != MAP_FAILED) munmap(g_memo_map, g_memo_map_len);
+    if (g_memo_disk != -1) close(g_memo_disk);
+}
+
+/**
+ * Built-in 'memo': report cache statistics ('memo -c' clears the cache)
+ */
+static int builtin_memo(char** args) {
+    memo_init();
+    if (args[1] && strcmp(args[1], "-c") == 0) {
+        for (int i = 0; i < g_memo_buckets; i++) {
+            while (g_memo[i].hash) memo_remove(i);
+        }
+        if (g_memo_disk != -1) memo_disk_reset(g_env.memo_file);
+        return SUCCESS;
+    }
+    printf("memo: %lu hits, %lu misses, %d entries, %zu bytes, %lu evictions\n",
+           g_memo_hits, g_memo_misses, g_memo_entries, g_memo_bytes, g_memo_evictions);
+    fflush(stdout);
+    return SUCCESS;
+}
+
+/* One shell variable. Variables inherited from environ point into it and
+   are only copied when assigned (copy-on-write) */
+typedef struct {
+    char* entry;            // "NAME=value", NULL for an empty slot
+    uint32_t hash;
+    uint32_t name_len;
+    int envp_index;         // Position in g_vars.envp while it is current
+    unsigned owned : 1;     // entry is heap memory owned by the table
+    unsigned exported : 1;
+} var_t;
+
+/* Variable table, loaded from environ on first use */
+static struct {
+    var_t* slots;           // Open addressing, capacity a power of two
+    size_t cap;
+    size_t count;
+    char** envp;            // Exported entries handed to exec, NULL-terminated
+    size_t envp_len;
+    int loaded;
+    int dirty;              // Exported variables changed since envp was built
+} g_vars;
+
+/**
+ * Length of the variable name at the start of text (0 if there is none)
+ */
+static size_t var_name_len(const char* text, size_t len) {
+    size_t n = 0;
+    if (len > 0 && is_name_start(text[0])) {
+        n = 1;
+        while (n < len && (isalnum((unsigned char)text[n]) || text[n] == '_')) n++;
+    }
+    return n;
+}
+
+/**
+ * Check for a valid variable name: [A-Za-z_][A-Za-z0-9_]*
+ */
+static int var_valid_name(const char* name, size_t len) {
+    return len > 0 && var_name_len(name, len) == len;
+}
+
+/**
+ * Find the slot of a name: its entry, or the empty slot where it belongs
+ */
+static var_t* var_slot(const char* name, size_t len, uint32_t hash) {
+    size_t mask = g_vars.cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        var_t* v = &g_vars.slots[i];
+        if (!v->entry || (v->hash == hash && v->name_len == len &&
+                          memcmp(v->entry, name, len) == 0)) {
+            return v;
+        }
+    }
+}
+
+/**
+ * Double the table once it is half full
+ * @return 0 on success, -1 on allocation failure
+ */
+static int vars_reserve(size_t count) {
+    if (count * 2 <= g_vars.cap) return 0;
+    size_t cap = g_vars.cap ? g_vars.cap : 64;
+    while (count * 2 > cap) cap *= 2;
+    var_t* old = g_vars.slots;
+    size_t old_cap = g_vars.cap;
+    g_vars.slots = calloc(cap, sizeof(var_t));
+    if (!g_vars.slots) {
+        g_vars.slots = old;
+        return -1;
+    }
+    g_vars.cap = cap;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].entry) *var_slot(old[i].entry, old[i].name_len, old[i].hash) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/**
+ * Index the inherited environment. Entries are views into environ, so
+ * loading copies no strings; the first definition of a name wins, as
+ * with getenv()
+ */
+static void vars_load(void) {
+    if (g_vars.loaded) return;
+    g_vars.loaded = 1;
+    
+    size_t count = 0;
+    while (environ[count]) count++;
+    if (vars_reserve(count + 1) == -1) return;
+    for (char** env = environ; *env; env++) {
+        const char* eq = strchr(*env, '=');
+        if (!eq) continue;
+        size_t len = eq - *env;
+        uint32_t hash = (uint32_t)fnv1a(FNV_OFFSET, *env, len);
+        var_t* v = var_slot(*env, len, hash);
+        if (v->entry) continue;
+        v->entry = *env;
+        v->hash = hash;
+        v->name_len = (uint32_t)len;
+        v->envp_index = -1;
+        v->exported = 1;
+        g_vars.count++;
+    }
+}
+
+/**
+ * Look up a variable
+ * @return Its value, or NULL if it is not set
+ */
+static const char* var_get(const char* name, size_t len) {
+    vars_load();
+    if (!g_vars.cap) return NULL;
+    var_t* v = var_slot(name, len, (uint32_t)fnv1a(FNV_OFFSET, name, len));
+    return v->entry ? v->entry + len + 1 : NULL;
+}
+
+/**
+ * Look up an exported variable, as commands will see it
+ * @return Its value, or NULL if it is not set or not exported
+ */
+static const char* env_get(const char* name, size_t len) {
+    vars_load();
+    if (!g_vars.cap) return NULL;
+    var_t* v = var_slot(name, len, (uint32_t)fnv1a(FNV_OFFSET, name, len));
+    return v->entry && v->exported ? v->entry + len + 1 : NULL;
+}
+
+/**
+ * Set a variable from a "NAME=value" string
+ * @param assign Assignment text; the name must already be valid
+ * @param export Export the variable; otherwise it keeps its current
+ *        export state (new variables stay local to the shell)
+ * @return SUCCESS or ERROR_MEMORY
+ */
+static int var_assign(const char* assign, int export) {
+    vars_load();
+    size_t len = strchr(assign, '=') - assign;
+    if (vars_reserve(g_vars.count + 1) == -1) return ERROR_MEMORY;
+    char* entry = safe_strdup(assign);
+    if (!entry) return ERROR_MEMORY;
+    
+    uint32_t hash = (uint32_t)fnv1a(FNV_OFFSET, assign, len);
+    var_t* v = var_slot(assign, len, hash);
+    if (!v->entry) {
+        v->hash = hash;
+        v->name_len = (uint32_t)len;
+        v->envp_index = -1;
+        g_vars.count++;
+    } else if (v->owned) {
+        free(v->entry);
+    }
+    v->entry = entry;
+    v->owned = 1;
+    v->exported |= export != 0;
+    g_vars.dirty |= v->exported;
+    return SUCCESS;
+}
+
+/**
+ * Collect the exported variables into envp and install it as environ
+ * @return Number of exported variables, or -1 on allocation failure
+ */
+static ssize_t envp_build(void) {
+    size_t count = 0;
+    char** envp = malloc((g_vars.count + 1) * sizeof(char*));
+    if (!envp) return -1;
+    for (size_t i = 0; i < g_vars.cap; i++) {
+        var_t* v = &g_vars.slots[i];
+        v->envp_index = -1;
+        if (v->entry && v->exported) {
+            v->envp_index = (int)count;
+            envp[count++] = v->entry;
+        }
+    }
+    envp[count] = NULL;
+    free(g_vars.envp);
+    g_vars.envp = envp;
+    g_vars.envp_len = count;
+    environ = envp;
+    env_scan();
+    return (ssize_t)count;
+}
+
+static void path_index_update(void);
+
+/**
+ * Make the exported variables the environment of future commands. envp
+ * is rebuilt only if an exported variable changed since the last build
+ * (or, with need_envp, if none was built yet), so most launches reuse it
+ * as is. Idle pool helpers, the memo key fragment and the PATH index are
+ * refreshed with it.
+ * @param need_envp Also build envp if the environment never changed
+ *        (per-command assignments patch it in the child)
+ */
+static void env_sync(int need_envp) {
+    if (!g_vars.dirty && (g_vars.envp || !need_envp)) return;
+    vars_load();
+    ssize_t count = envp_build();
+    if (count == -1) return;
+    
+    if (g_vars.dirty) {
+        g_vars.dirty = 0;
+        pool_retire();
+        if (g_memo_loaded) memo_env_key();
+        path_index_update();
+    }
+    if (g_debug_mode) {
+        fprintf(stderr, "Env: envp rebuilt with %zd variables\n", count);
+    }
+}
+
+/**
+ * Apply per-command assignments (VAR=x cmd) in a forked child right before
+ * exec. Only the slots of the assigned names change, in the child's
+ * private copy of envp; the shell's table and envp are untouched
+ * @param assigns "NAME=value" strings
+ * @param count Number of assignments
+ */
+static void env_apply(char** assigns, int count) {
+    if (count == 0) return;
+    if (!g_vars.envp) {
+        // Only nested pipelines get here without a prepared envp
+        vars_load();
+        if (!g_vars.cap || envp_build() == -1) return;
+    }
+    for (int i = 0; i < count; i++) {
+        size_t len = strchr(assigns[i], '=') - assigns[i];
+        var_t* v = var_slot(assigns[i], len, (uint32_t)fnv1a(FNV_OFFSET, assigns[i], len));
+        if (v->entry && v->envp_index >= 0) {
+            g_vars.envp[v->envp_index] = assigns[i];
+            continue;
+        }
+        char** grown = realloc(g_vars.envp, (g_vars.envp_len + 2) * sizeof(char*));
+        if (!grown) break;
+        g_vars.envp = grown;
+        grown[g_vars.envp_len++] = assigns[i];
+        grown[g_vars.envp_len] = NULL;
+    }
+    environ = g_vars.envp;
+    env_scan();
+}
+
+/**
+ * Order "NAME=value" entries by name
+ */
+static int cmp_entry(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * Built-in 'export': 'export NAME=value ...' sets and exports variables,
+ * 'export NAME' exports an existing one, a bare 'export' lists them
+ */
+static int builtin_export(char** args) {
+    vars_load();
+    if (!args[1]) {
+        env_sync(1);
+        char** sorted = malloc((g_vars.envp_len + 1) * sizeof(char*));
+        if (!sorted) return ERROR_MEMORY;
+        memcpy(sorted, g_vars.envp, g_vars.envp_len * sizeof(char*));
+        qsort(sorted, g_vars.envp_len, sizeof(char*), cmp_entry);
+        for (size_t i = 0; i < g_vars.envp_len; i++) {
+            const char* eq = strchr(sorted[i], '=');
+            printf("export %.*s=\"%s\"\n", (int)(eq - sorted[i]), sorted[i], eq + 1);
+        }
+        free(sorted);
+        fflush(stdout);
+        return SUCCESS;
+    }
+    
+    int result = SUCCESS;
+    for (int i = 1; args[i]; i++) {
+        const char* eq = strchr(args[i], '=');
+        size_t len = eq ? (size_t)(eq - args[i]) : strlen(args[i]);
+        if (!var_valid_name(args[i], len)) {
+            fprintf(stderr, "export: '%s': not a valid identifier\n", args[i]);
+            result = ERROR_GENERAL;
+        } else if (eq) {
+            if (var_assign(args[i], 1) != SUCCESS) return ERROR_MEMORY;
+        } else if (g_vars.cap) {
+            var_t* v = var_slot(args[i], len, (uint32_t)fnv1a(FNV_OFFSET, args[i], len));
+            if (v->entry && !v->exported) {
+                v->exported = 1;
+                g_vars.dirty = 1;
+            }
+        }
+    }
+    // Settings and the PATH index follow the new environment right away
+    env_sync(0);
+    return result;
+}
+
+/* One history entry: a view into the mapped file, or a copy for lines added later */
+typedef struct {
+    const char* text;
+    uint32_t len;
+    uint32_t seq;           // 1-based position in the history
+} hist_entry_t;
+
+/* Suffix array element: the suffix of unique entry 'entry' starting at 'offset' */
+typedef struct {
+    uint32_t entry;
+    uint32_t offset;
+} hist_suffix_t;
+
+#define HIST_DELTA_MAX 4096     // Entries scanned linearly before the indexes are rebuilt
+
+static char* g_hist_path = NULL;        // History file, NULL when history is off
+static int g_hist_fd = -1;              // O_APPEND descriptor for new entries
+static char* g_hist_map = MAP_FAILED;   // Read-only mapping made at first use
+static size_t g_hist_map_len = 0;
+static int g_hist_loaded = 0;
+static hist_entry_t* g_hist = NULL;     // Every entry in order: mapped, then added this session
+static size_t g_hist_count = 0;
+static size_t g_hist_cap = 0;
+static size_t g_hist_indexed = 0;       // g_hist[0..g_hist_indexed) is covered by the indexes
+static hist_entry_t* g_hist_sorted = NULL; // Distinct indexed commands sorted by text
+static size_t g_hist_unique = 0;
+static hist_suffix_t* g_hist_sa = NULL; // Suffix array over g_hist_sorted, built on demand
+static size_t g_hist_sa_len = 0;
+
+/**
+ * Choose the history file: SHELL_HISTORY_FILE, or ~/.shell_history for a
+ * terminal session. Nothing is opened or read here.
+ */
+static void history_init(void) {
+    const char* path = g_env.history_file;
+    if (path) {
+        if (*path) g_hist_path = safe_strdup(path);
+        return;
+    }
+    const char* home = g_env.home;
+    if (home && *home && isatty(STDIN_FILENO)) {
+        size_t len = strlen(home) + sizeof("/.shell_history");
+        g_hist_path = malloc(len);
+        if (g_hist_path) snprintf(g_hist_path, len, "%s/.shell_history", home);
+    }
+}
+
+/**
+ * Append an entry to the in-memory list
+ * @return SUCCESS or ERROR_MEMORY
+ */
+static int history_push(const char* text, size_t len) {
+    if (g_hist_count == g_hist_cap) {
+        size_t cap = g_hist_cap ? g_hist_cap * 2 : 1024;
+        hist_entry_t* grown = realloc(g_hist, cap * sizeof(*grown));
+        if (!grown) return ERROR_MEMORY;
+        g_hist = grown;
+        g_hist_cap = cap;
+    }
+    g_hist[g_hist_count].text = text;
+    g_hist[g_hist_count].len = (uint32_t)len;
+    g_hist[g_hist_count].seq = (uint32_t)(g_hist_count + 1);
+    g_hist_count++;
+    return SUCCESS;
+}
+
+/**
+ * Map the history file and split it into entries; runs once, on the first
+ * lookup, so a large file never costs anything at startup
+ */
+static void history_load(void) {
+    if (g_hist_loaded || !g_hist_path) return;
+    g_hist_loaded = 1;
+    
+    int fd = open(g_hist_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        g_hist_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (g_hist_map != MAP_FAILED) g_hist_map_len = st.st_size;
+    }
+    close(fd);
+    if (g_hist_map == MAP_FAILED) return;
+    
+    const char* p = g_hist_map;
+    const char* end = g_hist_map + g_hist_map_len;
+    while (p < end) {
+        const char* nl = memchr(p, '\n', end - p);
+        const char* stop = nl ? nl : end;
+        if (stop > p && history_push(p, stop - p) != SUCCESS) break;
+        p = stop + 1;
+    }
+}
+
+/**
+ * Record an interactive command line: one O_APPEND write per entry, so
+ * shells sharing the file never interleave their lines
+ * @param line Line as read, possibly ending in a newline
+ * @param len Length of the line
+ */
+static void history_add(const char* line, size_t len) {
+    if (!g_hist_path) return;
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) len--;
+    size_t blank = 0;
+    while (blank < len && (line[blank] == ' ' || line[blank] == '\t')) blank++;
+    if (blank == len) return;
+    
+    if (g_hist_fd == -1) {
+        g_hist_fd = open(g_hist_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        if (g_hist_fd == -1) {
+            fprintf(stderr, "history: cannot open '%s': %s\n", g_hist_path, strerror(errno));
+            free(g_hist_path);
+            g_hist_path = NULL;
+            return;
+        }
+    }
+    char* copy = malloc(len + 1);
+    if (!copy) return;
+    memcpy(copy, line, len);
+    copy[len] = '\n';
+    write_all(g_hist_fd, copy, len + 1);
+    
+    // Once the file is mapped, later lines live beside it in memory
+    if (!g_hist_loaded || history_push(copy, len) != SUCCESS) {
+        free(copy);
+    }
+}
+
+/**
+ * Order entries by text, then by position
+ */
+static int hist_cmp_text(const void* a, const void* b) {
+    const hist_entry_t* x = a;
+    const hist_entry_t* y = b;
+    int c = memcmp(x->text, y->text, x->len < y->len ? x->len : y->len);
+    if (c) return c;
+    if (x->len != y->len) return x->len < y->len ? -1 : 1;
+    return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+/**
+ * Order entries by position
+ */
+static int hist_cmp_seq(const void* a, const void* b) {
+    const hist_entry_t* x = a;
+    const hist_entry_t* y = b;
+    return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+/**
+ * Order suffixes of g_hist_sorted entries lexicographically
+ */
+static int hist_cmp_suffix(const void* a, const void* b) {
+    const hist_suffix_t* x = a;
+    const hist_suffix_t* y = b;
+    const hist_entry_t* ex = &g_hist_sorted[x->entry];
+    const hist_entry_t* ey = &g_hist_sorted[y->entry];
+    size_t lx = ex->len - x->offset;
+    size_t ly = ey->len - y->offset;
+    int c = memcmp(ex->text + x->offset, ey->text + y->offset, lx < ly ? lx : ly);
+    if (c) return c;
+    return lx < ly ? -1 : (lx > ly);
+}
+
+/**
+ * Sort entries by text and keep the most recent use of each distinct command
+ * @return Number of entries left
+ */
+static size_t hist_unique(hist_entry_t* entries, size_t n) {
+    qsort(entries, n, sizeof(*entries), hist_cmp_text);
+    size_t kept = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (kept > 0 && entries[kept - 1].len == entries[i].len &&
+            memcmp(entries[kept - 1].text, entries[i].text, entries[i].len) == 0) {
+            entries[kept - 1] = entries[i];
+        } else {
+            entries[kept++] = entries[i];
+        }
+    }
+    return kept;
+}
+
+/**
+ * Drop the search indexes (they are rebuilt on the next search)
+ */
+static void history_drop_index(void) {
+    free(g_hist_sorted);
+    free(g_hist_sa);
+    g_hist_sorted = NULL;
+    g_hist_sa = NULL;
+    g_hist_unique = g_hist_sa_len = 0;
+    g_hist_indexed = 0;
+}
+
+/**
+ * Build the sorted command index, and for substring searches the suffix
+ * array, over every entry known so far
+ * @return SUCCESS or ERROR_MEMORY
+ */
+static int history_index(int substring) {
+    history_load();
+    if (g_hist_sorted && g_hist_count - g_hist_indexed > HIST_DELTA_MAX) {
+        history_drop_index();
+    }
+    if (!g_hist_sorted && g_hist_count > 0) {
+        g_hist_sorted = malloc(g_hist_count * sizeof(*g_hist_sorted));
+        if (!g_hist_sorted) return ERROR_MEMORY;
+        memcpy(g_hist_sorted, g_hist, g_hist_count * sizeof(*g_hist_sorted));
+        g_hist_unique = hist_unique(g_hist_sorted, g_hist_count);
+        g_hist_indexed = g_hist_count;
+    }
+    if (substring && g_hist_sorted && !g_hist_sa) {
+        size_t total = 0;
+        for (size_t i = 0; i < g_hist_unique; i++) total += g_hist_sorted[i].len;
+        g_hist_sa = malloc((total ? total : 1) * sizeof(*g_hist_sa));
+        if (!g_hist_sa) return ERROR_MEMORY;
+        size_t n = 0;
+        for (size_t i = 0; i < g_hist_unique; i++) {
+            for (uint32_t off = 0; off < g_hist_sorted[i].len; off++) {
+                g_hist_sa[n].entry = (uint32_t)i;
+                g_hist_sa[n].offset = off;
+                n++;
+            }
+        }
+        qsort(g_hist_sa, n, sizeof(*g_hist_sa), hist_cmp_suffix);
+        g_hist_sa_len = n;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Compare the start of a text with a pattern: 0 when the text begins with it
+ */
+static int hist_cmp_prefix(const char* text, size_t len, const char* pat, size_t pat_len) {
+    int c = memcmp(text, pat, len < pat_len ? len : pat_len);
+    if (c) return c;
+    return len < pat_len ? -1 : 0;
+}
+
+/**
+ * Find the commands that start with (or contain) a pattern.
+ * The indexed part is answered by two binary searches, over the sorted
+ * commands for a prefix or over the suffix array for a substring; the few
+ * entries added since the indexes were built are scanned. Each distinct
+ * command is reported once, at its latest position, oldest first.
+ * @param pat Pattern
+ * @param pat_len Pattern length
+ * @param substring Match anywhere instead of at the start
+ * @param out Output: malloc'd array of matches (caller frees)
+ * @return Number of matches, or -1 on allocation failure
+ */
+static ssize_t history_search(const char* pat, size_t pat_len, int substring, hist_entry_t** out) {
+    *out = NULL;
+    if (history_index(substring) != SUCCESS) return -1;
+    
+    size_t lo = 0, hi = 0;
+    if (g_hist_sorted) {
+        size_t n = substring ? g_hist_sa_len : g_hist_unique;
+        // First element >= pattern, then first element > pattern
+        for (int pass = 0; pass < 2; pass++) {
+            size_t a = pass ? lo : 0, b = n;
+            while (a < b) {
+                size_t mid = a + (b - a) / 2;
+                const hist_entry_t* e;
+                size_t off = 0;
+                if (substring) {
+                    e = &g_hist_sorted[g_hist_sa[mid].entry];
+                    off = g_hist_sa[mid].offset;
+                } else {
+                    e = &g_hist_sorted[mid];
+                }
+                int c = hist_cmp_prefix(e->text + off, e->len - off, pat, pat_len);
+                if (pass ? c <= 0 : c < 0) a = mid + 1;
+                else b = mid;
+            }
+            if (pass) hi = a;
+            else lo = a;
+        }
+    }
+    
+    size_t cap = (hi - lo) + (g_hist_count - g_hist_indexed);
+    hist_entry_t* matches = malloc((cap ? cap : 1) * sizeof(*matches));
+    if (!matches) return -1;
+    size_t n = 0;
+    for (size_t i = lo; i < hi; i++) {
+        matches[n++] = g_hist_sorted[substring ? g_hist_sa[i].entry : i];
+    }
+    for (size_t i = g_hist_indexed; i < g_hist_count; i++) {
+        const hist_entry_t* e = &g_hist[i];
+        int hit = substring ? memmem(e->text, e->len, pat, pat_len) != NULL
+                            : hist_cmp_prefix(e->text, e->len, pat, pat_len) == 0;
+        if (hit) matches[n++] = *e;
+    }
+    
+    // A command may match at several offsets, or again this session
+    n = hist_unique(matches, n);
+    qsort(matches, n, sizeof(*matches), hist_cmp_seq);
+    *out = matches;
+    return (ssize_t)n;
+}
+
+/**
+ * Forget every entry and unmap the file
+ */
+static void history_shutdown(void) {
+    for (size_t i = 0; i < g_hist_count; i++) {
+        const char* t = g_hist[i].text;
+        if (g_hist_map == MAP_FAILED || t < g_hist_map || t >= g_hist_map + g_hist_map_len) {
+            free((void*)t);
+        }
+    }
+    history_drop_index();
+    free(g_hist);
+    g_hist = NULL;
+    g_hist_count = g_hist_cap = 0;
+    if (g_hist_map != MAP_FAILED) munmap(g_hist_map, g_hist_map_len);
+    g_hist_map = MAP_FAILED;
+    g_hist_map_len = 0;
+    g_hist_loaded = 0;
+}
+
+/**
+ * Built-in 'history': list entries ('history N' the last N), search them
+ * ('-p prefix', '-s text') or clear the file ('-c')
+ */
+static int builtin_history(char** args) {
+    if (!g_hist_path) {
+        fprintf(stderr, "history: no history file (set SHELL_HISTORY_FILE)\n");
+        return ERROR_GENERAL;
+    }
+    if (args[1] && strcmp(args[1], "-c") == 0) {
+        // Unlinked, not truncated: other shells search their mapping of it.
+        // The next entry creates a new file.
+        history_shutdown();
+        if (g_hist_fd != -1) close(g_hist_fd);
+        g_hist_fd = -1;
+        if (unlink(g_hist_path) == -1 && errno != ENOENT) {
+            fprintf(stderr, "history: %s\n", strerror(errno));
+            return ERROR_GENERAL;
+        }
+        return SUCCESS;
+    }
+    
+    if (args[1] && (strcmp(args[1], "-p") == 0 || strcmp(args[1], "-s") == 0)) {
+        if (!args[2]) {
+            fprintf(stderr, "history: usage: history [-p prefix | -s text | -c | count]\n");
+            return ERROR_GENERAL;
+        }
+        // Words after the option form one pattern
+        size_t len = 0;
+        for (int i = 2; args[i]; i++) len += strlen(args[i]) + 1;
+        char* pat = arena_alloc(len);
+        if (!pat) return ERROR_MEMORY;
+        char* p = pat;
+        for (int i = 2; args[i]; i++) {
+            if (i > 2) *p++ = ' ';
+            size_t n = strlen(args[i]);
+            memcpy(p, args[i], n);
+            p += n;
+        }
+        
+        hist_entry_t* matches;
+        ssize_t n = history_search(pat, p - pat, args[1][1] == 's', &matches);
+        if (n == -1) {
+            fprintf(stderr, "history: out of memory\n");
+            return ERROR_MEMORY;
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            printf("%5u  %.*s\n", matches[i].seq, (int)matches[i].len, matches[i].text);
+        }
+        free(matches);
+        fflush(stdout);
+        return n > 0 ? SUCCESS : ERROR_GENERAL;
+    }
+    
+    history_load();
+    size_t first = 0;
+    if (args[1]) {
+        char* end;
+        long count = strtol(args[1], &end, 10);
+        if (*end || count < 0) {
+            fprintf(stderr, "history: usage: history [-p prefix | -s text | -c | count]\n");
+            return ERROR_GENERAL;
+        }
+        if ((size_t)count < g_hist_count) first = g_hist_count - count;
+    }
+    for (size_t i = first; i < g_hist_count; i++) {
+        printf("%5u  %.*s\n", g_hist[i].seq, (int)g_hist[i].len, g_hist[i].text);
+    }
+    fflush(stdout);
+    return SUCCESS;
+}
+
+/* Coprocess started with 'coproc': its stdin and stdout are one end of a
+   socketpair, the shell keeps the other end for requests and responses */
+typedef struct {
+    char* name;             // NULL when the slot is free
+    int fd;                 // Shell's end
+    pid_t pid;              // Last stage
+    char* command;
+} coproc_t;
+
+#define MAX_COPROCS 16
+#define COPROC_CHUNK 4096
+#define COPROC_TIMEOUT_MS 10000     // Default wait for an answer ('-t' changes it)
+
+static coproc_t g_coprocs[MAX_COPROCS];
+
+/**
+ * Whether a coprocess is still running (its job has not been collected)
+ */
+static int coproc_running(const coproc_t* cp) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        const job_t* job = &g_jobs[i];
+        if (job->state != JOB_RUNNING) continue;
+        for (int j = 0; j < job->num_stages; j++) {
+            if (job->pids[j] == cp->pid) return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Find a coprocess by name
+ * @return The entry, or NULL (an error is printed)
+ */
+static coproc_t* coproc_find(const char* name) {
+    for (int i = 0; name && i < MAX_COPROCS; i++) {
+        if (g_coprocs[i].name && strcmp(g_coprocs[i].name, name) == 0) return &g_coprocs[i];
+    }
+    fprintf(stderr, "coproc: %s: no such coprocess\n", name ? name : "");
+    return NULL;
+}
+
+/**
+ * Close the shell's end of a coprocess and free its slot
+ */
+static void coproc_free(coproc_t* cp) {
+    if (cp->fd != -1) close(cp->fd);
+    free(cp->name);
+    free(cp->command);
+    memset(cp, 0, sizeof(*cp));
+    cp->fd = -1;
+}
+
+/**
+ * Close the shell's end of every coprocess in a child that never execs;
+ * otherwise a coprocess whose input the shell closes never sees end of file
+ */
+static void coproc_close_child(void) {
+    for (int i = 0; i < MAX_COPROCS; i++) {
+        if (g_coprocs[i].name && g_coprocs[i].fd != -1) close(g_coprocs[i].fd);
+        g_coprocs[i].fd = -1;
+    }
+}
+
+/**
+ * Send bytes to a coprocess; a coprocess that exited gives EPIPE, not SIGPIPE
+ * @return 0 on success, -1 on error
+ */
+static int coproc_send(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Copy whole lines of coprocess output to stdout.
+ * Output is peeked and only consumed up to the last requested newline, so
+ * nothing is read ahead: answers to later requests stay in the socket,
+ * whichever process (the shell, or a pipeline stage) reads next.
+ * The shell keeps serving its events while it waits.
+ * @param lines Number of lines to copy
+ * @param timeout_ms Longest wait for the answer, < 0 waits forever
+ * @return Lines copied; fewer when the coprocess closed its output or the
+ *         timeout expired
+ */
+static int coproc_read(coproc_t* cp, int lines, int timeout_ms) {
+    char buf[COPROC_CHUNK];
+    int done = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (done < lines && g_shell_running) {
+        ssize_t n = recv(cp->fd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+        if (n == 0) break;
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno != EAGAIN) {
+            fprintf(stderr, "coproc: %s: %s\n", cp->name, strerror(errno));
+            break;
+        }
+        if (n == -1) {
+            int wait_ms = -1;
+            if (timeout_ms >= 0) {
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                wait_ms = timeout_ms - (int)(timespec_elapsed(&start, &now) * 1000);
+                if (wait_ms <= 0) {
+                    fprintf(stderr, "coproc: %s: no answer within %d ms\n", cp->name, timeout_ms);
+                    break;
+                }
+            }
+            struct pollfd pfd[2] = { { cp->fd, POLLIN, 0 }, { g_event_fd, POLLIN, 0 } };
+            if (poll(pfd, g_event_fd != -1 ? 2 : 1, wait_ms) > 0 && (pfd[1].revents & POLLIN)) {
+                events_dispatch(0);
+            }
+            continue;
+        }
+        
+        // Consume up to the last newline still needed, or the partial line
+        size_t take = (size_t)n;
+        for (ssize_t i = 0; i < n && done < lines; i++) {
+            if (buf[i] == '\n' && ++done == lines) take = i + 1;
+        }
+        n = recv(cp->fd, buf, take, 0);
+        if (n > 0 && write_all(STDOUT_FILENO, buf, n) == -1) break;
+    }
+    return done;
+}
+
+/**
+ * Built-in 'coproc': list coprocesses, or talk to one
+ *   coproc -w name [text]    send text as a line (no text: copy redirected
+ *                            or piped stdin, never the shell's own input)
+ *   coproc -r name [lines]   print lines of output (default 1)
+ *   coproc -q name text      send a line, print one line of the answer
+ *   coproc -c name           close its input; it sees end of file
+ * '-t seconds' before the operation bounds the wait of -r and -q (default
+ * 10 s, 0 waits forever).
+ * Coprocesses are started by the 'coproc [-n name] command' prefix.
+ */
+static int builtin_coproc(char** args) {
+    int timeout_ms = COPROC_TIMEOUT_MS;
+    if (args[1] && strcmp(args[1], "-t") == 0) {
+        char* end = NULL;
+        double seconds = args[2] ? strtod(args[2], &end) : -1;
+        if (!end || *end || seconds < 0 || seconds > INT_MAX / 1000) {
+            fprintf(stderr, "coproc: -t: invalid timeout '%s'\n", args[2] ? args[2] : "");
+            return ERROR_GENERAL;
+        }
+        timeout_ms = seconds > 0 ? (int)(seconds * 1000) : -1;
+        args += 2;
+    }
+    
+    if (!args[1]) {
+        for (int i = 0; i < MAX_COPROCS; i++) {
+            coproc_t* cp = &g_coprocs[i];
+            if (!cp->name) continue;
+            printf("%s\t%d\t%s\t%s\n", cp->name, cp->pid, coproc_running(cp) ? "Running" : "Done",
+                   cp->command);
+        }
+        fflush(stdout);
+        return SUCCESS;
+    }
+    
+    const char* op = args[1];
+    if (strlen(op) != 2 || op[0] != '-' || !strchr("wrqc", op[1]) || !args[2]) {
+        fprintf(stderr, "coproc: usage: coproc [-n name] command | coproc [-t sec] [-w|-r|-q|-c] name [args]\n");
+        return ERROR_GENERAL;
+    }
+    coproc_t* cp = coproc_find(args[2]);
+    if (!cp) {
+        return ERROR_GENERAL;
+    }
+    
+    if (op[1] == 'c') {
+        shutdown(cp->fd, SHUT_WR);
+        return SUCCESS;
+    }
+    if (op[1] == 'r') {
+        int lines = args[3] ? atoi(args[3]) : 1;
+        return coproc_read(cp, lines, timeout_ms) == lines ? SUCCESS : ERROR_GENERAL;
+    }
+    
+    if (op[1] == 'w' && !args[3] && g_shell_stdin) {
+        fprintf(stderr, "coproc: -w: no text, and standard input is the shell's own input\n");
+        return ERROR_GENERAL;
+    }
+    if (op[1] == 'w' && !args[3]) {
+        // Stream standard input to the coprocess
+        char buf[COPROC_CHUNK];
+        ssize_t n;
+        while ((n = read(STDIN_FILENO, buf, sizeof(buf))) != 0) {
+            if (n == -1 && errno == EINTR) continue;
+            if (n == -1 || coproc_send(cp->fd, buf, n) == -1) {
+                fprintf(stderr, "coproc: %s: %s\n", cp->name, strerror(errno));
+                return ERROR_GENERAL;
+            }
+        }
+        return SUCCESS;
+    }
+    
+    // Arguments form one request line
+    for (int i = 3; args[i]; i++) {
+        const char* sep = args[i + 1] ? " " : "\n";
+        if (coproc_send(cp->fd, args[i], strlen(args[i])) == -1 ||
+            coproc_send(cp->fd, sep, 1) == -1) {
+            fprintf(stderr, "coproc: %s: %s\n", cp->name, strerror(errno));
+            return ERROR_GENERAL;
+        }
+    }
+    if (op[1] == 'q') {
+        return coproc_read(cp, 1, timeout_ms) == 1 ? SUCCESS : ERROR_GENERAL;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Close every coprocess at exit; they see end of file on their input
+ */
+static void coproc_shutdown(void) {
+    for (int i = 0; i < MAX_COPROCS; i++) {
+        if (g_coprocs[i].name) coproc_free(&g_coprocs[i]);
+    }
+}
+
+/**
+ * Close the shell's own descriptors in a freshly forked child: job pidfds,
+ * pool control sockets, the memo and history append descriptors and the
+ * PATH indexer's wakeup. The child never launches through the pool or
+ * appends to either store.
+ */
+static void child_close_fds(void) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        job_t* job = &g_jobs[i];
+        for (int j = 0; job->pidfds && j < job->num_pids; j++) {
+            if (job->pidfds[j] != -1) close(job->pidfds[j]);
+            job->pidfds[j] = -1;
+        }
+    }
+    for (int i = 0; i < g_pool_size; i++) {
+        if (g_pool[i].sock != -1) close(g_pool[i].sock);
+    }
+    g_pool_size = 0;
+    if (g_memo_disk != -1) close(g_memo_disk);
+    if (g_hist_fd != -1) close(g_hist_fd);
+    g_memo_disk = g_hist_fd = -1;
+    path_index_detach();
+}
+
+/* Built-in command table */
+typedef int (*builtin_fn)(char** args);
+
+typedef struct {
+    const char* name;
+    builtin_fn fn;
+    int in_child;           // Always run in a forked child, never in the shell itself
+} builtin_t;
+
+static const builtin_t g_builtins[] = {
+    { "exit", builtin_exit, 0 },
+    { "wait", builtin_wait, 0 },
+    { "jobs", builtin_jobs, 0 },
+    { "fanout", builtin_fanout, 1 },
+    { "pool", builtin_pool, 0 },
+    { "memo", builtin_memo, 0 },
+    { "history", builtin_history, 0 },
+    { "coproc", builtin_coproc, 0 },
+    { "export", builtin_export, 0 },
+    { NULL, NULL, 0 }
+};
+
+/* Words that prefix a pipeline with options for it (see parse_pipeline_prefixes) */
+static const char* const g_prefixes[] = { "time", "profile", "bulk", "pin", "limit", "sched", NULL };
+
+/**
+ * Look up a built-in command by name
+ * @return Table entry or NULL if the name is not a built-in
+ */
+static const builtin_t* find_builtin(const char* name) {
+    for (const builtin_t* b = g_builtins; b->name; b++) {
+        if (strcmp(b->name, name) == 0) return b;
+    }
+    return NULL;
+}
+
+/* Command paths resolved when a script was compiled, sorted by name. Both
+   point into the mapped script cache while a cached script runs. */
+typedef struct {
+    uint32_t name_off;      // Offsets into the string section
+    uint32_t path_off;
+} script_cmd_t;
+
+static struct {
+    const script_cmd_t* cmds;
+    uint32_t count;
+    const char* strings;
+    uint64_t path_hash;     // PATH the table was resolved against
+} g_script_cmds;
+
+/**
+ * Find the resolved path of a command of the cached script
+ * Only valid while PATH is the one the table was resolved against.
+ * @return Absolute path, or NULL to search PATH as usual
+ */
+static const char* script_cmd_lookup(const char* name) {
+    if (g_script_cmds.count == 0 || strchr(name, '/')) return NULL;
+    const char* path = g_env.path;
+    if (!path || fnv1a(FNV_OFFSET, path, strlen(path)) != g_script_cmds.path_hash) return NULL;
+    uint32_t lo = 0, hi = g_script_cmds.count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(g_script_cmds.strings + g_script_cmds.cmds[mid].name_off, name);
+        if (cmp == 0) return g_script_cmds.strings + g_script_cmds.cmds[mid].path_off;
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+/**
+ * Child-side tail of every launch: run a built-in or exec the program.
+ * Shared by single commands, pipeline stages and fanout jobs.
+ * @param args Null-terminated array of command arguments
+ */
+static void exec_child(char** args) {
+    const builtin_t* builtin = find_builtin(args[0]);
+    if (builtin) {
+        if (builtin->fn != builtin_coproc) coproc_close_child();
+        int status = builtin->fn(args);
+        fflush(stdout);
+        exit(status);
+    }
+    
+    // A path resolved by the script cache saves the PATH walk; if the
+    // program went away since, execvp searches as usual
+    const char* resolved = script_cmd_lookup(args[0]);
+    if (resolved) {
+        execv(resolved, args);
+    }
+    if (execvp(args[0], args) == -1) {
+        fprintf(stderr, "Error executing '%s': %s\n", args[0], strerror(errno));
+    }
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Execute a single command with proper error handling
+ * @param args Null-terminated array of command arguments
+ * @param fds Replacement stdin/stdout/stderr (-1 keeps the shell's), or NULL
+ * @return SUCCESS on success, error code on failure
+ */
+int execute_command(char** args, const int* fds) {
+    if (!args || !args[0]) {
+        return ERROR_GENERAL; // Empty command
+    }
+    
+    // Handle built-in commands
+    const builtin_t* builtin = find_builtin(args[0]);
+    if (builtin && !builtin->in_child) {
+        // Redirect the shell's own descriptors around the call
+        int saved[3] = { -1, -1, -1 };
+        fflush(stdout);
+        fflush(stderr);
+        for (int i = 0; fds && i < 3; i++) {
+            if (fds[i] == -1) continue;
+            saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+            dup2(fds[i], i);
+        }
+        int shell_stdin = g_shell_stdin;
+        g_shell_stdin = shell_stdin && saved[STDIN_FILENO] == -1;
+        int result = builtin->fn(args);
+        g_shell_stdin = shell_stdin;
+        fflush(stdout);
+        fflush(stderr);
+        for (int i = 0; i < 3; i++) {
+            if (saved[i] == -1) continue;
+            dup2(saved[i], i);
+            close(saved[i]);
+        }
+        return result;
+    }
+    
+    int io[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    for (int i = 0; fds && i < 3; i++) {
+        if (fds[i] != -1) io[i] = fds[i];
+    }
+    
+    // Prefer a pre-forked helper for external commands
+    pid_t pid = builtin ? -1 : pool_launch(args, io[0], io[1], io[2]);
+    if (pid == -1) {
+        pid = shell_fork();
+    }
+    if (pid == 0) {
+        // Child process
+        for (int i = 0; i < 3; i++) {
+            if (io[i] != i && dup2(io[i], i) == -1) {
+                perror("dup2");
+                exit(EXIT_FAILURE);
+            }
+        }
+        exec_child(args);
+    } else if (pid > 0) {
+        // Parent process
+        int status = wait_foreground(pid);
+        if (status == -1) {
+            perror("waitpid");
+            return ERROR_GENERAL;
+        }
+        return status_to_exit_code(status);
+    } else {
+        perror("fork");
+        return ERROR_FORK;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Reap one child with wait4 and record its accounting data
+ * @return Wait status, or -1 on error
+ */
+static int reap_stage(pid_t pid, int options, stage_stats_t* stats) {
+    int status;
+    struct rusage usage;
+    pid_t r;
+    
+    do {
+        r = wait4(pid, &status, options, &usage);
+    } while (r == -1 && errno == EINTR);
+    
+    if (r == -1) {
+        perror("waitpid");
+        return -1;
+    }
+    if (r == 0) {
+        return -2; // Still running (WNOHANG)
+    }
+    if (stats) {
+        clock_gettime(CLOCK_MONOTONIC, &stats->end);
+        stats->usage = usage;
+        stats->status = status;
+    }
+    return status;
+}
+
+/**
+ * Signal the stages that can no longer deliver output because a stage
+ * downstream of them has exited
+ * @param pids Stage pids, reaped entries set to 0
+ * @param cut Index of the furthest exited stage
+ * @param sig Signal to send
+ */
+static void teardown_producers(const pid_t* pids, int cut, int sig) {
+    for (int i = 0; i < cut; i++) {
+        if (pids[i] > 0) {
+            if (g_debug_mode) {
+                fprintf(stderr, "Teardown: %s to stage %d (pid %d)\n",
+                        sig == SIGKILL ? "SIGKILL" : "SIGTERM", i, pids[i]);
+            }
+            kill(pids[i], sig);
+        }
+    }
+}
+
+/**
+ * Wait for all valid child processes and handle cleanup
+ * Children are reaped in completion order through pidfds, so each stage's
+ * end time and rusage are exact; without pidfd support stages are reaped
+ * in index order instead.
+ * Once a stage exits, every stage upstream of it is an orphaned producer:
+ * it gets g_pipe_grace_ms to notice SIGPIPE on its own, then SIGTERM, then
+ * SIGKILL after PIPE_KILL_FACTOR times that grace.
+ * @param pids Array of process IDs
+ * @param num_processes Number of processes
+ * @param stats Optional per-stage accounting output (may be NULL)
+ * @return Exit code of the last stage, as in bash: a producer that died
+ *         of SIGPIPE or teardown does not fail the pipeline
+ */
+static int wait_for_children(pid_t* pids, int num_processes, stage_stats_t* stats) {
+    int last = num_processes - 1;
+    int exit_status = pids[last] > 0 ? SUCCESS : ERROR_GENERAL;
+    struct pollfd* pfds = arena_alloc((num_processes + 1) * sizeof(struct pollfd));
+    int* index = arena_alloc(num_processes * sizeof(int));
+    pid_t* live = arena_alloc(num_processes * sizeof(pid_t));
+    int pending = 0;
+    int cut = -1;               // Furthest stage that has exited
+    int teardown = 0;           // Signals sent so far: 0, 1 (SIGTERM), 2 (SIGKILL)
+    int armed = 0;              // Grace timer running
+    struct timespec deadline;
+    
+    for (int i = 0; i < num_processes; i++) {
+        if (pids[i] <= 0) continue;
+        
+        int fd = (pfds && index && live) ? pidfd_open_child(pids[i]) : -1;
+        if (fd == -1) {
+            // No pidfd: fall back to a blocking wait on this stage
+            int status = reap_stage(pids[i], 0, stats ? &stats[i] : NULL);
+            if (i == last) exit_status = status == -1 ? ERROR_GENERAL : status_to_exit_code(status);
+            continue;
+        }
+        pfds[pending].fd = fd;
+        pfds[pending].events = POLLIN;
+        index[pending] = i;
+        pending++;
+    }
+    if (live) {
+        for (int p = 0; p < num_processes; p++) live[p] = 0;
+        for (int p = 0; p < pending; p++) live[index[p]] = pids[index[p]];
+    }
+    
+    while (pending > 0) {
+        int timeout = -1;
+        if (armed) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double left = timespec_elapsed(&now, &deadline);
+            if (left <= 0) {
+                teardown++;
+                teardown_producers(live, cut, teardown == 1 ? SIGTERM : SIGKILL);
+                armed = teardown < 2;
+                deadline = now;
+                timespec_add_ms(&deadline, (long)g_pipe_grace_ms * PIPE_KILL_FACTOR);
+                continue;
+            }
+            timeout = (int)(left * 1000) + 1;
+        }
+        
+        // Background jobs and signals are served while the pipeline runs
+        int watched = pending;
+        if (g_event_fd != -1) {
+            pfds[watched].fd = g_event_fd;
+            pfds[watched].events = POLLIN;
+            pfds[watched++].revents = 0;
+        }
+        int ready = poll(pfds, watched, timeout);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if (watched > pending && pfds[pending].revents) {
+            events_dispatch(0);
+        }
+        
+        for (int p = 0; p < pending; p++) {
+            if (!pfds[p].revents) continue;
+            
+            int i = index[p];
+            int status = reap_stage(pids[i], WNOHANG, stats ? &stats[i] : NULL);
+            if (status == -2) continue;
+            if (i == last) exit_status = status == -1 ? ERROR_GENERAL : status_to_exit_code(status);
+            live[i] = 0;
+            if (i > cut) cut = i;
+            
+            close(pfds[p].fd);
+            pfds[p] = pfds[pending - 1];
+            index[p] = index[pending - 1];
+            pending--;
+            p--;
+        }
+        
+        // Arm the grace timer once some stage is left without a reader
+        if (!armed && teardown == 0 && g_pipe_grace_ms >= 0) {
+            for (int p = 0; p < pending; p++) {
+                if (index[p] < cut) {
+                    clock_gettime(CLOCK_MONOTONIC, &deadline);
+                    timespec_add_ms(&deadline, g_pipe_grace_ms);
+                    armed = 1;
+                    break;
+                }
+            }
+        }
+    }
+    
+    // Only reached on poll failure: finish with blocking waits
+    for (int p = 0; p < pending; p++) {
+        close(pfds[p].fd);
+        int status = reap_stage(pids[index[p]], 0, stats ? &stats[index[p]] : NULL);
+        if (index[p] == last) exit_status = status == -1 ? ERROR_GENERAL : status_to_exit_code(status);
+    }
+    return exit_status;
+}
+
+/**
+ * Print a string as a JSON string literal
+ */
+static void json_print_string(FILE* out, const char* str, int len) {
+    fputc('"', out);
+    for (int i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)str[i];
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/**
+ * Seconds of CPU time in a timeval
+ */
+static double timeval_seconds(const struct timeval* tv) {
+    return (double)tv->tv_sec + (double)tv->tv_usec / 1e6;
+}
+
+/* One file redirection of a stage */
+typedef struct {
+    int fd;                 // 0, 1 or 2
+    int append;             // >> / 2>>
+    char* path;             // Arena backed
+} redir_t;
+
+typedef struct psub psub_t;
+
+/* One stage of a pipeline, with its arguments already materialized */
+typedef struct {
+    char** argv;            // NULL-terminated, arena backed
+    int argc;
+    const char** arg_src;   // Source position of each argument, shifted with argv
+    redir_t* redirs;        // Applied in order after the pipe plumbing
+    int num_redirs;
+    psub_t* psubs;          // Process substitutions among the arguments
+    int num_psubs;
+    char** assigns;         // Leading NAME=value words, applied to this command only
+    int num_assigns;
+    const char* text;       // Source span of the stage, for messages
+    int text_len;
+    stage_limits_t* limits; // From a 'limit' prefix or the job cgroup, else NULL
+    stage_sched_t* sched;   // From a 'sched' prefix or 'pin', else NULL
+} stage_t;
+
+/* A <(pipeline) or >(pipeline) argument: one pipe edge to a nested pipeline */
+struct psub {
+    int arg_index;          // argv slot replaced by /dev/fd/N at launch
+    int output;             // >( : the stage writes, the nested pipeline reads
+    stage_t* stages;
+    int num_stages;
+    int fd;                 // Stage side of the edge once created, else -1
+};
+
+/**
+ * Consume the first n arguments of a stage (prefix words and their
+ * options): argv, the source positions and the process substitution slots
+ * move together, and the source text then starts at the new first argument
+ */
+static void stage_shift(stage_t* stage, int n) {
+    stage->argv += n;
+    stage->arg_src += n;
+    stage->argc -= n;
+    for (int j = 0; j < stage->num_psubs; j++) {
+        stage->psubs[j].arg_index -= n;
+    }
+    if (stage->argc > 0) {
+        stage->text_len -= (int)(stage->arg_src[0] - stage->text);
+        stage->text = stage->arg_src[0];
+    }
+}
+
+/**
+ * Number of pid slots a pipeline needs: each stage and its O_DIRECT writer,
+ * then the same layout for every nested pipeline in argument order
+ */
+static int pipeline_slots(const stage_t* stages, int num_stages) {
+    int slots = 2 * num_stages;
+    for (int i = 0; i < num_stages; i++) {
+        for (int j = 0; j < stages[i].num_psubs; j++) {
+            slots += pipeline_slots(stages[i].psubs[j].stages, stages[i].psubs[j].num_stages);
+        }
+    }
+    return slots;
+}
+
+static int build_pipeline(const lexed_line_t* lex, int first, int last, stage_t** stages_out);
+static int execute_line(const lexed_line_t* lex, int first, int last, int background);
+
+/* How a pipeline of a command list is joined to the one before it */
+typedef enum {
+    LIST_SEQ,               // First pipeline, or after ';' / '&'
+    LIST_AND,               // After &&: runs only if the last status is 0
+    LIST_OR                 // After ||: runs only if the last status is not 0
+} list_op_t;
+
+/* One pipeline of a compiled command list: token offsets, no pointers */
+typedef struct {
+    uint32_t first;         // Token range of the pipeline
+    uint32_t last;
+    uint8_t op;             // list_op_t
+    uint8_t background;     // Terminated by '&'
+} list_node_t;
+
+/* A line compiled into its pipelines, evaluated left to right */
+typedef struct {
+    list_node_t* nodes;     // Arena backed
+    int count;
+} command_list_t;
+
+static int compile_list(const lexed_line_t* lex, int num_tokens, command_list_t* list, int* bad);
+static void list_syntax_error(const lexed_line_t* lex, int num_tokens, int bad);
+static int execute_list(const lexed_line_t* lex, const command_list_t* list);
+
+/* Fields produced while expanding one word */
+typedef struct {
+    char** fields;      // Finished fields (arena)
+    int count;
+    int cap;
+    char* buf;          // Field being assembled (heap, reused for every field)
+    size_t len;
+    size_t buf_cap;
+    int open;           // A field is being assembled, possibly still empty
+} word_fields_t;
+
+/* Result of expanding one word, kept between the two build_pipeline passes */
+typedef struct {
+    char** fields;
+    int count;
+} word_expansion_t;
+
+/**
+ * Finish the field being assembled and add it to the list
+ * @return 0 on success, -1 on allocation failure
+ */
+static int fields_end(word_fields_t* wf) {
+    if (wf->count == wf->cap) {
+        int cap = wf->cap ? wf->cap * 2 : 8;
+        char** grown = arena_grow(wf->fields, wf->cap * sizeof(char*), cap * sizeof(char*));
+        if (!grown) return -1;
+        wf->fields = grown;
+        wf->cap = cap;
+    }
+    char* field = arena_alloc(wf->len + 1);
+    if (!field) return -1;
+    memcpy(field, wf->buf, wf->len);
+    wf->fields[wf->count++] = field;
+    wf->len = 0;
+    wf->open = 0;
+    return 0;
+}
+
+/**
+ * Add expanded text (substitution output or a variable value) to the word
+ * being expanded. Outside double quotes the text is split into fields at
+ * blanks, inside quotes it stays part of the current field. Runs of
+ * non-blank bytes are appended with one copy straight from the source,
+ * which for substitutions is usually the memfd mapping
+ * @return 0 on success, -1 on allocation failure
+ */
+static int fields_add(word_fields_t* wf, const char* data, size_t n, int quoted) {
+    if (quoted) {
+        wf->open = 1;
+        return buffer_append(&wf->buf, &wf->len, &wf->buf_cap, data, n);
+    }
+    const char* p = data;
+    const char* end = data + n;
+    while (p < end) {
+        if (*p == ' ' || *p == '\t' || *p == '\n') {
+            if (wf->open && fields_end(wf) == -1) return -1;
+            p++;
+            continue;
+        }
+        const char* run = p;
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\n') p++;
+        if (buffer_append(&wf->buf, &wf->len, &wf->buf_cap, run, p - run) == -1) return -1;
+        wf->open = 1;
+    }
+    return 0;
+}
+
+/* Commands whose output a substitution computes without forking */
+static const char* const g_subst_inline[] = { "echo", "pwd", "true", "false", ":" };
+
+/**
+ * Add the output of a substitution, without its trailing newlines
+ * @return 0 on success, -1 on allocation failure
+ */
+static int fields_add_output(word_fields_t* wf, const char* data, size_t n, int quoted) {
+    while (n > 0 && data[n - 1] == '\n') n--;
+    return fields_add(wf, data, n, quoted);
+}
+
+/**
+ * Check whether a command name is evaluated in-process by substitutions
+ */
+static int subst_is_inline(const char* name, size_t len) {
+    for (size_t i = 0; i < sizeof(g_subst_inline) / sizeof(g_subst_inline[0]); i++) {
+        if (strlen(g_subst_inline[i]) == len && memcmp(g_subst_inline[i], name, len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Produce the output of an in-process command (see g_subst_inline)
+ * @param argv Arguments, already expanded
+ * @return 0 on success, -1 on allocation failure
+ */
+static int subst_inline(char* const* argv, word_fields_t* wf, int quoted) {
+    if (strcmp(argv[0], "echo") == 0) {
+        char* out = NULL;
+        size_t len = 0, cap = 0;
+        int i = 1;
+        while (argv[i] && strcmp(argv[i], "-n") == 0) i++;
+        for (int first = i; argv[i]; i++) {
+            if ((i > first && buffer_append(&out, &len, &cap, " ", 1) == -1) ||
+                buffer_append(&out, &len, &cap, argv[i], strlen(argv[i])) == -1) {
+                free(out);
+                return -1;
+            }
+        }
+        int result = fields_add_output(wf, out, len, quoted);
+        free(out);
+        return result;
+    }
+    if (strcmp(argv[0], "pwd") == 0) {
+        char cwd[PATH_MAX];
+        if (getcwd(cwd, sizeof(cwd))) {
+            return fields_add_output(wf, cwd, strlen(cwd), quoted);
+        }
+        perror("pwd");
+    }
+    // No output; an empty quoted substitution still yields a field
+    return fields_add_output(wf, "", 0, quoted);
+}
+
+/**
+ * Run the command of a $( ) substitution and add its output to the word
+ * being expanded. Simple echo-like commands are evaluated in the shell.
+ * Anything else runs as a normal line with the shell's stdout pointed at
+ * a memfd, so builtins, pipelines and memoized commands all write into
+ * it directly; the memfd is then mapped and split without an
+ * intermediate read buffer.
+ * @param cmd Command text between "$(" and ")"
+ * @param len Length of the command text
+ * @param wf Word being expanded
+ * @param quoted Whether the substitution appeared inside double quotes
+ * @return SUCCESS or an error code (already reported)
+ */
+static int subst_run(const char* cmd, size_t len, word_fields_t* wf, int quoted) {
+    lexed_line_t lex;
+    int num_tokens = lex_line(cmd, len, &lex);
+    if (num_tokens < 0) {
+        fprintf(stderr, "Error: Invalid command substitution '$(%.*s)'\n", (int)len, cmd);
+        return ERROR_GENERAL;
+    }
+    if (num_tokens == 0) {
+        return fields_add_output(wf, "", 0, quoted) == -1 ? ERROR_MEMORY : SUCCESS;
+    }
+    
+    // Fast path: a single plain command such as echo
+    int simple = 1;
+    for (int t = 0; t < num_tokens && simple; t++) {
+        simple = lex.tokens[t].kind == TOK_WORD;
+    }
+    const token_t* name = &lex.tokens[0];
+    if (simple && !(name->flags & (TOKF_QUOTED | TOKF_EXPAND)) &&
+        subst_is_inline(cmd + name->start, name->len)) {
+        stage_t* stages;
+        if (build_pipeline(&lex, 0, num_tokens, &stages) != 1) {
+            return ERROR_GENERAL;
+        }
+        if (subst_inline(stages[0].argv, wf, quoted) == -1) {
+            return ERROR_MEMORY;
+        }
+        if (g_debug_mode) {
+            fprintf(stderr, "Subst: '%.*s' evaluated in-process\n", (int)len, cmd);
+        }
+        return SUCCESS;
+    }
+    
+    // Every pipeline runs in the foreground: the output must be complete
+    command_list_t list;
+    int bad;
+    if (compile_list(&lex, num_tokens, &list, &bad) == -1) {
+        list_syntax_error(&lex, num_tokens, bad);
+        return ERROR_GENERAL;
+    }
+    for (int i = 0; i < list.count; i++) {
+        list.nodes[i].background = 0;
+    }
+    
+    int fd = memfd_create("subst", MFD_CLOEXEC);
+    if (fd == -1) fd = open("/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        perror("subst");
+        return ERROR_GENERAL;
+    }
+    fflush(stdout);
+    int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    if (saved == -1 || dup2(fd, STDOUT_FILENO) == -1) {
+        perror("subst");
+        if (saved != -1) close(saved);
+        close(fd);
+        return ERROR_GENERAL;
+    }
+    
+    execute_list(&lex, &list);
+    
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    
+    int result = SUCCESS;
+    struct stat st;
+    size_t size = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+    if (size > 0) {
+        void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("subst");
+            result = ERROR_GENERAL;
+        } else {
+            if (fields_add_output(wf, map, size, quoted) == -1) result = ERROR_MEMORY;
+            munmap(map, size);
+        }
+    } else if (fields_add_output(wf, "", 0, quoted) == -1) {
+        result = ERROR_MEMORY;
+    }
+    close(fd);
+    
+    if (g_debug_mode) {
+        fprintf(stderr, "Subst: '%.*s' captured %zu bytes\n", (int)len, cmd, size);
+    }
+    return result;
+}
+
+/**
+ * Expand a word containing $( ) substitutions, $VAR / ${VAR} references or $?
+ * into its fields: quote removal as in token_copy_arg, plus each
+ * expansion replaced by the command output or the variable value
+ * @param tok Word token with TOKF_EXPAND set
+ * @param split Split unquoted expansions into fields (0 for assignments)
+ * @param fields_out Receives the arena-allocated fields
+ * @return Number of fields (0 if an unquoted expansion was empty), or -1 on error
+ */
+static int word_expand(const lexed_line_t* lex, const token_t* tok, int split, char*** fields_out) {
+    const char* p = lex->text + tok->start;
+    const char* end = p + tok->len;
+    word_fields_t wf = { 0 };
+    int quoted = 0;
+    int result = SUCCESS;
+    
+    while (p < end && result == SUCCESS) {
+        if (*p == '"') {
+            quoted = !quoted;
+            wf.open = 1;
+            p++;
+        } else if (*p == '$' && p + 1 < end && p[1] == '(') {
+            const char* close = lex_subst_end(p + 2, end);
+            result = subst_run(p + 2, close - 1 - (p + 2), &wf, quoted || !split);
+            p = close;
+        } else if (*p == '$' && p + 1 < end && p[1] == '?') {
+            char status[16];
+            int n = snprintf(status, sizeof(status), "%d", g_last_status);
+            if (fields_add(&wf, status, n, 1) == -1) result = ERROR_MEMORY;
+            p += 2;
+        } else if (*p == '$' && p + 1 < end && (p[1] == '{' || is_name_start(p[1]))) {
+            const char* name = p + 1;
+            size_t len;
+            if (*name == '{') {
+                name++;
+                const char* close = memchr(name, '}', end - name);
+                len = close ? (size_t)(close - name) : 0;
+                if (!close || !var_valid_name(name, len)) {
+                    fprintf(stderr, "Error: Bad substitution '%.*s'\n", (int)(end - p), p);
+                    result = ERROR_GENERAL;
+                    break;
+                }
+                p = close + 1;
+            } else {
+                len = var_name_len(name, end - name);
+                p = name + len;
+            }
+            const char* value = var_get(name, len);
+            if (value && fields_add(&wf, value, strlen(value), quoted || !split) == -1) {
+                result = ERROR_MEMORY;
+            }
+        } else {
+            const char* run = p;
+            while (p < end && *p != '"' && *p != '$') p++;
+            if (p == run) p++;
+            if (buffer_append(&wf.buf, &wf.len, &wf.buf_cap, run, p - run) == -1) {
+                result = ERROR_MEMORY;
+            }
+            wf.open = 1;
+        }
+    }
+    if (result == SUCCESS && wf.open && fields_end(&wf) == -1) {
+        result = ERROR_MEMORY;
+    }
+    free(wf.buf);
+    if (result != SUCCESS) {
+        if (result == ERROR_MEMORY) fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    *fields_out = wf.fields;
+    return wf.count;
+}
+
+/**
+ * Check whether a word is an assignment: an unquoted name followed by '='
+ */
+static int token_is_assign(const lexed_line_t* lex, const token_t* tok) {
+    const char* text = lex->text + tok->start;
+    size_t n = var_name_len(text, tok->len);
+    return n > 0 && n < tok->len && text[n] == '=';
+}
+
+/**
+ * Find the ')' closing the process substitution opened at token t
+ * @return Token index of the matching ')'
+ */
+static int psub_end(const lexed_line_t* lex, int t) {
+    int depth = 0;
+    for (;; t++) {
+        if (lex->tokens[t].kind == TOK_PSUB) depth++;
+        else if (lex->tokens[t].kind == TOK_RPAREN && --depth == 0) return t;
+    }
+}
+
+/**
+ * Build the stages of one pipeline from a token range, in a single walk
+ * over the tokens. Arguments are materialized into the arena here, so
+ * children no longer parse anything after fork.
+ * 
+ * @param lex Lexed line
+ * @param first Index of the first token of the pipeline
+ * @param last Index one past the last token of the pipeline
+ * @param stages_out Receives the arena-allocated stage array
+ * @return Number of stages, or -1 on error (already reported)
+ */
+static int build_pipeline(const lexed_line_t* lex, int first, int last, stage_t** stages_out) {
+    int num_stages = 1;
+    int has_subst = 0;
+    for (int t = first; t < last; t++) {
+        if (lex->tokens[t].kind == TOK_PSUB) t = psub_end(lex, t);
+        else if (lex->tokens[t].kind == TOK_PIPE) num_stages++;
+        else has_subst |= lex->tokens[t].flags & TOKF_EXPAND;
+    }
+    
+    stage_t* stages = arena_alloc(num_stages * sizeof(stage_t));
+    if (!stages) return -1;
+    
+    // Fields of the words holding $( ), by token, expanded while counting
+    word_expansion_t* expanded = NULL;
+    if (has_subst) {
+        expanded = arena_alloc((last - first) * sizeof(word_expansion_t));
+        if (!expanded) return -1;
+    }
+    
+    int t = first;
+    for (int i = 0; i < num_stages; i++) {
+        stage_t* stage = &stages[i];
+        int stage_first = t;
+        size_t arg_bytes = 0;
+        int argc = 0, num_redirs = 0, num_psubs = 0, num_assigns = 0;
+        int leading = 1;    // Still in the NAME=value words before the command
+        int declare = 0;    // The command is 'export': its NAME=value arguments are not split
+        while (t < last && lex->tokens[t].kind != TOK_PIPE) {
+            int target = 0, assign = 0;
+            if (lex->tokens[t].kind == TOK_PSUB) {
+                // Placeholder argument, filled in with /dev/fd/N at launch
+                argc++;
+                num_psubs++;
+                leading = 0;
+                t = psub_end(lex, t) + 1;
+                continue;
+            }
+            if (lex->tokens[t].kind == TOK_REDIR) {
+                if (t + 1 >= last || lex->tokens[t + 1].kind != TOK_WORD) {
+                    fprintf(stderr, "Error: Missing redirection target after '%.*s'\n",
+                            (int)lex->tokens[t].len, lex->text + lex->tokens[t].start);
+                    return -1;
+                }
+                num_redirs++;
+                target = 1;
+                t++;
+            } else if (leading && token_is_assign(lex, &lex->tokens[t])) {
+                num_assigns++;
+                assign = 1;
+            } else {
+                if (leading) {
+                    const token_t* name = &lex->tokens[t];
+                    declare = name->len == 6 && memcmp(lex->text + name->start, "export", 6) == 0;
+                }
+                assign = declare && token_is_assign(lex, &lex->tokens[t]);
+                argc++;
+                leading = 0;
+            }
+            if (lex->tokens[t].flags & TOKF_EXPAND) {
+                // Expansions run here, in order, before anything is launched
+                word_expansion_t* x = &expanded[t - first];
+                x->count = word_expand(lex, &lex->tokens[t], !assign, &x->fields);
+                if (x->count < 0) return -1;
+                if (target) {
+                    if (x->count != 1) {
+                        fprintf(stderr, "Error: Ambiguous redirection target '%.*s'\n",
+                                (int)lex->tokens[t].len, lex->text + lex->tokens[t].start);
+                        return -1;
+                    }
+                } else {
+                    argc += x->count - 1;
+                }
+            } else {
+                arg_bytes += lex->tokens[t].len + 1;
+            }
+            t++;
+        }
+        
+        if (t > stage_first) {
+            const token_t* lo = &lex->tokens[stage_first];
+            const token_t* hi = &lex->tokens[t - 1];
+            stage->text = lex->text + lo->start;
+            stage->text_len = (int)(hi->start + hi->len - lo->start);
+        } else {
+            stage->text = "";
+            stage->text_len = 0;
+        }
+        
+        // Debug output if SHELL_DEBUG is set
+        if (g_debug_mode) {
+            printf("Command %d: %.*s\n", i, stage->text_len, stage->text);
+            fflush(stdout);
+        }
+        
+        // A stage of assignments only sets shell variables (single commands)
+        if (argc == 0 && (num_assigns == 0 || num_stages > 1)) {
+            fprintf(stderr, "Error: Invalid command '' in pipeline\n");
+            return -1;
+        }
+        
+        // One vector for the pointers and one block for all argument bytes:
+        // no per-argument allocation and no ceiling other than ARG_MAX
+        stage->argc = argc;
+        stage->argv = arena_alloc((argc + 1) * sizeof(char*));
+        stage->arg_src = arena_alloc((argc + 1) * sizeof(char*));
+        stage->num_redirs = num_redirs;
+        stage->redirs = num_redirs ? arena_alloc(num_redirs * sizeof(redir_t)) : NULL;
+        stage->num_psubs = num_psubs;
+        stage->psubs = num_psubs ? arena_alloc(num_psubs * sizeof(psub_t)) : NULL;
+        stage->num_assigns = num_assigns;
+        stage->assigns = num_assigns ? arena_alloc(num_assigns * sizeof(char*)) : NULL;
+        stage->limits = NULL;
+        stage->sched = NULL;
+        char* bytes = arena_alloc(arg_bytes);
+        if (!stage->argv || !stage->arg_src || !bytes || (num_redirs && !stage->redirs) ||
+            (num_psubs && !stage->psubs) || (num_assigns && !stage->assigns)) return -1;
+        int a = 0, r = 0, ps = 0, as = 0;
+        for (int k = stage_first; k < t; k++) {
+            const token_t* tok = &lex->tokens[k];
+            if (as < num_assigns && tok->kind == TOK_WORD && token_is_assign(lex, tok)) {
+                // The leading NAME=value words come before any argument
+                if (tok->flags & TOKF_EXPAND) {
+                    stage->assigns[as++] = expanded[k - first].fields[0];
+                } else {
+                    stage->assigns[as++] = bytes;
+                    bytes = token_copy_arg(lex, tok, bytes);
+                }
+            } else if (tok->kind == TOK_PSUB) {
+                if (a == 0) {
+                    fprintf(stderr, "Error: Invalid command '' in pipeline\n");
+                    return -1;
+                }
+                psub_t* psub = &stage->psubs[ps++];
+                int close_tok = psub_end(lex, k);
+                psub->arg_index = a;
+                psub->output = lex->text[tok->start] == '>';
+                psub->fd = -1;
+                psub->num_stages = build_pipeline(lex, k + 1, close_tok, &psub->stages);
+                if (psub->num_stages <= 0) return -1;
+                stage->arg_src[a] = lex->text + tok->start;
+                stage->argv[a++] = NULL;
+                k = close_tok;
+            } else if (tok->kind == TOK_REDIR) {
+                const char* op = lex->text + tok->start;
+                redir_t* redir = &stage->redirs[r++];
+                redir->fd = op[0] == '<' ? STDIN_FILENO : op[0] == '2' ? STDERR_FILENO : STDOUT_FILENO;
+                redir->append = tok->len >= 2 && op[tok->len - 1] == '>' && op[tok->len - 2] == '>';
+                if (lex->tokens[++k].flags & TOKF_EXPAND) {
+                    redir->path = expanded[k - first].fields[0];
+                } else {
+                    redir->path = bytes;
+                    bytes = token_copy_arg(lex, &lex->tokens[k], bytes);
+                }
+            } else if (tok->flags & TOKF_EXPAND) {
+                const word_expansion_t* x = &expanded[k - first];
+                for (int f = 0; f < x->count; f++) {
+                    stage->arg_src[a] = lex->text + tok->start;
+                    stage->argv[a++] = x->fields[f];
+                }
+            } else {
+                stage->arg_src[a] = lex->text + tok->start;
+                stage->argv[a++] = bytes;
+                bytes = token_copy_arg(lex, tok, bytes);
+            }
+        }
+        stage->argv[argc] = NULL;
+        
+        t++; // Skip the '|' separator
+    }
+    
+    *stages_out = stages;
+    return num_stages;
+}
+
+#ifdef SHELL_HAVE_IO_URING
+/* Minimal io_uring instance: mmap'ed submission and completion rings */
+typedef struct {
+    int fd;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_len;
+    void* cq_ring;
+    size_t cq_ring_len;
+    size_t sqes_len;
+    unsigned queued;        // SQEs filled in since the last io_uring_enter
+    unsigned long enters;   // io_uring_enter calls, for SHELL_DEBUG
+} uring_t;
+
+/**
+ * Set up a ring; needs IORING_FEAT_RW_CUR_POS (Linux 5.6) so plain
+ * IORING_OP_READ/WRITE and offset -1 are available
+ * @return 0 on success, -1 if io_uring is unavailable or disabled
+ */
+static int uring_init(uring_t* ring, unsigned entries) {
+    static int unsupported = 0;
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    if (!g_io_uring || unsupported) return -1;
+    
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(SYS_io_uring_setup, entries, &params);
+    if (ring->fd == -1 || !(params.features & IORING_FEAT_RW_CUR_POS)) {
+        // ENOSYS, EPERM (kernel.io_uring_disabled), seccomp, old kernel
+        if (ring->fd != -1) close(ring->fd);
+        ring->fd = -1;
+        unsupported = 1;
+        return -1;
+    }
+    
+    ring->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP && ring->cq_ring_len > ring->sq_ring_len) {
+        ring->sq_ring_len = ring->cq_ring_len;
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = params.features & IORING_FEAT_SINGLE_MMAP ? ring->sq_ring :
+                    mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        ring->fd = -1;
+        return -1;
+    }
+    
+    char* sq = ring->sq_ring;
+    char* cq = ring->cq_ring;
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+/**
+ * Release a ring and its mappings
+ */
+static void uring_exit(uring_t* ring) {
+    if (ring->fd == -1) return;
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_len);
+    munmap(ring->sq_ring, ring->sq_ring_len);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+/**
+ * Queue one read or write; it is submitted with the next uring_enter()
+ * @param op IORING_OP_READ(_FIXED) or IORING_OP_WRITE(_FIXED)
+ * @param buf_index Registered buffer for the _FIXED opcodes
+ * @param offset File offset, -1 for the current position
+ */
+static void uring_queue(uring_t* ring, int op, int fd, void* buf, unsigned len, int buf_index,
+                        off_t offset, uint64_t user_data) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t)op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = (uint64_t)offset;
+    sqe->buf_index = (uint16_t)buf_index;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+}
+
+/**
+ * Submit everything queued and wait for at least min_complete completions,
+ * all in one system call
+ * @return 0 on success, -1 on error
+ */
+static int uring_enter(uring_t* ring, unsigned min_complete) {
+    int r;
+    do {
+        r = (int)syscall(SYS_io_uring_enter, ring->fd, ring->queued, min_complete,
+                         min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (r == -1 && errno == EINTR);
+    ring->enters++;
+    if (r >= 0) ring->queued -= (unsigned)r < ring->queued ? (unsigned)r : ring->queued;
+    return r < 0 ? -1 : 0;
+}
+
+/**
+ * Take one completion off the ring
+ * @return 1 if a completion was returned, 0 if none is ready
+ */
+static int uring_complete(uring_t* ring, uint64_t* user_data, int* res) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+    struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * Pipe-to-file draining for 'bulk' on io_uring. DIRECT_RING_BUFS registered,
+ * aligned buffers rotate: while full ones are written to the file, the next
+ * one is filled from the pipe, and each io_uring_enter both submits the new
+ * requests and collects finished ones. Writes carry explicit offsets so
+ * several can be in flight. '>>' is left to the read/write writer: explicit
+ * offsets would race other appenders to the same file, and O_APPEND stays set.
+ * @param bufs DIRECT_RING_BUFS buffers of DIRECT_CHUNK bytes
+ * @param tail Output: index of the buffer holding the unwritten tail
+ * @param fill Output: bytes in that buffer
+ * @return 0 at end of input, 1 if io_uring is unavailable (nothing consumed), -1 on error
+ */
+static int direct_sink_uring(char** bufs, int* tail, size_t* fill) {
+    if (fcntl(STDOUT_FILENO, F_GETFL) & O_APPEND) return 1;
+    uring_t ring;
+    if (uring_init(&ring, URING_ENTRIES) == -1) return 1;
+    
+    struct iovec iov[DIRECT_RING_BUFS];
+    for (int b = 0; b < DIRECT_RING_BUFS; b++) {
+        iov[b].iov_base = bufs[b];
+        iov[b].iov_len = DIRECT_CHUNK;
+    }
+    // Registration pins the buffers once instead of on every request
+    int fixed = syscall(SYS_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iov,
+                        DIRECT_RING_BUFS) == 0;
+    off_t offset = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+    if (offset == -1) offset = 0;
+    
+    int writing[DIRECT_RING_BUFS] = { 0 };  // Bytes not yet written per buffer
+    int retried[DIRECT_RING_BUFS] = { 0 };  // Rejected once by O_DIRECT
+    off_t write_off[DIRECT_RING_BUFS];
+    int in_flight = 0, reading = 0, eof = 0, failed = 0;
+    unsigned long long total = 0;
+    int cur = 0;
+    *fill = 0;
+    
+    while (!failed && (!eof || in_flight > 0)) {
+        if (!eof && !reading && !writing[cur]) {
+            uring_queue(&ring, fixed ? IORING_OP_READ_FIXED : IORING_OP_READ, STDIN_FILENO,
+                        bufs[cur] + *fill, DIRECT_CHUNK - *fill, cur, -1, DIRECT_RING_BUFS);
+            reading = 1;
+        }
+        if (uring_enter(&ring, 1) == -1) {
+            failed = 1;
+            break;
+        }
+        
+        uint64_t tag;
+        int res;
+        while (uring_complete(&ring, &tag, &res)) {
+            if (tag == DIRECT_RING_BUFS) {
+                // Pipe read into the current buffer
+                reading = 0;
+                if (res == -EINTR || res == -EAGAIN) continue;
+                if (res <= 0) {
+                    eof = 1;
+                    failed = res < 0;
+                    continue;
+                }
+                *fill += res;
+                total += res;
+                if (*fill < DIRECT_CHUNK) continue;
+                
+                writing[cur] = DIRECT_CHUNK;
+                write_off[cur] = offset;
+                uring_queue(&ring, fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, STDOUT_FILENO,
+                            bufs[cur], DIRECT_CHUNK, cur, offset, cur);
+                offset += DIRECT_CHUNK;
+                in_flight++;
+                cur = (cur + 1) % DIRECT_RING_BUFS;
+                *fill = 0;
+                continue;
+            }
+            
+            // File write of buffer tag
+            int b = (int)tag;
+            if (res == -EINVAL && !retried[b]) {
+                // Alignment not accepted here: continue through the page cache
+                fcntl(STDOUT_FILENO, F_SETFL, fcntl(STDOUT_FILENO, F_GETFL) & ~O_DIRECT);
+                retried[b] = 1;
+                res = -EAGAIN;
+            }
+            if (res > 0) {
+                writing[b] -= res;
+            } else if (res != -EAGAIN && res != -EINTR) {
+                errno = -res;
+                failed = 1;
+                continue;
+            }
+            if (writing[b] > 0) {
+                // Retry or short write: queue the rest of the buffer
+                uring_queue(&ring, fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, STDOUT_FILENO,
+                            bufs[b] + DIRECT_CHUNK - writing[b], writing[b], b,
+                            write_off[b] + DIRECT_CHUNK - writing[b], b);
+                continue;
+            }
+            retried[b] = 0;
+            in_flight--;
+        }
+    }
+    
+    if (!failed) {
+        lseek(STDOUT_FILENO, offset, SEEK_SET);
+    }
+    if (g_debug_mode) {
+        fprintf(stderr, "Bulk: io_uring%s, %llu bytes in %lu io_uring_enter calls\n",
+                fixed ? " (registered buffers)" : "", total, ring.enters);
+    }
+    uring_exit(&ring);
+    *tail = cur;
+    return failed ? -1 : 0;
+}
+
+/**
+ * Read through a small io_uring (the shell's own input); falls back to read(2)
+ * @return Bytes read, 0 at end of input, -1 on error
+ */
+static ssize_t io_read(int fd, void* buf, size_t len) {
+    static uring_t ring = { .fd = -1 };
+    static int tried = 0;
+    static int reads = 0;
+    // The first read, often the only one, does not pay for the ring setup
+    if (!tried && reads++ > 0) {
+        tried = 1;
+        uring_init(&ring, 2);
+    }
+    if (ring.fd == -1) {
+        return read(fd, buf, len);
+    }
+    
+    uring_queue(&ring, IORING_OP_READ, fd, buf, (unsigned)len, 0, -1, 0);
+    uint64_t tag;
+    int res;
+    if (uring_enter(&ring, 1) == -1 || !uring_complete(&ring, &tag, &res)) {
+        return -1;
+    }
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
+#else
+/**
+ * Read the shell's own input (no io_uring headers at build time)
+ */
+static ssize_t io_read(int fd, void* buf, size_t len) {
+    return read(fd, buf, len);
+}
+#endif
+
+/**
+ * Streaming writer for 'bulk' output redirections: copy stdin (a large pipe)
+ * to stdout (the O_DIRECT file) in DIRECT_CHUNK aligned writes. The unaligned
+ * tail, or any write the filesystem rejects, goes through the page cache.
+ */
+static void direct_sink_main(void) __attribute__((noreturn));
+static void direct_sink_main(void) {
+    char* buf = aligned_alloc(DIRECT_ALIGN, DIRECT_CHUNK);
+    size_t fill = 0;
+    int failed = !buf;
+    
+#ifdef SHELL_HAVE_IO_URING
+    // Batched submissions when the kernel has io_uring, else read/write below
+    char* bufs[DIRECT_RING_BUFS] = { buf };
+    for (int b = 1; b < DIRECT_RING_BUFS && !failed; b++) {
+        bufs[b] = aligned_alloc(DIRECT_ALIGN, DIRECT_CHUNK);
+        failed = !bufs[b];
+    }
+    int tail = 0;
+    int done = failed ? -1 : direct_sink_uring(bufs, &tail, &fill);
+    if (done == 0) {
+        buf = bufs[tail];
+    } else if (done == -1) {
+        failed = 1;
+    }
+    if (done != 1) {
+        // Only the tail is left (or nothing, on error)
+        if (!failed && fill > 0) {
+            fcntl(STDOUT_FILENO, F_SETFL, fcntl(STDOUT_FILENO, F_GETFL) & ~O_DIRECT);
+            failed = write_all(STDOUT_FILENO, buf, fill) == -1;
+        }
+        if (failed) {
+            perror("bulk write");
+        }
+        _exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+#endif
+    
+    while (!failed) {
+        ssize_t n = read(STDIN_FILENO, buf + fill, DIRECT_CHUNK - fill);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            failed = n < 0;
+            break;
+        }
+        fill += n;
+        if (fill < DIRECT_CHUNK) continue;
+        
+        if (write_all(STDOUT_FILENO, buf, fill) == -1) {
+            // EINVAL: alignment not accepted here (e.g. appending at an odd offset)
+            if (errno != EINVAL) {
+                failed = 1;
+                break;
+            }
+            fcntl(STDOUT_FILENO, F_SETFL, fcntl(STDOUT_FILENO, F_GETFL) & ~O_DIRECT);
+            failed = write_all(STDOUT_FILENO, buf, fill) == -1;
+        }
+        fill = 0;
+    }
+    
+    if (!failed && fill > 0) {
+        fcntl(STDOUT_FILENO, F_SETFL, fcntl(STDOUT_FILENO, F_GETFL) & ~O_DIRECT);
+        failed = write_all(STDOUT_FILENO, buf, fill) == -1;
+    }
+    if (failed) {
+        perror("bulk write");
+    }
+    _exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/**
+ * Start a direct_sink_main process writing to file_fd
+ * @param file_fd File opened with O_DIRECT (consumed)
+ * @param sink Output: pid of the writer
+ * @return Write end of the pipe feeding the writer, -1 on failure
+ */
+static int direct_sink_spawn(int file_fd, pid_t* sink) {
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) == -1) {
+        perror("pipe");
+        close(file_fd);
+        return -1;
+    }
+    fcntl(p[1], F_SETPIPE_SZ, DIRECT_CHUNK);
+    
+    *sink = shell_fork();
+    if (*sink == 0) {
+        // Keep only the pipe, the file and stderr: no pipeline pipe may stay open here
+        signal(SIGINT, SIG_IGN);
+        dup2(p[0], STDIN_FILENO);
+        dup2(file_fd, STDOUT_FILENO);
+        if (syscall(SYS_close_range, 3, ~0U, 0) == -1) {
+            for (int fd = 3; fd < 1024; fd++) close(fd);
+        }
+        direct_sink_main();
+    }
+    close(p[0]);
+    close(file_fd);
+    if (*sink == -1) {
+        perror("fork");
+        close(p[1]);
+        return -1;
+    }
+    return p[1];
+}
+
+/**
+ * Open the file redirections of a stage in the shell
+ * Files are opened close-on-exec; the launcher installs them on 0/1/2.
+ * With 'bulk', inputs get sequential readahead hints and stdout files are
+ * written with O_DIRECT through a writer process fed by a large pipe.
+ * @param stage Stage whose redirections to open
+ * @param bulk Non-zero for the bulk I/O options
+ * @param fds Output: replacement stdin/stdout/stderr, -1 where unchanged
+ * @param sink Output: pid of the O_DIRECT writer, -1 if none
+ * @return SUCCESS, or ERROR_GENERAL after reporting the failing file
+ */
+static int open_redirections(const stage_t* stage, int bulk, int fds[3], pid_t* sink) {
+    int failed = 0;
+    fds[0] = fds[1] = fds[2] = -1;
+    *sink = -1;
+    
+    for (int r = 0; r < stage->num_redirs && !failed; r++) {
+        const redir_t* redir = &stage->redirs[r];
+        int flags = O_CLOEXEC;
+        if (redir->fd == STDIN_FILENO) {
+            flags |= O_RDONLY;
+        } else {
+            flags |= O_WRONLY | O_CREAT | (redir->append ? O_APPEND : O_TRUNC);
+        }
+        int direct = bulk && redir->fd == STDOUT_FILENO;
+        
+        int fd = open(redir->path, flags | (direct ? O_DIRECT : 0), 0666);
+        if (fd == -1 && direct && errno == EINVAL) {
+            // Filesystem without O_DIRECT (tmpfs, ...)
+            direct = 0;
+            fd = open(redir->path, flags, 0666);
+        }
+        if (fd == -1) {
+            fprintf(stderr, "Error: cannot open '%s': %s\n", redir->path, strerror(errno));
+            failed = 1;
+            break;
+        }
+        
+        if (bulk && redir->fd == STDIN_FILENO) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        }
+        if (direct) {
+            if (*sink != -1) {
+                // Only the last stdout redirection is written; finish the earlier writer
+                close(fds[STDOUT_FILENO]);
+                fds[STDOUT_FILENO] = -1;
+                waitpid(*sink, NULL, 0);
+            }
+            fd = direct_sink_spawn(fd, sink);
+            if (fd == -1) {
+                failed = 1;
+                break;
+            }
+        }
+        
+        if (fds[redir->fd] != -1) close(fds[redir->fd]);
+        fds[redir->fd] = fd;
+    }
+    
+    if (!failed) {
+        return SUCCESS;
+    }
+    
+    // Undo everything opened so far
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] != -1) close(fds[i]);
+        fds[i] = -1;
+    }
+    if (*sink != -1) {
+        waitpid(*sink, NULL, 0);
+        *sink = -1;
+    }
+    return ERROR_GENERAL;
+}
+
+/**
+ * Move exactly len bytes from a pipe to fd without copying when possible;
+ * fds that cannot be spliced into get a read/write copy instead
+ * @return Number of bytes that could not be moved (0 on success)
+ */
+static size_t relay_move(int from, int to, size_t len) {
+    static char buf[RELAY_CHUNK];
+    
+    while (len > 0) {
+        ssize_t n = splice(from, NULL, to, NULL, len, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EINVAL) {
+            n = read(from, buf, len < sizeof(buf) ? len : sizeof(buf));
+            if (n > 0 && write_all(to, buf, n) == -1) {
+                // Bytes already taken from the pipe are lost with the reader
+                len -= n;
+                break;
+            }
+        }
+        if (n <= 0) break;
+        len -= n;
+    }
+    return len;
+}
+
+/* Zero-copy fan-out: link j duplicates its input into branch j with tee(2)
+   and moves the same bytes on to link j + 1 (or the main output) */
+typedef struct {
+    int num_links;
+    int* in;                // Input pipe of each link
+    int* branch;            // Branch pipe of each link, -1 once its reader is gone
+    int* next;              // Output of each link: next link's pipe or the main output
+    int devnull;            // Replaces the main output once its reader is gone
+} tee_chain_t;
+
+/**
+ * Push len bytes (already queued in link j's input) through links j..end
+ */
+static void tee_link(tee_chain_t* chain, int j, size_t len) {
+    while (len > 0) {
+        size_t n = len;
+        if (chain->branch[j] != -1) {
+            ssize_t dup = tee(chain->in[j], chain->branch[j], len, 0);
+            if (dup < 0) {
+                if (errno == EINTR) continue;
+                close(chain->branch[j]);
+                chain->branch[j] = -1;
+            } else {
+                n = dup;
+            }
+        }
+        
+        size_t left = relay_move(chain->in[j], chain->next[j], n);
+        if (left > 0 && j == chain->num_links - 1 && chain->next[j] != chain->devnull) {
+            // Main consumer exited: keep feeding the branches
+            chain->next[j] = chain->devnull;
+            left = relay_move(chain->in[j], chain->devnull, left);
+        }
+        if (j < chain->num_links - 1) {
+            tee_link(chain, j + 1, n - left);
+        }
+        len -= n;
+    }
+}
+
+/**
+ * Child body of 'tee >(a) >(b) ...': copy stdin to every branch and stdout.
+ * Each branch costs one tee(2) and one splice of page references, no data
+ * copy. Falls back to read/write when stdin is not a pipe.
+ * @param branches Stage side of the >( ) edges
+ * @param num_branches Number of branches
+ */
+static void tee_relay_main(const int* branches, int num_branches) __attribute__((noreturn));
+static void tee_relay_main(const int* branches, int num_branches) {
+    signal(SIGPIPE, SIG_IGN);
+    struct stat st;
+    
+    if (fstat(STDIN_FILENO, &st) == -1 || !S_ISFIFO(st.st_mode)) {
+        static char buf[RELAY_CHUNK];
+        int* out = malloc((num_branches + 1) * sizeof(int));
+        if (!out) _exit(EXIT_FAILURE);
+        memcpy(out, branches, num_branches * sizeof(int));
+        out[num_branches] = STDOUT_FILENO;
+        ssize_t n;
+        while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR)) {
+            for (int i = 0; i <= num_branches; i++) {
+                if (out[i] != -1 && n > 0 && write_all(out[i], buf, n) == -1) out[i] = -1;
+            }
+        }
+        _exit(EXIT_SUCCESS);
+    }
+    
+    // Links after the first read from private pipes as large as the input
+    tee_chain_t chain;
+    chain.num_links = num_branches;
+    chain.in = malloc(num_branches * sizeof(int));
+    chain.branch = malloc(num_branches * sizeof(int));
+    chain.next = malloc(num_branches * sizeof(int));
+    chain.devnull = open("/dev/null", O_WRONLY);
+    if (!chain.in || !chain.branch || !chain.next || chain.devnull == -1) _exit(EXIT_FAILURE);
+    
+    int capacity = fcntl(STDIN_FILENO, F_GETPIPE_SZ);
+    chain.in[0] = STDIN_FILENO;
+    for (int j = 0; j < num_branches; j++) {
+        chain.branch[j] = branches[j];
+        if (j == num_branches - 1) {
+            chain.next[j] = STDOUT_FILENO;
+            break;
+        }
+        int mid[2];
+        if (pipe(mid) == -1) _exit(EXIT_FAILURE);
+        if (capacity > 0) fcntl(mid[1], F_SETPIPE_SZ, capacity);
+        chain.next[j] = mid[1];
+        chain.in[j + 1] = mid[0];
+    }
+    
+    for (;;) {
+        struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+        if (poll(&pfd, 1, -1) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        int queued = 0;
+        if (ioctl(STDIN_FILENO, FIONREAD, &queued) == -1 || queued == 0) {
+            break; // Writer gone and pipe drained
+        }
+        tee_link(&chain, 0, queued < RELAY_CHUNK ? (size_t)queued : RELAY_CHUNK);
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+/**
+ * Child body of 'cat <(a) <(b) ...': splice every input, in order, to stdout
+ * @param inputs Stage side of the <( ) edges
+ * @param num_inputs Number of inputs
+ */
+static void cat_relay_main(const int* inputs, int num_inputs) __attribute__((noreturn));
+static void cat_relay_main(const int* inputs, int num_inputs) {
+    signal(SIGPIPE, SIG_IGN);
+    for (int i = 0; i < num_inputs; i++) {
+        for (;;) {
+            int queued = 0;
+            struct pollfd pfd = { inputs[i], POLLIN, 0 };
+            if (poll(&pfd, 1, -1) == -1) {
+                if (errno == EINTR) continue;
+                _exit(EXIT_FAILURE);
+            }
+            if (ioctl(inputs[i], FIONREAD, &queued) == -1 || queued == 0) break;
+            if (relay_move(inputs[i], STDOUT_FILENO, queued) > 0) _exit(EXIT_FAILURE);
+        }
+        close(inputs[i]);
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+/**
+ * Run a fan-out/fan-in stage inside the shell's child instead of exec'ing
+ * tee or cat, when every argument is a process substitution of the right
+ * direction. Returns only if the stage does not qualify.
+ */
+static void psub_relay(const stage_t* stage) {
+    int is_tee = strcmp(stage->argv[0], "tee") == 0;
+    if ((!is_tee && strcmp(stage->argv[0], "cat") != 0) ||
+        stage->num_psubs == 0 || stage->num_psubs != stage->argc - 1) {
+        return;
+    }
+    int* fds = malloc(stage->num_psubs * sizeof(int));
+    if (!fds) return;
+    for (int j = 0; j < stage->num_psubs; j++) {
+        if (stage->psubs[j].output != is_tee) {
+            free(fds);
+            return;
+        }
+        fds[j] = stage->psubs[j].fd;
+    }
+    coproc_close_child();
+    if (is_tee) {
+        tee_relay_main(fds, stage->num_psubs);
+    }
+    cat_relay_main(fds, stage->num_psubs);
+}
+
+/* Pipeline options given as prefixes of the first stage */
+typedef struct {
+    int timing;             // 0, TIME_TEXT or TIME_JSON
+    int profile;            // Relay every pipe through the throughput profiler
+    int bulk;               // Readahead hints and O_DIRECT output on redirections
+    int memo;               // Serve the command from the result cache
+    job_limits_t limits;    // cgroup limits collected from 'limit' prefixes
+    int pin;                // Place adjacent stages on cache-sharing CPUs
+    int scheduled;          // Some stage carries a 'sched' prefix
+    const char* coproc;     // Name of the coprocess to start, NULL otherwise
+} pipeline_opts_t;
+
+/* Relay state of one profiled pipe */
+typedef enum { RELAY_MOVING = 0, RELAY_EMPTY, RELAY_FULL, RELAY_DONE } relay_state_t;
+
+/* Throughput accounting for the pipe between stage i and stage i + 1 */
+typedef struct {
+    int in_fd;              // Relay end of the pipe written by stage i
+    int out_fd;             // Relay end of the pipe read by stage i + 1
+    relay_state_t state;
+    unsigned long long bytes;
+    struct timespec since;  // Entry into the current state
+    struct timespec end;    // Producer EOF or consumer exit
+    double empty;           // Seconds waiting for stage i to write
+    double full;            // Seconds waiting for stage i + 1 to read
+} pipe_profile_t;
+
+/**
+ * Strip a 'sched [-C cpus] [-M node] [-n nice] [-b|-i] [-I class[:level]]'
+ * prefix from a stage: CPU affinity, NUMA node (CPUs and memory), nice
+ * value, SCHED_BATCH / SCHED_IDLE and I/O priority (rt, be or idle)
+ * @param stage Stage whose argv and text are advanced past the prefix
+ * @return SUCCESS, or ERROR_GENERAL on a malformed prefix (already reported)
+ */
+static int parse_stage_sched(stage_t* stage) {
+    if (stage->argc == 0 || strcmp(stage->argv[0], "sched") != 0) {
+        return SUCCESS;
+    }
+    
+    stage_sched_t* sched = arena_alloc(sizeof(stage_sched_t));
+    if (!sched) return ERROR_MEMORY;
+    memset(sched, 0, sizeof(*sched));
+    sched->node = -1;
+    sched->nice = INT_MIN;
+    sched->policy = -1;
+    sched->ioprio = -1;
+    
+    int i = 1;
+    while (i < stage->argc && stage->argv[i][0] == '-' && stage->argv[i][1] && !stage->argv[i][2]) {
+        char opt = stage->argv[i][1];
+        if (opt == 'b' || opt == 'i') {
+            sched->policy = opt == 'b' ? SCHED_BATCH : SCHED_IDLE;
+            i++;
+            continue;
+        }
+        if (i + 1 >= stage->argc) break;
+        const char* value = stage->argv[i + 1];
+        char* end = NULL;
+        int ok = 1;
+        if (opt == 'C') {
+            ok = parse_cpu_list(value, &sched->cpus) == 0;
+            sched->has_cpus = 1;
+        } else if (opt == 'M') {
+            char dir[64], buf[4096];
+            sched->node = (int)strtol(value, &end, 10);
+            snprintf(dir, sizeof(dir), "/sys/devices/system/node/node%d", sched->node);
+            ok = *end == '\0' && sched->node >= 0 && cgroup_read(dir, "cpulist", buf, sizeof(buf)) > 0 &&
+                 parse_cpu_list(buf, &sched->cpus) == 0;
+            sched->has_cpus = 1;
+        } else if (opt == 'n') {
+            sched->nice = (int)strtol(value, &end, 10);
+            ok = *end == '\0' && sched->nice >= -20 && sched->nice <= 19;
+        } else if (opt == 'I') {
+            static const char* classes[] = { "rt", "be", "idle" };
+            size_t len = strcspn(value, ":");
+            int level = value[len] == ':' ? (int)strtol(value + len + 1, &end, 10) : 4;
+            ok = 0;
+            for (int c = 0; c < 3; c++) {
+                if (strlen(classes[c]) == len && strncmp(value, classes[c], len) == 0) {
+                    sched->ioprio = ((c + 1) << IOPRIO_CLASS_SHIFT) | (c == 2 ? 0 : level);
+                    ok = (!end || *end == '\0') && level >= 0 && level <= 7;
+                }
+            }
+        } else {
+            ok = 0;
+        }
+        if (!ok) {
+            fprintf(stderr, "sched: invalid option '%s %s'\n", stage->argv[i], value);
+            return ERROR_GENERAL;
+        }
+        i += 2;
+    }
+    if (i >= stage->argc || stage->argv[i][0] == '-') {
+        fprintf(stderr, "Usage: sched [-C cpus] [-M node] [-n nice] [-b|-i] "
+                        "[-I rt|be|idle[:level]] command\n");
+        return ERROR_GENERAL;
+    }
+    
+    stage_shift(stage, i);
+    stage->sched = sched;
+    return SUCCESS;
+}
+
+/**
+ * Pin stage i to the i-th CPU of the cache-aware order, so that stages
+ * exchanging data through a pipe run on CPUs sharing L2 or at least L3.
+ * Stages with an explicit 'sched -C' / '-M' keep their CPUs.
+ * @return SUCCESS, or ERROR_MEMORY
+ */
+static int place_pipeline(stage_t* stages, int num_stages) {
+    int num_cpus;
+    const int* order = cpu_placement_order(&num_cpus);
+    if (!order || num_cpus < 2) {
+        return SUCCESS; // Nothing to choose from
+    }
+    
+    for (int i = 0; i < num_stages; i++) {
+        stage_sched_t* sched = stages[i].sched;
+        if (sched && sched->has_cpus) continue;
+        if (!sched) {
+            sched = stages[i].sched = arena_alloc(sizeof(stage_sched_t));
+            if (!sched) return ERROR_MEMORY;
+            memset(sched, 0, sizeof(*sched));
+            sched->node = -1;
+            sched->nice = INT_MIN;
+            sched->policy = -1;
+            sched->ioprio = -1;
+        }
+        int cpu = order[i % num_cpus];
+        CPU_ZERO(&sched->cpus);
+        CPU_SET(cpu, &sched->cpus);
+        sched->has_cpus = 1;
+        if (g_debug_mode) {
+            fprintf(stderr, "Pin: stage %d (%.*s) -> cpu %d\n", i, stages[i].text_len,
+                    stages[i].text, cpu);
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ * Make every stage of a pipeline, nested pipelines included, join a job cgroup
+ * @param procs cgroup.procs descriptor of the job cgroup
+ * @return SUCCESS, or ERROR_MEMORY
+ */
+static int attach_job_cgroup(stage_t* stages, int num_stages, int procs) {
+    for (int i = 0; i < num_stages; i++) {
+        if (!stages[i].limits) {
+            stages[i].limits = arena_alloc(sizeof(stage_limits_t));
+            if (!stages[i].limits) return ERROR_MEMORY;
+            stages[i].limits->cpu = stages[i].limits->as = stages[i].limits->nofile = RLIM_INFINITY;
+        }
+        stages[i].limits->cgroup_procs = procs;
+        for (int j = 0; j < stages[i].num_psubs; j++) {
+            if (attach_job_cgroup(stages[i].psubs[j].stages, stages[i].psubs[j].num_stages,
+                                  procs) != SUCCESS) return ERROR_MEMORY;
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ * Fork every stage of a pipeline and wire the pipes between them
+ * Pipes are created one stage at a time, so the shell never holds more
+ * than one pipe plus one read end, whatever the pipeline length
+ * @param stages Array of parsed stages
+ * @param num_commands Number of commands in pipeline
+ * @param pids Output array (pipeline_slots() entries): stage pids, -1 if not
+ *             started, the O_DIRECT writer of each stage or -1, then the
+ *             slots of every process substitution
+ * @param in_fd Input of the first stage
+ * @param out_fd Output of the last stage
+ * @param background Non-zero to detach the first stage from the shell's stdin
+ * @param bulk Non-zero for the bulk redirection options
+ * @param stats Optional per-stage accounting, start times are recorded here
+ * @param edges Optional profiler state (num_commands - 1 entries); when given,
+ *              every pipe is split in two and the shell keeps the middle ends
+ * @return SUCCESS on success, error code on failure
+ */
+static int spawn_pipeline(stage_t* stages, int num_commands, pid_t* pids, int in_fd, int out_fd,
+                          int background, int bulk, stage_stats_t* stats, pipe_profile_t* edges) {
+    int prev_read = -1;     // Read end of the pipe feeding stage i
+    int result = SUCCESS;
+    int slot = 2 * num_commands;    // Next free slot for nested pipelines
+    
+    int num_slots = pipeline_slots(stages, num_commands);
+    for (int i = 0; i < num_slots; i++) {
+        pids[i] = -1;
+    }
+    
+    // Create child processes
+    for (int i = 0; i < num_commands; i++) {
+        int next[2] = { -1, -1 };
+        
+        if (i < num_commands - 1) {
+            int failed;
+            if (edges) {
+                // stage i -> up[1] ... up[0] -> shell -> down[1] ... down[0] -> stage i + 1
+                int up[2], down[2];
+                failed = pipe2(up, O_CLOEXEC) == -1;
+                if (!failed && pipe2(down, O_CLOEXEC) == -1) {
+                    close(up[0]);
+                    close(up[1]);
+                    failed = 1;
+                }
+                if (!failed) {
+                    next[0] = down[0];
+                    next[1] = up[1];
+                    edges[i].in_fd = up[0];
+                    edges[i].out_fd = down[1];
+                    fcntl(up[0], F_SETFL, O_NONBLOCK);
+                    fcntl(down[1], F_SETFL, O_NONBLOCK);
+                }
+            } else {
+                failed = pipe2(next, O_CLOEXEC) == -1;
+            }
+            if (failed) {
+                perror("pipe");
+                if (prev_read != -1) close(prev_read);
+                return ERROR_PIPE;
+            }
+        }
+        
+        // Final stdio of the stage: pipes, then /dev/null for background
+        // input, then file redirections on top
+        int redir[3];
+        int io[3] = { prev_read != -1 ? prev_read : in_fd,
+                      next[1] != -1 ? next[1] : out_fd,
+                      STDERR_FILENO };
+        int devnull = -1;
+        if (background && i == 0 && in_fd == STDIN_FILENO) {
+            // Background jobs must not compete with the shell for its input
+            devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            if (devnull != -1) io[0] = devnull;
+        }
+        int launch = open_redirections(&stages[i], bulk, redir, &pids[num_commands + i]) == SUCCESS;
+        for (int k = 0; launch && k < 3; k++) {
+            if (redir[k] != -1) io[k] = redir[k];
+        }
+        
+        // One pipe per process substitution edge; the nested pipeline gets
+        // the other end and the shell's own stdio otherwise
+        for (int j = 0; j < stages[i].num_psubs; j++) {
+            psub_t* psub = &stages[i].psubs[j];
+            int edge[2];
+            int nested_slots = pipeline_slots(psub->stages, psub->num_stages);
+            if (!launch || pipe2(edge, O_CLOEXEC) == -1) {
+                launch = 0;
+                slot += nested_slots;
+                continue;
+            }
+            psub->fd = edge[psub->output ? 1 : 0];
+            char* path = arena_alloc(32);
+            if (path) {
+                snprintf(path, 32, "/dev/fd/%d", psub->fd);
+            }
+            stages[i].argv[psub->arg_index] = path ? path : "/dev/null";
+            if (psub->output) {
+                spawn_pipeline(psub->stages, psub->num_stages, pids + slot, edge[0], STDOUT_FILENO,
+                               0, bulk, NULL, NULL);
+                close(edge[0]);
+            } else {
+                spawn_pipeline(psub->stages, psub->num_stages, pids + slot, STDIN_FILENO, edge[1],
+                               background, bulk, NULL, NULL);
+                close(edge[1]);
+            }
+            slot += nested_slots;
+        }
+        
+        if (!launch) {
+            // Like bash: the stage does not run, its neighbours see EOF / EPIPE
+            result = ERROR_GENERAL;
+        }
+        
+        if (stats) {
+            clock_gettime(CLOCK_MONOTONIC, &stats[i].start);
+        }
+        
+        // External commands go through an idle pre-forked helper when available
+        // (not with process substitutions: their /dev/fd numbers must survive,
+        // nor with limits, placement or assignments: they are installed
+        // between fork and exec)
+        if (launch && !find_builtin(stages[i].argv[0]) && stages[i].num_psubs == 0 &&
+            !stages[i].limits && !stages[i].sched && !stages[i].num_assigns) {
+            pids[i] = pool_launch(stages[i].argv, io[0], io[1], io[2]);
+        }
+        
+        if (launch && pids[i] == -1) {
+            pids[i] = shell_fork();
+            if (pids[i] == -1) {
+                perror("fork");
+                result = ERROR_FORK;
+            }
+        }
+        
+        if (launch && pids[i] == 0) {
+            // Child process i
+            for (int k = 0; k < 3; k++) {
+                if (io[k] != k && dup2(io[k], k) == -1) {
+                    perror("dup2");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            if (prev_read != -1) close(prev_read);
+            if (next[0] != -1) close(next[0]);
+            if (next[1] != -1) close(next[1]);
+            
+            // Relay ends are close-on-exec, but in-process built-ins never exec
+            for (int j = 0; edges && j <= i && j < num_commands - 1; j++) {
+                close(edges[j].in_fd);
+                close(edges[j].out_fd);
+            }
+            
+            // For long pipelines, disable buffering to improve flow
+            if (num_commands > 10) {
+                setvbuf(stdout, NULL, _IONBF, 0);
+                setvbuf(stdin, NULL, _IONBF, 0);
+            }
+            
+            // Substitution edges must survive exec under their /dev/fd number
+            for (int j = 0; j < stages[i].num_psubs; j++) {
+                fcntl(stages[i].psubs[j].fd, F_SETFD, 0);
+            }
+            apply_stage_limits(stages[i].limits);
+            apply_stage_sched(stages[i].sched);
+            env_apply(stages[i].assigns, stages[i].num_assigns);
+            psub_relay(&stages[i]);
+            
+            // Execute the command (built-ins such as 'exit' just run and exit)
+            exec_child(stages[i].argv);
+        }
+        
+        // In parent: the previous read end now belongs to stage i and the
+        // write end of the new pipe to stage i; only the new read end is kept
+        if (devnull != -1) close(devnull);
+        for (int k = 0; launch && k < 3; k++) {
+            if (redir[k] != -1) close(redir[k]);
+        }
+        for (int j = 0; j < stages[i].num_psubs; j++) {
+            if (stages[i].psubs[j].fd != -1) close(stages[i].psubs[j].fd);
+            stages[i].psubs[j].fd = -1;
+        }
+        if (prev_read != -1) close(prev_read);
+        if (next[1] != -1) close(next[1]);
+        prev_read = next[0];
+        
+        if (result == ERROR_FORK) {
+            if (prev_read != -1) close(prev_read);
+            return result;
+        }
+    }
+    
+    return result;
+}
+
+/**
+ * Wait for the helper processes of a pipeline (O_DIRECT writers, process
+ * substitutions) once its main stages are done
+ * @param pids Helper pids, -1 entries are skipped
+ * @param count Number of entries
+ */
+static void wait_for_helpers(const pid_t* pids, int count) {
+    for (int i = 0; i < count; i++) {
+        if (pids[i] > 0) reap_stage(pids[i], 0, NULL);
+    }
+}
+
+/**
+ * Report per-stage and total resource usage of a timed pipeline on stderr
+ * @param stages Pipeline stages
+ * @param num_commands Number of stages
+ * @param pids Stage pids
+ * @param stats Per-stage accounting collected by spawn/wait
+ * @param json Non-zero for a JSON document instead of text
+ */
+static void report_pipeline_times(const stage_t* stages, int num_commands, const pid_t* pids,
+                                  const stage_stats_t* stats, int json) {
+    struct timespec first = stats[0].start, last = stats[0].end;
+    double user = 0, sys = 0;
+    long maxrss = 0, nvcsw = 0, nivcsw = 0, minflt = 0, majflt = 0;
+    
+    for (int i = 0; i < num_commands; i++) {
+        const struct rusage* ru = &stats[i].usage;
+        if (timespec_elapsed(&stats[i].start, &first) > 0) first = stats[i].start;
+        if (timespec_elapsed(&last, &stats[i].end) > 0) last = stats[i].end;
+        user += timeval_seconds(&ru->ru_utime);
+        sys += timeval_seconds(&ru->ru_stime);
+        if (ru->ru_maxrss > maxrss) maxrss = ru->ru_maxrss;
+        nvcsw += ru->ru_nvcsw;
+        nivcsw += ru->ru_nivcsw;
+        minflt += ru->ru_minflt;
+        majflt += ru->ru_majflt;
+    }
+    
+    if (json) {
+        fprintf(stderr, "{\"stages\":[");
+        for (int i = 0; i < num_commands; i++) {
+            const struct rusage* ru = &stats[i].usage;
+            fprintf(stderr, "%s{\"command\":", i ? "," : "");
+            json_print_string(stderr, stages[i].text, stages[i].text_len);
+            fprintf(stderr, ",\"pid\":%d,\"exit\":%d,\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,"
+                    "\"maxrss_kb\":%ld,\"vcsw\":%ld,\"ivcsw\":%ld,\"minflt\":%ld,\"majflt\":%ld}",
+                    pids[i], status_to_exit_code(stats[i].status),
+                    timespec_elapsed(&stats[i].start, &stats[i].end),
+                    timeval_seconds(&ru->ru_utime), timeval_seconds(&ru->ru_stime),
+                    ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw, ru->ru_minflt, ru->ru_majflt);
+        }
+        fprintf(stderr, "],\"total\":{\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss_kb\":%ld,"
+                "\"vcsw\":%ld,\"ivcsw\":%ld,\"minflt\":%ld,\"majflt\":%ld}}\n",
+                timespec_elapsed(&first, &last), user, sys, maxrss, nvcsw, nivcsw, minflt, majflt);
+        return;
+    }
+    
+    for (int i = 0; i < num_commands; i++) {
+        const struct rusage* ru = &stats[i].usage;
+        fprintf(stderr, "time: [%d] %-20.*s real %.3fs user %.3fs sys %.3fs maxrss %ldKB "
+                "csw %ld/%ld flt %ld/%ld exit %d\n",
+                i, stages[i].text_len, stages[i].text,
+                timespec_elapsed(&stats[i].start, &stats[i].end),
+                timeval_seconds(&ru->ru_utime), timeval_seconds(&ru->ru_stime), ru->ru_maxrss,
+                ru->ru_nvcsw, ru->ru_nivcsw, ru->ru_minflt, ru->ru_majflt,
+                status_to_exit_code(stats[i].status));
+    }
+    fprintf(stderr, "time: total %-19s real %.3fs user %.3fs sys %.3fs maxrss %ldKB "
+            "csw %ld/%ld flt %ld/%ld\n", "",
+            timespec_elapsed(&first, &last), user, sys, maxrss, nvcsw, nivcsw, minflt, majflt);
+}
+
+/**
+ * Report a timed background job, once all of its stages are reaped, the
+ * way 'time' reports a foreground pipeline
+ */
+static void job_report_times(const job_t* job) {
+    if (!job->times) return;
+    int n = job->num_stages;
+    stage_t* stages = calloc(n, sizeof(stage_t));
+    pid_t* pids = malloc(n * sizeof(pid_t));
+    stage_stats_t* stats = malloc(n * sizeof(stage_stats_t));
+    if (stages && pids && stats) {
+        for (int i = 0; i < n; i++) {
+            stages[i].text = job->command + job->times[i].text_off;
+            stages[i].text_len = job->times[i].text_len;
+            pids[i] = job->times[i].pid;
+            stats[i] = job->times[i].stats;
+        }
+        report_pipeline_times(stages, n, pids, stats, job->timing == TIME_JSON);
+    }
+    free(stages);
+    free(pids);
+    free(stats);
+}
+
+/**
+ * Move a profiled pipe into a new state, charging the time spent in the old one
+ * @param edge Pipe accounting
+ * @param state New state
+ */
+static void relay_set_state(pipe_profile_t* edge, relay_state_t state) {
+    if (edge->state == state) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (edge->state == RELAY_EMPTY) {
+        edge->empty += timespec_elapsed(&edge->since, &now);
+    } else if (edge->state == RELAY_FULL) {
+        edge->full += timespec_elapsed(&edge->since, &now);
+    }
+    edge->since = now;
+    edge->state = state;
+    if (state == RELAY_DONE) {
+        // Closing both ends passes EOF downstream and SIGPIPE upstream
+        edge->end = now;
+        close(edge->in_fd);
+        close(edge->out_fd);
+    }
+}
+
+/**
+ * Splice as much as possible from stage i's pipe into stage i + 1's pipe
+ * @param edge Pipe accounting
+ */
+static void relay_pump(pipe_profile_t* edge) {
+    for (;;) {
+        ssize_t n = splice(edge->in_fd, NULL, edge->out_fd, NULL, RELAY_CHUNK,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            edge->bytes += n;
+            relay_set_state(edge, RELAY_MOVING);
+        } else if (n == 0) {
+            relay_set_state(edge, RELAY_DONE);
+            return;
+        } else if (errno == EAGAIN) {
+            // Data still queued on the input side means the consumer is behind
+            int queued = 0;
+            ioctl(edge->in_fd, FIONREAD, &queued);
+            relay_set_state(edge, queued > 0 ? RELAY_FULL : RELAY_EMPTY);
+            return;
+        } else if (errno != EINTR) {
+            // EPIPE: stage i + 1 is gone
+            relay_set_state(edge, RELAY_DONE);
+            return;
+        }
+    }
+}
+
+/**
+ * Relay every profiled pipe until all producers finish or all consumers exit
+ * @param edges Pipe accounting, one entry per pipe
+ * @param num_edges Number of pipes
+ */
+static void relay_pipeline(pipe_profile_t* edges, int num_edges) {
+    struct pollfd* fds = arena_alloc(num_edges * sizeof(struct pollfd));
+    int* owner = arena_alloc(num_edges * sizeof(int));
+    if (!fds || !owner) {
+        return;
+    }
+    
+    // A consumer may exit early; that must not kill the shell
+    struct sigaction ignore, saved;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &saved);
+    
+    for (;;) {
+        int nfds = 0;
+        for (int i = 0; i < num_edges; i++) {
+            if (edges[i].state != RELAY_DONE) {
+                relay_pump(&edges[i]);
+            }
+            if (edges[i].state == RELAY_DONE) {
+                continue;
+            }
+            fds[nfds].fd = edges[i].state == RELAY_FULL ? edges[i].out_fd : edges[i].in_fd;
+            fds[nfds].events = edges[i].state == RELAY_FULL ? POLLOUT : POLLIN;
+            owner[nfds++] = i;
+        }
+        if (nfds == 0) {
+            break;
+        }
+        if (poll(fds, nfds, -1) == -1 && errno != EINTR) {
+            perror("poll");
+            for (int i = 0; i < nfds; i++) {
+                relay_set_state(&edges[owner[i]], RELAY_DONE);
+            }
+            break;
+        }
+    }
+    
+    sigaction(SIGPIPE, &saved, NULL);
+}
+
+/**
+ * Report bytes, throughput and full/empty time per pipe and name the likely bottleneck
+ * A slow stage keeps its input pipe full and its output pipe empty
+ * @param stages Pipeline stages
+ * @param num_commands Number of stages
+ * @param edges Pipe accounting, num_commands - 1 entries
+ * @param start Pipeline start time
+ */
+static void report_pipeline_profile(const stage_t* stages, int num_commands,
+                                    const pipe_profile_t* edges, const struct timespec* start) {
+    int slowest = 0;
+    double slowest_score = -1;
+    
+    for (int i = 0; i < num_commands - 1; i++) {
+        double elapsed = timespec_elapsed(start, &edges[i].end);
+        if (elapsed <= 0) elapsed = 1e-9;
+        fprintf(stderr, "profile: pipe %d %.*s -> %.*s: %llu bytes, %.2f MB/s, "
+                "empty %.1f%%, full %.1f%%\n",
+                i, stages[i].text_len, stages[i].text, stages[i + 1].text_len, stages[i + 1].text,
+                edges[i].bytes, edges[i].bytes / elapsed / 1e6,
+                100.0 * edges[i].empty / elapsed, 100.0 * edges[i].full / elapsed);
+    }
+    
+    for (int i = 0; i < num_commands; i++) {
+        double score = 0;
+        int sides = 0;
+        if (i > 0) {
+            double elapsed = timespec_elapsed(start, &edges[i - 1].end);
+            score += elapsed > 0 ? edges[i - 1].full / elapsed : 0;
+            sides++;
+        }
+        if (i < num_commands - 1) {
+            double elapsed = timespec_elapsed(start, &edges[i].end);
+            score += elapsed > 0 ? edges[i].empty / elapsed : 0;
+            sides++;
+        }
+        score /= sides;
+        if (score > slowest_score) {
+            slowest_score = score;
+            slowest = i;
+        }
+    }
+    fprintf(stderr, "profile: bottleneck: stage %d %.*s\n",
+            slowest, stages[slowest].text_len, stages[slowest].text);
+}
+
+/**
+ * Execute commands connected by pipes with robust error handling
+ * @param stages Array of parsed stages
+ * @param num_commands Number of commands in pipeline
+ * @param opts Optional pipeline options ('time', 'profile'), NULL for none
+ * @return SUCCESS on success, error code on failure
+ */
+int execute_pipe(stage_t* stages, int num_commands, const pipeline_opts_t* opts) {
+    if (!stages || num_commands <= 0) {
+        return ERROR_GENERAL;
+    }
+    
+    int timing = opts ? opts->timing : 0;
+    int profile = opts && opts->profile && num_commands > 1;
+    int num_slots = pipeline_slots(stages, num_commands);
+    pid_t* pids = arena_alloc(num_slots * sizeof(pid_t));
+    stage_stats_t* stats = timing ? arena_alloc(num_commands * sizeof(stage_stats_t)) : NULL;
+    pipe_profile_t* edges = profile ? arena_alloc((num_commands - 1) * sizeof(pipe_profile_t)) : NULL;
+    if (!pids || (timing && !stats) || (profile && !edges)) {
+        return ERROR_MEMORY;
+    }
+    
+    // Job cgroup for 'limit', created first so every stage can join it
+    int procs = -1;
+    char* cgroup = opts && opts->limits.requested ? cgroup_create(&opts->limits, &procs) : NULL;
+    if (procs != -1 && attach_job_cgroup(stages, num_commands, procs) != SUCCESS) {
+        close(procs);
+        cgroup_finish(cgroup, "", 0);
+        return ERROR_MEMORY;
+    }
+    
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; profile && i < num_commands - 1; i++) {
+        edges[i].in_fd = -1;
+        edges[i].out_fd = -1;
+        edges[i].state = RELAY_EMPTY;
+        edges[i].since = start;
+    }
+    
+    int result = spawn_pipeline(stages, num_commands, pids, STDIN_FILENO, STDOUT_FILENO, 0,
+                                opts && opts->bulk, stats, edges);
+    if (procs != -1) close(procs);
+    
+    if (profile) {
+        if (result == SUCCESS) {
+            relay_pipeline(edges, num_commands - 1);
+        } else {
+            for (int i = 0; i < num_commands - 1; i++) {
+                if (edges[i].in_fd != -1) close(edges[i].in_fd);
+                if (edges[i].out_fd != -1) close(edges[i].out_fd);
+            }
+        }
+    }
+    
+    // Wait for all children (including the ones started before a failure)
+    int wait_result = wait_for_children(pids, num_commands, stats);
+    wait_for_helpers(pids + num_commands, num_slots - num_commands);
+    if (result == SUCCESS) {
+        result = wait_result;
+        if (profile) {
+            report_pipeline_profile(stages, num_commands, edges, &start);
+        }
+        if (timing) {
+            report_pipeline_times(stages, num_commands, pids, stats, timing == TIME_JSON);
+        }
+    }
+    const stage_t* last = &stages[num_commands - 1];
+    cgroup_finish(cgroup, stages[0].text, (int)(last->text + last->text_len - stages[0].text));
+    
+    return result;
+}
+
+/**
+ * Launch a pipeline in the background and register it as a job
+ * @param stages Array of parsed stages
+ * @param num_commands Number of commands in pipeline
+ * @param opts Pipeline options ('bulk', 'limit')
+ * @param text Command text recorded in the job table
+ * @param text_len Length of the command text
+ * @param in_fd Input of the first stage (STDIN_FILENO: /dev/null)
+ * @param out_fd Output of the last stage
+ * @param added Output: the new job, NULL if none was registered (may be NULL)
+ * @return SUCCESS on success, error code on failure
+ */
+static int execute_background(stage_t* stages, int num_commands, const pipeline_opts_t* opts,
+                              const char* text, int text_len, int in_fd, int out_fd, job_t** added) {
+    int num_slots = pipeline_slots(stages, num_commands);
+    pid_t* pids = arena_alloc(num_slots * sizeof(pid_t));
+    if (!pids) {
+        return ERROR_MEMORY;
+    }
+    
+    // Refuse before anything runs: a job with no slot would have no owner
+    int room = 0;
+    for (int i = 0; i < MAX_JOBS && !room; i++) {
+        room = g_jobs[i].state == JOB_FREE;
+    }
+    if (!room) {
+        fprintf(stderr, "Error: Job table full (maximum %d jobs)\n", MAX_JOBS);
+        return ERROR_GENERAL;
+    }
+    
+    // 'time' accounts the stages as they are reaped and reports with the job
+    job_stage_time_t* times = NULL;
+    stage_stats_t* stats = NULL;
+    if (opts->timing) {
+        times = calloc(num_commands, sizeof(job_stage_time_t));
+        stats = arena_alloc(num_commands * sizeof(stage_stats_t));
+        if (!times || !stats) {
+            free(times);
+            return ERROR_MEMORY;
+        }
+    }
+    
+    int procs = -1;
+    char* cgroup = opts->limits.requested ? cgroup_create(&opts->limits, &procs) : NULL;
+    if (procs != -1 && attach_job_cgroup(stages, num_commands, procs) != SUCCESS) {
+        close(procs);
+        cgroup_finish(cgroup, text, text_len);
+        free(times);
+        return ERROR_MEMORY;
+    }
+    
+    int result = spawn_pipeline(stages, num_commands, pids, in_fd, out_fd, 1,
+                                opts->bulk, stats, NULL);
+    if (procs != -1) close(procs);
+    
+    // The job owns the stages, their O_DIRECT writers and substitutions;
+    // only a fully started pipeline becomes one
+    job_t* job = result == SUCCESS ? job_add(pids, num_slots, num_commands, text, text_len) : NULL;
+    if (!job) {
+        if (result == SUCCESS) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            result = ERROR_MEMORY;
+        }
+        // Nobody would report on the processes started before the failure
+        for (int i = 0; i < num_slots; i++) {
+            if (pids[i] > 0) kill(pids[i], SIGTERM);
+        }
+        wait_for_children(pids, num_commands, NULL);
+        wait_for_helpers(pids + num_commands, num_slots - num_commands);
+        cgroup_finish(cgroup, text, text_len);
+        free(times);
+        return result;
+    }
+    job->cgroup = cgroup;
+    if (times) {
+        for (int i = 0; i < num_commands; i++) {
+            times[i].stats = stats[i];
+            times[i].pid = pids[i];
+            times[i].text_off = (int)(stages[i].text - text);
+            times[i].text_len = stages[i].text_len;
+        }
+        job->times = times;
+        job->timing = opts->timing;
+    }
+    if (added) *added = job;
+    
+    if (g_interactive) {
+        printf("[%d] %d\n", job->id, pids[num_commands - 1]);
+        fflush(stdout);
+    }
+    return result;
+}
+
+/**
+ * Start a pipeline as a named coprocess: a background job whose first stdin
+ * and last stdout are one end of a socketpair held by the shell
+ * @param stages Array of parsed stages
+ * @param num_commands Number of commands in pipeline
+ * @param opts Pipeline options; opts->coproc is the name
+ * @param text Command text recorded in the job table
+ * @param text_len Length of the command text
+ * @return SUCCESS on success, error code on failure
+ */
+static int coproc_start(stage_t* stages, int num_commands, const pipeline_opts_t* opts,
+                        const char* text, int text_len) {
+    coproc_t* slot = NULL;
+    for (int i = 0; i < MAX_COPROCS; i++) {
+        coproc_t* cp = &g_coprocs[i];
+        if (cp->name && strcmp(cp->name, opts->coproc) == 0) {
+            if (coproc_running(cp)) {
+                fprintf(stderr, "coproc: %s: already running (pid %d)\n", cp->name, cp->pid);
+                return ERROR_GENERAL;
+            }
+            coproc_free(cp);
+        }
+        if (!slot && (!cp->name || !coproc_running(cp))) slot = cp;
+    }
+    if (!slot) {
+        fprintf(stderr, "coproc: too many coprocesses (maximum %d)\n", MAX_COPROCS);
+        return ERROR_GENERAL;
+    }
+    if (slot->name) coproc_free(slot);
+    
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        return ERROR_PIPE;
+    }
+    // Registered before the stages fork, so the ones that never exec close it
+    slot->name = safe_strdup(opts->coproc);
+    slot->fd = sv[0];
+    job_t* job = NULL;
+    int result = execute_background(stages, num_commands, opts, text, text_len, sv[1], sv[1], &job);
+    close(sv[1]);
+    if (!job || !slot->name) {
+        coproc_free(slot);
+        return job ? ERROR_MEMORY : result;
+    }
+    
+    slot->command = safe_strdup(job->command);
+    slot->pid = job->pids[num_commands - 1];
+    return result;
+}
+
+/**
+ * Strip 'time [-j|--json]', 'profile', 'bulk', 'memo', 'pin' and 'coproc [-n name]' prefixes
+ * from the first stage
+ * @param stage First pipeline stage, argv and text are advanced past the prefixes
+ * @param opts Options to fill in
+ * @return SUCCESS, or ERROR_GENERAL when no command is left
+ */
+static int parse_pipeline_prefixes(stage_t* stage, pipeline_opts_t* opts) {
+    int consumed = 0;
+    
+    while (stage->argc > 0) {
+        if (strcmp(stage->argv[0], "time") == 0) {
+            opts->timing = TIME_TEXT;
+        } else if ((strcmp(stage->argv[0], "-j") == 0 || strcmp(stage->argv[0], "--json") == 0) &&
+                   opts->timing) {
+            opts->timing = TIME_JSON;
+        } else if (strcmp(stage->argv[0], "profile") == 0) {
+            opts->profile = 1;
+        } else if (strcmp(stage->argv[0], "bulk") == 0) {
+            opts->bulk = 1;
+        } else if (strcmp(stage->argv[0], "pin") == 0) {
+            opts->pin = 1;
+        } else if (strcmp(stage->argv[0], "memo") == 0 && stage->argc > 1 &&
+                   stage->argv[1][0] != '-') {
+            // A bare 'memo' (or 'memo -c') is the statistics built-in
+            opts->memo = 1;
+        } else if (strcmp(stage->argv[0], "coproc") == 0 && stage->argc > 1 &&
+                   (stage->argv[1][0] != '-' || (strcmp(stage->argv[1], "-n") == 0 && stage->argc > 3))) {
+            // Likewise 'coproc' alone or with -w/-r/-q/-c talks to running ones
+            opts->coproc = "COPROC";
+            if (stage->argv[1][0] == '-') {
+                opts->coproc = stage->argv[2];
+                stage_shift(stage, 2);
+            }
+        } else {
+            break;
+        }
+        // Reports show the stage without its prefixes
+        stage_shift(stage, 1);
+        consumed++;
+    }
+    
+    if (consumed == 0) {
+        return SUCCESS;
+    }
+    if (stage->argc == 0) {
+        fprintf(stderr, "Usage: [time [-j|--json]] [profile] [bulk] [memo] [pin] [coproc [-n name]] "
+                "command [| command ...]\n");
+        return ERROR_GENERAL;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Parse a size with an optional K, M or G suffix
+ * @return The size in bytes, or 0 if the text is not a positive size
+ */
+static unsigned long long parse_size(const char* text) {
+    char* end;
+    unsigned long long value = strtoull(text, &end, 10);
+    switch (*end) {
+    case 'G': case 'g': value <<= 10; __attribute__((fallthrough));
+    case 'M': case 'm': value <<= 10; __attribute__((fallthrough));
+    case 'K': case 'k': value <<= 10; end++; break;
+    default: break;
+    }
+    return *end == '\0' && end != text ? value : 0;
+}
+
+/**
+ * Strip a 'limit [-t sec] [-v size] [-n files] [-m size] [-c percent] [-p pids]'
+ * prefix from a stage. -t, -v and -n become rlimits of this stage; -m, -c and
+ * -p are memory.max, cpu.max and pids.max of the job cgroup, whichever stage
+ * names them.
+ * @param stage Stage whose argv and text are advanced past the prefix
+ * @param limits Job-wide limits to fill in
+ * @return SUCCESS, or ERROR_GENERAL on a malformed prefix (already reported)
+ */
+static int parse_stage_limits(stage_t* stage, job_limits_t* limits) {
+    if (stage->argc == 0 || strcmp(stage->argv[0], "limit") != 0) {
+        return SUCCESS;
+    }
+    
+    stage_limits_t* rl = arena_alloc(sizeof(stage_limits_t));
+    if (!rl) return ERROR_MEMORY;
+    rl->cpu = rl->as = rl->nofile = RLIM_INFINITY;
+    rl->cgroup_procs = -1;
+    limits->requested = 1;
+    
+    int i = 1;
+    for (; i + 1 < stage->argc && stage->argv[i][0] == '-' && stage->argv[i][1] &&
+           !stage->argv[i][2]; i += 2) {
+        const char* value = stage->argv[i + 1];
+        unsigned long long number = parse_size(value);
+        int ok = number > 0;
+        switch (stage->argv[i][1]) {
+        case 't': rl->cpu = number; ok = ok && strspn(value, "0123456789") == strlen(value); break;
+        case 'v': rl->as = number; break;
+        case 'n': rl->nofile = number; ok = ok && strspn(value, "0123456789") == strlen(value); break;
+        case 'm': limits->memory_max = number; break;
+        case 'c': limits->cpu_percent = (int)number; ok = ok && number <= 100000; break;
+        case 'p': limits->pids_max = number; break;
+        default: ok = 0; break;
+        }
+        if (!ok) {
+            fprintf(stderr, "limit: invalid option '%s %s'\n", stage->argv[i], value);
+            return ERROR_GENERAL;
+        }
+    }
+    if (i >= stage->argc || stage->argv[i][0] == '-') {
+        fprintf(stderr, "Usage: limit [-t sec] [-v size] [-n files] [-m size] [-c percent] "
+                        "[-p pids] command\n");
+        return ERROR_GENERAL;
+    }
+    
+    stage_shift(stage, i);
+    stage->limits = rl;
+    return SUCCESS;
+}
+
+/**
+ * Build the cache key of a command: argv, working directory, the values of
+ * the SHELL_MEMO_ENV variables and a hash of the redirected input file
+ * @param in Redirected stdin, or -1 (the command then reads /dev/null)
+ * @return Key length, or -1 if the command cannot be cached
+ */
+static ssize_t memo_key(char** argv, int in, char** key, uint64_t* hash) {
+    char* buf = NULL;
+    size_t len = 0, cap = 0;
+    int ok = 1;
+    
+    for (int i = 0; argv[i] && ok; i++) {
+        ok = buffer_append(&buf, &len, &cap, argv[i], strlen(argv[i]) + 1) == 0;
+    }
+    char cwd[PATH_MAX];
+    if (ok && getcwd(cwd, sizeof(cwd))) {
+        ok = buffer_append(&buf, &len, &cap, cwd, strlen(cwd) + 1) == 0;
+    }
+    if (ok && g_memo_env_len > 0) {
+        ok = buffer_append(&buf, &len, &cap, g_memo_env, g_memo_env_len) == 0;
+    }
+    
+    uint64_t input = 0;
+    if (ok && in != -1) {
+        // Only regular files have contents that can be hashed up front
+        struct stat st;
+        ok = fstat(in, &st) == 0 && S_ISREG(st.st_mode);
+        if (ok && st.st_size > 0) {
+            void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in, 0);
+            ok = map != MAP_FAILED;
+            if (ok) {
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+                input = fnv1a(FNV_OFFSET, map, st.st_size);
+                munmap(map, st.st_size);
+            }
+        }
+        input ^= (uint64_t)st.st_size;
+    }
+    if (ok) {
+        ok = buffer_append(&buf, &len, &cap, &input, sizeof(input)) == 0;
+    }
+    if (!ok) {
+        free(buf);
+        return -1;
+    }
+    
+    *hash = fnv1a(FNV_OFFSET, buf, len);
+    if (*hash == 0) *hash = 1; // 0 marks empty buckets
+    *key = buf;
+    return (ssize_t)len;
+}
+
+/**
+ * Run a single external command through the result cache
+ * A hit writes the stored output without forking. A miss runs the command
+ * with stdout on a pipe, streams the output through while keeping a copy,
+ * and stores it with the exit status. Standard error is not cached.
+ * @param stage The command (no pipes or process substitutions)
+ * @param bulk Non-zero for the bulk I/O options on redirections
+ * @return Exit status of the command, or error code
+ */
+static int memo_execute(const stage_t* stage, int bulk) {
+    memo_init();
+    
+    int fds[3];
+    pid_t sink;
+    if (open_redirections(stage, bulk, fds, &sink) != SUCCESS) {
+        return ERROR_GENERAL;
+    }
+    int out = fds[STDOUT_FILENO] != -1 ? fds[STDOUT_FILENO] : STDOUT_FILENO;
+    int result = ERROR_GENERAL;
+    
+    char* key = NULL;
+    uint64_t hash = 0;
+    ssize_t key_len = find_builtin(stage->argv[0]) ? -1 : memo_key(stage->argv, fds[0], &key, &hash);
+    const memo_entry_t* hit = key_len < 0 ? NULL : memo_lookup(hash, key, key_len);
+    int in = fds[0] != -1 ? fds[0] : open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int pipe_fds[2] = { -1, -1 };
+    
+    if (key_len < 0) {
+        if (g_debug_mode) {
+            fprintf(stderr, "Memo: '%s' is not cacheable, running it directly\n", stage->argv[0]);
+        }
+        result = execute_command(stage->argv, stage->num_redirs ? fds : NULL);
+    } else if (hit) {
+        fflush(stdout);
+        write_all(out, hit->out, hit->out_len);
+        result = hit->status;
+    } else if (in != -1 && pipe2(pipe_fds, O_CLOEXEC) == 0) {
+        int err = fds[STDERR_FILENO] != -1 ? fds[STDERR_FILENO] : STDERR_FILENO;
+        fflush(stdout);
+        pid_t pid = pool_launch(stage->argv, in, pipe_fds[1], err);
+        if (pid == -1) {
+            pid = shell_fork();
+        }
+        if (pid == 0) {
+            if (dup2(in, STDIN_FILENO) == -1 || dup2(pipe_fds[1], STDOUT_FILENO) == -1 ||
+                (err != STDERR_FILENO && dup2(err, STDERR_FILENO) == -1)) {
+                perror("dup2");
+                exit(EXIT_FAILURE);
+            }
+            exec_child(stage->argv);
+        }
+        close(pipe_fds[1]);
+        
+        char* buf = NULL;
+        size_t len = 0, cap = 0;
+        int keep = pid > 0;
+        char chunk[RELAY_CHUNK];
+        ssize_t n;
+        while (pid > 0 && ((n = read(pipe_fds[0], chunk, sizeof(chunk))) > 0 ||
+                           (n == -1 && errno == EINTR))) {
+            if (n <= 0) continue;
+            write_all(out, chunk, n);
+            // Outputs too large to be worth caching are only streamed
+            if (keep && (len + n > g_memo_max / 4 || buffer_append(&buf, &len, &cap, chunk, n) == -1)) {
+                keep = 0;
+                free(buf);
+                buf = NULL;
+            }
+        }
+        close(pipe_fds[0]);
+        
+        if (pid == -1) {
+            perror("fork");
+            result = ERROR_FORK;
+        } else {
+            int status = reap_stage(pid, 0, NULL);
+            result = status >= 0 ? status_to_exit_code(status) : ERROR_GENERAL;
+            // Commands killed by a signal did not produce a result
+            if (keep && status >= 0 && WIFEXITED(status)) {
+                memo_store(hash, key, key_len, buf, len, result);
+                buf = NULL;
+            }
+        }
+        free(buf);
+    } else {
+        perror("memo");
+    }
+    
+    if (in != -1 && in != fds[0]) close(in);
+    for (int k = 0; k < 3; k++) {
+        if (fds[k] != -1) close(fds[k]);
+    }
+    wait_for_helpers(&sink, 1);
+    free(key);
+    return result;
+}
+
+/**
+ * Run one pipeline given as a token range of a lexed line
+ * @param lex Lexed line
+ * @param first Index of the first token
+ * @param last Index one past the last token
+ * @param background Non-zero to run it as a background job
+ * @return Exit status of the command, or error code
+ */
+static int execute_line(const lexed_line_t* lex, int first, int last, int background) {
+    if (first >= last) {
+        return SUCCESS;
+    }
+    
+    stage_t* stages;
+    int num_commands = build_pipeline(lex, first, last, &stages);
+    if (num_commands <= 0) {
+        return ERROR_GENERAL;
+    }
+    if (stages[0].argc == 0) {
+        // NAME=value without a command sets shell variables
+        for (int i = 0; i < stages[0].num_assigns; i++) {
+            if (var_assign(stages[0].assigns[i], 0) != SUCCESS) return ERROR_MEMORY;
+        }
+        env_sync(0);    // An exported one (PATH=...) takes effect at once
+        return SUCCESS;
+    }
+    
+    pipeline_opts_t opts = { 0 };
+    if (parse_pipeline_prefixes(&stages[0], &opts) != SUCCESS) {
+        return ERROR_GENERAL;
+    }
+    int assigns = 0;
+    for (int i = 0; i < num_commands; i++) {
+        // 'limit' and 'sched' may be combined in either order
+        int argc;
+        do {
+            argc = stages[i].argc;
+            if (parse_stage_limits(&stages[i], &opts.limits) != SUCCESS ||
+                parse_stage_sched(&stages[i]) != SUCCESS) {
+                return ERROR_GENERAL;
+            }
+        } while (stages[i].argc != argc);
+        assigns |= stages[i].num_assigns > 0;
+    }
+    if (opts.pin && place_pipeline(stages, num_commands) != SUCCESS) {
+        return ERROR_MEMORY;
+    }
+    // After placement: 'pin' gives even a single command a CPU to apply
+    for (int i = 0; i < num_commands; i++) {
+        opts.scheduled |= stages[i].sched != NULL;
+    }
+    env_sync(assigns);
+    
+    if (background || opts.coproc) {
+        const token_t* lo = &lex->tokens[first];
+        const token_t* hi = &lex->tokens[last - 1];
+        const char* text = lex->text + lo->start;
+        int text_len = (int)(hi->start + hi->len - lo->start);
+        if (opts.profile) {
+            fprintf(stderr, "profile: background pipelines are not profiled\n");
+        }
+        if (opts.coproc) {
+            return coproc_start(stages, num_commands, &opts, text, text_len);
+        }
+        return execute_background(stages, num_commands, &opts, text, text_len,
+                                  STDIN_FILENO, STDOUT_FILENO, NULL);
+    }
+    if (opts.memo) {
+        if (num_commands == 1 && !opts.timing && !opts.profile && !opts.limits.requested &&
+            !opts.scheduled && stages[0].num_psubs == 0 && !assigns) {
+            return memo_execute(&stages[0], opts.bulk);
+        }
+        fprintf(stderr, "memo: only single commands are cached, running uncached\n");
+    }
+    if (num_commands == 1 && !opts.timing && !opts.limits.requested && !opts.scheduled &&
+        stages[0].num_psubs == 0 && (!assigns || find_builtin(stages[0].argv[0]))) {
+        // Single command
+        int fds[3];
+        pid_t sink;
+        if (open_redirections(&stages[0], opts.bulk, fds, &sink) != SUCCESS) {
+            return ERROR_GENERAL;
+        }
+        int result = execute_command(stages[0].argv, stages[0].num_redirs ? fds : NULL);
+        for (int k = 0; k < 3; k++) {
+            if (fds[k] != -1) close(fds[k]);
+        }
+        wait_for_helpers(&sink, 1);
+        return result;
+    }
+    // Pipeline (timed, limited, placed and VAR=x single commands also take this path)
+    return execute_pipe(stages, num_commands, &opts);
+}
+
+/**
+ * Compile a lexed line into a flat command list in one pass over the
+ * tokens. ';', '&', '&&' and '||' bind left to right with equal
+ * precedence, as in bash, so 'a || b && c' needs no tree: each node only
+ * records the operator that joins it to the status left by the nodes
+ * before it. Nodes hold token offsets only and are never re-parsed.
+ * 
+ * @param lex Lexed line
+ * @param num_tokens Number of tokens
+ * @param list Receives the arena-allocated nodes
+ * @param bad Receives the offending token on a syntax error (num_tokens
+ *        for a missing command at the end of the line)
+ * @return Number of nodes, or -1 on a syntax error or allocation failure
+ */
+static int compile_list(const lexed_line_t* lex, int num_tokens, command_list_t* list, int* bad) {
+    int cap = 1;
+    for (int t = 0; t < num_tokens; t++) {
+        token_kind_t kind = lex->tokens[t].kind;
+        cap += kind == TOK_AMP || kind == TOK_AND || kind == TOK_OR || kind == TOK_SEMI;
+    }
+    list->nodes = arena_alloc(cap * sizeof(list_node_t));
+    list->count = 0;
+    if (!list->nodes) {
+        *bad = -1;
+        return -1;
+    }
+    
+    int start = 0, depth = 0;
+    list_op_t op = LIST_SEQ;
+    for (int t = 0; t <= num_tokens; t++) {
+        token_kind_t kind = t < num_tokens ? lex->tokens[t].kind : TOK_SEMI;
+        if (kind == TOK_PSUB) depth++;
+        else if (kind == TOK_RPAREN) depth--;
+        if (kind != TOK_AMP && kind != TOK_AND && kind != TOK_OR && kind != TOK_SEMI) continue;
+        
+        if (depth > 0 || (t == start && (kind != TOK_SEMI || op != LIST_SEQ))) {
+            // An operator inside <( ), or one with no pipeline before it
+            *bad = t;
+            return -1;
+        }
+        if (t > start) {
+            list_node_t* node = &list->nodes[list->count++];
+            node->first = (uint32_t)start;
+            node->last = (uint32_t)t;
+            node->op = (uint8_t)op;
+            node->background = kind == TOK_AMP;
+        }
+        op = kind == TOK_AND ? LIST_AND : kind == TOK_OR ? LIST_OR : LIST_SEQ;
+        start = t + 1;
+    }
+    return list->count;
+}
+
+/**
+ * Report a syntax error found by compile_list
+ */
+static void list_syntax_error(const lexed_line_t* lex, int num_tokens, int bad) {
+    if (bad < 0) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+    } else if (bad == num_tokens) {
+        fprintf(stderr, "Error: Syntax error: missing command at end of line\n");
+    } else {
+        fprintf(stderr, "Error: Syntax error near '%.*s'\n",
+                (int)lex->tokens[bad].len, lex->text + lex->tokens[bad].start);
+    }
+}
+
+/**
+ * Run a compiled command list with short-circuit evaluation: a pipeline
+ * after && or || is skipped depending on the status of the last pipeline
+ * that ran (0 from execute_command / execute_pipe is success)
+ * @return Status of the last pipeline that ran
+ */
+static int execute_list(const lexed_line_t* lex, const command_list_t* list) {
+    int status = SUCCESS;
+    for (int i = 0; i < list->count && g_shell_running; i++) {
+        const list_node_t* node = &list->nodes[i];
+        if ((node->op == LIST_AND && status != SUCCESS) ||
+            (node->op == LIST_OR && status == SUCCESS)) {
+            continue;
+        }
+        status = execute_line(lex, node->first, node->last, node->background);
+        g_last_status = status;
+    }
+    return status;
+}
+
+/* Compiled script cache: the tokens and command lists of every line of a
+   script, plus the resolved paths of its commands, stored next to each other
+   so that a later run maps the file and executes without lexing */
+#define SCRIPT_CACHE_MAGIC "EJ2SCv2"
+#define SCRIPT_CACHE_TAIL_MAX (1 << 20)     // Unrun tail compiled after an early exit
+#define SCRIPT_CACHE_PROBES 4               // Words tried as a command after a prefix
+
+typedef struct {
+    char magic[8];
+    uint32_t token_size;    // sizeof(token_t) and sizeof(list_node_t): layout check
+    uint32_t node_size;
+    uint64_t size;          // Script identity: a stat() decides validity
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t ino;
+    uint64_t dev;
+    uint64_t path_stamp;    // PATH and its directories when the command table was resolved
+    uint32_t num_lines;
+    uint32_t num_tokens;
+    uint32_t num_nodes;
+    uint32_t num_cmds;
+    uint64_t lines_off;     // Section offsets, 8-byte aligned
+    uint64_t tokens_off;
+    uint64_t nodes_off;
+    uint64_t cmds_off;
+    uint64_t strings_off;
+    uint64_t strings_len;
+} script_cache_header_t;
+
+/* One non-blank line of the script */
+typedef struct {
+    uint64_t text_off;      // Line text within the script
+    uint32_t text_len;
+    uint32_t line_no;
+    uint32_t first_token;
+    int32_t num_tokens;     // LEX_* error code if negative
+    uint32_t first_node;    // Offending token if num_nodes is -1
+    int32_t num_nodes;      // -1 on a syntax error
+} script_line_t;
+
+/* Recorder filled by run_line while a script runs for the first time */
+static struct {
+    int active;
+    const char* base;       // Mapped script
+    char* lines;
+    size_t lines_len, lines_cap;
+    char* tokens;
+    size_t tokens_len, tokens_cap;
+    char* nodes;
+    size_t nodes_len, nodes_cap;
+} g_script_rec;
+
+/**
+ * Record the compiled form of one script line; an allocation failure
+ * gives up on the cache for this run
+ */
+static void script_record(const char* text, size_t len, unsigned long line_no, const lexed_line_t* lex,
+                          int num_tokens, const command_list_t* list, int bad) {
+    if (len > UINT32_MAX || line_no > UINT32_MAX || (!list && num_tokens > 0 && bad < 0)) {
+        g_script_rec.active = 0;
+        return;
+    }
+    script_line_t line = {
+        (uint64_t)(text - g_script_rec.base), (uint32_t)len, (uint32_t)line_no,
+        (uint32_t)(g_script_rec.tokens_len / sizeof(token_t)), num_tokens,
+        list ? (uint32_t)(g_script_rec.nodes_len / sizeof(list_node_t)) : (uint32_t)bad,
+        list ? list->count : -1
+    };
+    if (buffer_append(&g_script_rec.lines, &g_script_rec.lines_len, &g_script_rec.lines_cap,
+                      &line, sizeof(line)) == -1 ||
+        (num_tokens > 0 &&
+         buffer_append(&g_script_rec.tokens, &g_script_rec.tokens_len, &g_script_rec.tokens_cap,
+                       lex->tokens, num_tokens * sizeof(token_t)) == -1) ||
+        (list && list->count > 0 &&
+         buffer_append(&g_script_rec.nodes, &g_script_rec.nodes_len, &g_script_rec.nodes_cap,
+                       list->nodes, list->count * sizeof(list_node_t)) == -1)) {
+        g_script_rec.active = 0;
+    }
+}
+
+/**
+ * Path of the cache file of a script: the cache directory
+ * (SHELL_SCRIPT_CACHE; the cache is off without it) and a hash of the
+ * script's real path
+ * @param create Create the directory if missing
+ * @return Malloc'ed path, or NULL if the cache is disabled
+ */
+static char* script_cache_path(const char* script, int create) {
+    const char* dir = g_env.script_cache;
+    if (!dir || !*dir || strcmp(dir, "0") == 0) return NULL;
+    if (create) mkdir(dir, 0700);
+    
+    char real[PATH_MAX];
+    if (!realpath(script, real)) return NULL;
+    size_t len = strlen(dir) + sizeof("/0123456789abcdef.sc");
+    char* path = malloc(len);
+    if (path) {
+        snprintf(path, len, "%s/%016llx.sc", dir,
+                 (unsigned long long)fnv1a(FNV_OFFSET, real, strlen(real)));
+    }
+    return path;
+}
+
+/**
+ * Order command-name candidates (views into the script) like strcmp
+ */
+static int cmp_script_word(const void* a, const void* b) {
+    const token_t* x = a;
+    const token_t* y = b;
+    uint32_t n = x->len < y->len ? x->len : y->len;
+    int cmp = memcmp(g_script_rec.base + x->start, g_script_rec.base + y->start, n);
+    if (cmp) return cmp;
+    return (x->len > y->len) - (x->len < y->len);
+}
+
+/**
+ * Fingerprint of PATH and of its directories' modification times: a
+ * program added to, removed from or renamed in any of them changes it
+ * @return Stamp, or 0 if PATH has relative entries (they follow the
+ *         working directory) and resolved paths cannot be trusted
+ */
+static uint64_t script_path_stamp(void) {
+    const char* dirs = g_env.path;
+    if (!dirs || !*dirs) return 0;
+    uint64_t h = fnv1a(FNV_OFFSET, dirs, strlen(dirs));
+    for (;;) {
+        const char* colon = strchr(dirs, ':');
+        size_t dlen = colon ? (size_t)(colon - dirs) : strlen(dirs);
+        char dir[PATH_MAX];
+        if (dlen == 0 || dirs[0] != '/' || dlen >= sizeof(dir)) return 0;
+        memcpy(dir, dirs, dlen);
+        dir[dlen] = '\0';
+        struct stat st;
+        int64_t id[3] = { -1, -1, -1 };
+        if (stat(dir, &st) == 0) {
+            id[0] = st.st_mtim.tv_sec;
+            id[1] = st.st_mtim.tv_nsec;
+            id[2] = (int64_t)st.st_ino;
+        }
+        h = fnv1a(h, id, sizeof(id));
+        if (!colon) break;
+        dirs = colon + 1;
+    }
+    return h ? h : 1;
+}
+
+/**
+ * Search PATH for a program the way execvp does
+ * @return 0 with the path in out, -1 if not found
+ */
+static int script_which(const char* name, size_t len, char* out, size_t out_size) {
+    const char* dirs = g_env.path;
+    while (dirs && *dirs) {
+        const char* colon = strchr(dirs, ':');
+        size_t dlen = colon ? (size_t)(colon - dirs) : strlen(dirs);
+        struct stat st;
+        if (dlen > 0 && dlen + len + 2 <= out_size) {
+            memcpy(out, dirs, dlen);
+            out[dlen] = '/';
+            memcpy(out + dlen + 1, name, len);
+            out[dlen + 1 + len] = '\0';
+            if (access(out, X_OK) == 0 && stat(out, &st) == 0 && S_ISREG(st.st_mode)) return 0;
+        }
+        if (!colon) break;
+        dirs = colon + 1;
+    }
+    return -1;
+}
+
+/**
+ * Collect the words of the recorded lines that name programs: the first
+ * plain word of every pipeline stage and process substitution, past any
+ * assignments, redirections and prefix words
+ * @return Candidates as tokens with script offsets (malloc'ed), or NULL
+ */
+static token_t* script_commands(size_t* count_out) {
+    const script_line_t* lines = (const script_line_t*)g_script_rec.lines;
+    const token_t* tokens = (const token_t*)g_script_rec.tokens;
+    const list_node_t* nodes = (const list_node_t*)g_script_rec.nodes;
+    size_t num_lines = g_script_rec.lines_len / sizeof(script_line_t);
+    token_t* words = NULL;
+    size_t count = 0, len = 0, cap = 0;
+    
+    for (size_t i = 0; i < num_lines; i++) {
+        const script_line_t* line = &lines[i];
+        const token_t* toks = tokens + line->first_token;
+        lexed_line_t lex = { g_script_rec.base + line->text_off, (token_t*)toks, line->num_tokens, 0 };
+        for (int n = 0; n < line->num_nodes; n++) {
+            const list_node_t* node = &nodes[line->first_node + n];
+            int expect = 1, probes = 0;
+            for (uint32_t t = node->first; t < node->last; t++) {
+                const token_t* tok = &toks[t];
+                if (tok->kind == TOK_PIPE || tok->kind == TOK_PSUB) {
+                    expect = 1;
+                    probes = 0;
+                    continue;
+                }
+                if (tok->kind == TOK_REDIR) {
+                    t++; // Skip the target
+                    continue;
+                }
+                if (tok->kind != TOK_WORD || !expect) continue;
+                if (token_is_assign(&lex, tok)) continue;
+                if (tok->flags) {
+                    expect = 0; // Known only once expanded
+                    continue;
+                }
+                const char* w = lex.text + tok->start;
+                int prefix = 0;
+                for (int p = 0; g_prefixes[p] && !prefix; p++) {
+                    prefix = strlen(g_prefixes[p]) == tok->len && memcmp(g_prefixes[p], w, tok->len) == 0;
+                }
+                for (const builtin_t* b = g_builtins; b->name && !prefix; b++) {
+                    prefix = strlen(b->name) == tok->len && memcmp(b->name, w, tok->len) == 0;
+                }
+                if (!prefix && !memchr(w, '/', tok->len) && *w != '-' && line->text_off <= UINT32_MAX - tok->start) {
+                    token_t word = { (uint32_t)(line->text_off + tok->start), tok->len, 0, 0 };
+                    if (buffer_append((char**)&words, &len, &cap, &word, sizeof(word)) == -1) {
+                        free(words);
+                        return NULL;
+                    }
+                    count++;
+                }
+                // After a prefix or built-in the command follows its options
+                expect = (prefix || probes > 0) && ++probes <= SCRIPT_CACHE_PROBES;
+            }
+        }
+    }
+    *count_out = count;
+    return words;
+}
+
+/**
+ * Resolve the script's commands and write the cache file: a header and the
+ * line, token, node, command and string sections, renamed into place
+ * @param cache Cache file path
+ * @param st Script identity
+ */
+static void script_cache_write(const char* cache, const struct stat* st) {
+    size_t num_words = 0;
+    token_t* words = script_commands(&num_words);
+    char* strings = NULL;
+    size_t strings_len = 0, strings_cap = 0;
+    char* cmds = NULL;
+    size_t cmds_len = 0, cmds_cap = 0;
+    
+    // Resolve each distinct name once; the table stays sorted by name.
+    // The stamp is taken first: a directory changing meanwhile fails the
+    // next load's check rather than slipping in
+    uint64_t stamp = script_path_stamp();
+    if (!stamp) num_words = 0;
+    qsort(words, num_words, sizeof(token_t), cmp_script_word);
+    for (size_t i = 0; i < num_words; i++) {
+        if (i > 0 && cmp_script_word(&words[i - 1], &words[i]) == 0) continue;
+        char resolved[PATH_MAX];
+        const char* name = g_script_rec.base + words[i].start;
+        if (script_which(name, words[i].len, resolved, sizeof(resolved)) == -1) continue;
+        script_cmd_t cmd = { (uint32_t)strings_len, (uint32_t)(strings_len + words[i].len + 1) };
+        if (buffer_append(&strings, &strings_len, &strings_cap, name, words[i].len) == -1 ||
+            buffer_append(&strings, &strings_len, &strings_cap, "", 1) == -1 ||
+            buffer_append(&strings, &strings_len, &strings_cap, resolved, strlen(resolved) + 1) == -1 ||
+            buffer_append(&cmds, &cmds_len, &cmds_cap, &cmd, sizeof(cmd)) == -1) {
+            cmds_len = 0;
+            break;
+        }
+    }
+    free(words);
+    
+    script_cache_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SCRIPT_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.token_size = sizeof(token_t);
+    hdr.node_size = sizeof(list_node_t);
+    hdr.size = st->st_size;
+    hdr.mtime_sec = st->st_mtim.tv_sec;
+    hdr.mtime_nsec = st->st_mtim.tv_nsec;
+    hdr.ino = st->st_ino;
+    hdr.dev = st->st_dev;
+    hdr.path_stamp = stamp;
+    hdr.num_lines = g_script_rec.lines_len / sizeof(script_line_t);
+    hdr.num_tokens = g_script_rec.tokens_len / sizeof(token_t);
+    hdr.num_nodes = g_script_rec.nodes_len / sizeof(list_node_t);
+    hdr.num_cmds = cmds_len / sizeof(script_cmd_t);
+    
+    const struct {
+        const char* data;
+        size_t len;
+        uint64_t* off;
+    } sections[] = {
+        { g_script_rec.lines, g_script_rec.lines_len, &hdr.lines_off },
+        { g_script_rec.tokens, g_script_rec.tokens_len, &hdr.tokens_off },
+        { g_script_rec.nodes, g_script_rec.nodes_len, &hdr.nodes_off },
+        { cmds, cmds_len, &hdr.cmds_off },
+        { strings, strings_len, &hdr.strings_off },
+    };
+    size_t num_sections = sizeof(sections) / sizeof(sections[0]);
+    uint64_t off = sizeof(hdr);
+    for (size_t i = 0; i < num_sections; i++) {
+        *sections[i].off = off;
+        off = (off + sections[i].len + 7) & ~(uint64_t)7;
+    }
+    hdr.strings_len = strings_len;
+    
+    size_t tmp_len = strlen(cache) + 32;
+    char* tmp = malloc(tmp_len);
+    int fd = -1;
+    if (tmp) {
+        snprintf(tmp, tmp_len, "%s.%d.tmp", cache, (int)getpid());
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    }
+    int ok = fd != -1 && write_all(fd, (const char*)&hdr, sizeof(hdr)) == 0;
+    static const char pad[8];
+    for (size_t i = 0; i < num_sections && ok; i++) {
+        size_t padding = (8 - sections[i].len % 8) % 8;
+        ok = (sections[i].len == 0 || write_all(fd, sections[i].data, sections[i].len) == 0) &&
+             write_all(fd, pad, padding) == 0;
+    }
+    if (fd != -1) {
+        ok = close(fd) == 0 && ok && rename(tmp, cache) == 0;
+        if (!ok) unlink(tmp);
+    }
+    if (ok && g_debug_mode) {
+        fprintf(stderr, "Script cache: wrote %u lines (%u commands) to %s\n",
+                hdr.num_lines, hdr.num_cmds, cache);
+    }
+    free(tmp);
+    free(cmds);
+    free(strings);
+}
+
+/**
+ * Stop recording and release the recorder's buffers
+ */
+static void script_rec_free(void) {
+    free(g_script_rec.lines);
+    free(g_script_rec.tokens);
+    free(g_script_rec.nodes);
+    memset(&g_script_rec, 0, sizeof(g_script_rec));
+}
+
+/**
+ * Map the cache file of a script and check it against the script: same
+ * file, size and modification time, and sections that fit the mapping.
+ * Every line's token and node ranges are checked too, so a damaged cache
+ * is rejected as a whole rather than failing half way through the script.
+ * @param cache Cache file path
+ * @param st Script identity
+ * @param len_out Mapping length
+ * @return Mapped header, or NULL if there is no usable cache
+ */
+static const script_cache_header_t* script_cache_load(const char* cache, const struct stat* st, size_t* len_out) {
+    int fd = open(cache, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+    struct stat cst;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &cst) == 0 && (size_t)cst.st_size >= sizeof(script_cache_header_t)) {
+        map = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    
+    const script_cache_header_t* hdr = map;
+    size_t len = cst.st_size;
+    int ok = memcmp(hdr->magic, SCRIPT_CACHE_MAGIC, sizeof(hdr->magic)) == 0 &&
+             hdr->token_size == sizeof(token_t) && hdr->node_size == sizeof(list_node_t) &&
+             hdr->size == (uint64_t)st->st_size && hdr->mtime_sec == st->st_mtim.tv_sec &&
+             hdr->mtime_nsec == st->st_mtim.tv_nsec && hdr->ino == st->st_ino && hdr->dev == st->st_dev &&
+             hdr->lines_off <= len && hdr->num_lines <= (len - hdr->lines_off) / sizeof(script_line_t) &&
+             hdr->tokens_off <= len && hdr->num_tokens <= (len - hdr->tokens_off) / sizeof(token_t) &&
+             hdr->nodes_off <= len && hdr->num_nodes <= (len - hdr->nodes_off) / sizeof(list_node_t) &&
+             hdr->cmds_off <= len && hdr->num_cmds <= (len - hdr->cmds_off) / sizeof(script_cmd_t) &&
+             hdr->strings_off <= len && hdr->strings_len <= len - hdr->strings_off &&
+             hdr->lines_off % 8 == 0 && hdr->tokens_off % 8 == 0 && hdr->nodes_off % 8 == 0 &&
+             hdr->cmds_off % 8 == 0;
+    
+    const script_line_t* lines = (const script_line_t*)((const char*)map + hdr->lines_off);
+    const token_t* tokens = (const token_t*)((const char*)map + hdr->tokens_off);
+    const list_node_t* nodes = (const list_node_t*)((const char*)map + hdr->nodes_off);
+    for (uint32_t i = 0; ok && i < hdr->num_lines; i++) {
+        const script_line_t* line = &lines[i];
+        int32_t ntok = line->num_tokens > 0 ? line->num_tokens : 0;
+        ok = line->text_off <= hdr->size && line->text_len <= hdr->size - line->text_off &&
+             line->first_token <= hdr->num_tokens && (uint32_t)ntok <= hdr->num_tokens - line->first_token &&
+             (line->num_nodes < 0 ? line->first_node <= (uint32_t)ntok :
+              line->first_node <= hdr->num_nodes &&
+              (uint32_t)line->num_nodes <= hdr->num_nodes - line->first_node);
+        for (int32_t t = 0; ok && t < ntok; t++) {
+            const token_t* tok = &tokens[line->first_token + t];
+            ok = tok->start <= line->text_len && tok->len <= line->text_len - tok->start &&
+                 tok->kind <= TOK_RPAREN;
+        }
+        for (int32_t n = 0; ok && n < line->num_nodes; n++) {
+            const list_node_t* node = &nodes[line->first_node + n];
+            ok = node->first < node->last && node->last <= (uint32_t)ntok;
+        }
+    }
+    
+    // Command paths only hold while PATH is the one they came from and no
+    // program appeared in or left its directories since. Like a shell's
+    // command hash, the table is then trusted for the run; a program that
+    // went away still falls back to the PATH search.
+    const char* strings = (const char*)map + hdr->strings_off;
+    if (ok && hdr->num_cmds > 0 && hdr->strings_len > 0 && strings[hdr->strings_len - 1] == '\0' &&
+        hdr->path_stamp != 0 && hdr->path_stamp == script_path_stamp()) {
+        const script_cmd_t* cmds = (const script_cmd_t*)((const char*)map + hdr->cmds_off);
+        int valid = 1;
+        for (uint32_t i = 0; valid && i < hdr->num_cmds; i++) {
+            valid = cmds[i].name_off < hdr->strings_len && cmds[i].path_off < hdr->strings_len;
+        }
+        if (valid) {
+            g_script_cmds.cmds = cmds;
+            g_script_cmds.count = hdr->num_cmds;
+            g_script_cmds.strings = strings;
+            g_script_cmds.path_hash = fnv1a(FNV_OFFSET, g_env.path, strlen(g_env.path));
+        }
+    }
+    if (!ok) {
+        munmap(map, len);
+        return NULL;
+    }
+    *len_out = len;
+    return hdr;
+}
+
+/**
+ * Report the error of a compiled line or run its command list
+ * @param lex Lexed line
+ * @param num_tokens Token count, or a LEX_* error code
+ * @param list Compiled command list, NULL on a syntax error
+ * @param bad Offending token of a syntax error (see compile_list)
+ * @param source Script name for error messages, NULL for standard input
+ * @param line_no Line number within the script
+ */
+static void run_compiled(const lexed_line_t* lex, int num_tokens, const command_list_t* list, int bad,
+                         const char* source, unsigned long line_no) {
+    const char* error = NULL;
+    if (num_tokens == LEX_UNCLOSED_QUOTE) {
+        error = "Unclosed quotes";
+    } else if (num_tokens == LEX_UNCLOSED_PAREN) {
+        error = "Unclosed process substitution";
+    } else if (num_tokens == LEX_UNCLOSED_SUBST) {
+        error = "Unclosed command substitution";
+    } else if (num_tokens <= 0) {
+        return;
+    } else if (list) {
+        execute_list(lex, list);
+        return;
+    }
+    
+    if (source) {
+        fprintf(stderr, "%s: line %lu: ", source, line_no);
+    }
+    if (error) {
+        fprintf(stderr, "Error: %s\n", error);
+    } else {
+        list_syntax_error(lex, num_tokens, bad);
+    }
+}
+
+/**
+ * Lex and run one input line, then drop its parse state
+ * The line is only read: tokens are views into it, so it may live in a
+ * read-only mapping. While a script is being compiled the result of
+ * lexing and compiling is also recorded for the script cache.
+ * @param text Line text (not necessarily NUL-terminated)
+ * @param len Length of the line
+ * @param source Script name for error messages, NULL for standard input
+ * @param line_no Line number within the script
+ * @param execute Run the line (0 only compiles it for the script cache)
+ * @return Number of tokens on the line (0 for a blank line)
+ */
+static int run_line(const char* text, size_t len, const char* source, unsigned long line_no, int execute) {
+    // Lex the whole line once, then compile it into its list of pipelines
+    lexed_line_t lex;
+    int num_tokens = lex_line(text, len, &lex);
+    
+    if (num_tokens != 0 && num_tokens != -1 &&
+        (num_tokens < 0 || text[lex.tokens[0].start] != '#')) {
+        command_list_t list;
+        int bad = 0;
+        int compiled = num_tokens > 0 && compile_list(&lex, num_tokens, &list, &bad) >= 0;
+        if (g_script_rec.active) {
+            script_record(text, len, line_no, &lex, num_tokens, compiled ? &list : NULL, bad);
+        }
+        if (execute) {
+            run_compiled(&lex, num_tokens, compiled ? &list : NULL, bad, source, line_no);
+        }
+    }
+    
+    // Drop all per-line parse state in one step
+    arena_reset();
+    return num_tokens;
+}
+
+/**
+ * Run a script from its compiled form: the lines' tokens and command lists
+ * are used straight from the mapped cache, the text from the mapped script
+ * @param path Script path for error messages
+ * @param map Mapped script
+ * @param hdr Mapped cache, validated by script_cache_load
+ */
+static void run_script_cached(const char* path, const char* map, const script_cache_header_t* hdr) {
+    const char* base = (const char*)hdr;
+    const script_line_t* lines = (const script_line_t*)(base + hdr->lines_off);
+    token_t* tokens = (token_t*)(base + hdr->tokens_off);         // Never written
+    list_node_t* nodes = (list_node_t*)(base + hdr->nodes_off);
+    
+    for (uint32_t i = 0; i < hdr->num_lines && g_shell_running; i++) {
+        const script_line_t* line = &lines[i];
+        lexed_line_t lex = { map + line->text_off, tokens + line->first_token,
+                             line->num_tokens, line->num_tokens };
+        command_list_t list = { nodes + line->first_node, line->num_nodes };
+        run_compiled(&lex, line->num_tokens, line->num_nodes >= 0 ? &list : NULL,
+                     (int)line->first_node, path, line->line_no);
+        arena_reset();
+        events_dispatch(0);
+        jobs_notify();
+        pool_refill();
+    }
+}
+
+/**
+ * Run a script file from a read-only mapping
+ * Nothing is read or parsed up front: each line is located with memchr and
+ * lexed in place right before it runs, so startup cost does not depend on
+ * the script size. Files that cannot be mapped (pipes, /dev/stdin) are read
+ * line by line instead.
+ * A mapped script is compiled into the script cache as it runs; later runs
+ * of the unchanged file skip lexing and PATH searches altogether.
+ * @param path Script path
+ * @return Status of the last pipeline run (or passed to 'exit'),
+ *         EXIT_FAILURE if the script cannot be opened
+ */
+static int run_script(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "Error: cannot open script '%s': %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    
+    struct stat st;
+    const char* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    
+    unsigned long line_no = 0;
+    if (map != MAP_FAILED) {
+        close(fd);
+        madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        char* cache = script_cache_path(path, 0);
+        size_t cache_len = 0;
+        const script_cache_header_t* hdr = cache ? script_cache_load(cache, &st, &cache_len) : NULL;
+        if (hdr) {
+            if (g_debug_mode) {
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                fprintf(stderr, "Script cache: loaded %u lines (%u commands) in %ld us\n",
+                        hdr->num_lines, g_script_cmds.count,
+                        (long)((t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000));
+            }
+            run_script_cached(path, map, hdr);
+            memset(&g_script_cmds, 0, sizeof(g_script_cmds));
+            munmap((void*)hdr, cache_len);
+            free(cache);
+            munmap((void*)map, st.st_size);
+            return g_last_status;
+        }
+        
+        g_script_rec.active = cache != NULL;
+        g_script_rec.base = map;
+        const char* p = map;
+        const char* end = map + st.st_size;
+        while (p < end && g_shell_running) {
+            const char* nl = memchr(p, '\n', end - p);
+            const char* line_end = nl ? nl : end;
+            line_no++;
+            run_line(p, line_end - p, path, line_no, 1);
+            p = line_end + 1;
+            events_dispatch(0);
+            jobs_notify();
+            pool_refill();
+        }
+        
+        // A script that exited early is still compiled to the end, unless
+        // that would mean parsing a large tail it never needed
+        if (p < end && end - p > SCRIPT_CACHE_TAIL_MAX) {
+            g_script_rec.active = 0;
+        }
+        while (p < end && g_script_rec.active) {
+            const char* nl = memchr(p, '\n', end - p);
+            const char* line_end = nl ? nl : end;
+            line_no++;
+            run_line(p, line_end - p, path, line_no, 0);
+            p = line_end + 1;
+        }
+        if (g_script_rec.active) {
+            free(cache);
+            cache = script_cache_path(path, 1);
+            if (cache) script_cache_write(cache, &st);
+        }
+        script_rec_free();
+        free(cache);
+        munmap((void*)map, st.st_size);
+    } else if (!S_ISREG(st.st_mode)) {
+        FILE* in = fdopen(fd, "r");
+        char* line = NULL;
+        size_t line_size = 0;
+        ssize_t line_length;
+        while (in && g_shell_running && (line_length = getline(&line, &line_size, in)) != -1) {
+            line_no++;
+            run_line(line, line_length, path, line_no, 1);
+            events_dispatch(0);
+            jobs_notify();
+            pool_refill();
+        }
+        free(line);
+        if (in) fclose(in);
+        else close(fd);
+    } else {
+        close(fd); // Empty file
+    }
+    return g_last_status;
+}
+
+/* Standard input buffer of the interactive loop */
+typedef struct {
+    char* buf;
+    size_t start;           // First byte not yet returned
+    size_t len;             // Bytes in buf
+    size_t cap;
+    int eof;
+} input_t;
+
+/**
+ * Wait for more standard input, serving shell events (signals, background
+ * job exits) in the meantime
+ * @param in Input buffer; unread bytes are kept at the front
+ * @param loop_fd epoll set of stdin (tag 0) and the shell events (tag 1),
+ *                -1 when stdin cannot be polled (regular file)
+ * @return 1 when bytes were added, 0 at end of input or shutdown
+ */
+static int input_fill(input_t* in, int loop_fd) {
+    for (;;) {
+        if (in->eof || !g_shell_running) {
+            return 0;
+        }
+        
+        if (loop_fd != -1) {
+            struct epoll_event ev;
+            int n = epoll_wait(loop_fd, &ev, 1, -1);
+            if (n == -1 && errno == EINTR) continue;
+            if (n == -1) {
+                perror("epoll_wait");
+                return 0;
+            }
+            if (ev.data.u64 == 1) {
+                events_dispatch(0);
+                continue;
+            }
+        }
+        
+        // Keep the partial line at the front and make room for one more read
+        if (in->start > 0) {
+            memmove(in->buf, in->buf + in->start, in->len - in->start);
+            in->len -= in->start;
+            in->start = 0;
+        }
+        if (in->cap - in->len < INPUT_CHUNK) {
+            size_t cap = in->cap * 2 + INPUT_CHUNK;
+            char* buf = realloc(in->buf, cap);
+            if (!buf) {
+                perror("realloc");
+                return 0;
+            }
+            in->buf = buf;
+            in->cap = cap;
+        }
+        ssize_t r = io_read(STDIN_FILENO, in->buf + in->len, INPUT_CHUNK);
+        if (r == -1 && errno == EINTR) continue;
+        if (r == -1) perror("read");
+        if (r <= 0) {
+            in->eof = 1;
+            return 0;
+        }
+        in->len += r;
+        return 1;
+    }
+}
+
+/**
+ * Return the next line of standard input
+ * @param in Input buffer
+ * @param loop_fd Event loop set, see input_fill()
+ * @param line Output: start of the line, valid until the next call
+ * @return Line length including the newline, 0 at end of input or shutdown
+ */
+static ssize_t input_read_line(input_t* in, int loop_fd, const char** line) {
+    for (;;) {
+        const char* nl = in->len > in->start ? memchr(in->buf + in->start, '\n', in->len - in->start) : NULL;
+        if (nl || (in->eof && in->len > in->start)) {
+            size_t end = nl ? (size_t)(nl - in->buf) + 1 : in->len;
+            ssize_t n = (ssize_t)(end - in->start);
+            *line = in->buf + in->start;
+            in->start = end;
+            return n;
+        }
+        if (!input_fill(in, loop_fd) && !(in->eof && in->len > in->start)) {
+            return 0;
+        }
+    }
+}
+
+/* Sorted, de-duplicated names of the executables on $PATH */
+typedef struct {
+    char** names;
+    size_t count;
+    char* pool;             // Storage behind names
+} path_index_t;
+
+#define COMPLETE_LIST_MAX 256   // Candidates kept for listing
+#define PATH_SETTLE_MS 50       // Quiet time after a burst of PATH changes
+
+static pthread_mutex_t g_path_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_path_cond = PTHREAD_COND_INITIALIZER;
+static path_index_t* g_path_index = NULL;   // Swapped whole by the indexer thread
+static int g_path_scanned = 0;              // First scan finished
+static int g_path_indexer = 0;              // Indexer thread running
+static char* g_path_dirs = NULL;            // PATH the indexer works on
+static unsigned g_path_gen = 0;             // Bumped with every new g_path_dirs
+static int g_path_wake = -1;                // eventfd: g_path_dirs changed
+
+/**
+ * Order strings through pointers, for qsort
+ */
+static int cmp_name(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * Release a PATH index
+ */
+static void path_index_free(path_index_t* idx) {
+    if (!idx) return;
+    free(idx->names);
+    free(idx->pool);
+    free(idx);
+}
+
+/**
+ * Scan every $PATH directory for executables
+ * @param path Value of $PATH
+ * @return New index, or NULL on allocation failure
+ */
+static path_index_t* path_index_build(const char* path) {
+    size_t pool_len = 0, pool_cap = 64 * 1024;
+    size_t count = 0, cap = 4096;
+    char* pool = malloc(pool_cap);
+    size_t* offsets = malloc(cap * sizeof(*offsets));
+    path_index_t* idx = calloc(1, sizeof(*idx));
+    if (!pool || !offsets || !idx) goto fail;
+    
+    for (const char* dir = path; ; ) {
+        const char* colon = strchr(dir, ':');
+        size_t dir_len = colon ? (size_t)(colon - dir) : strlen(dir);
+        char dir_path[PATH_MAX];
+        if (dir_len == 0) strcpy(dir_path, ".");     // Empty entry: current directory
+        else snprintf(dir_path, sizeof(dir_path), "%.*s", (int)dir_len, dir);
+        
+        int dfd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DIR* d = dfd != -1 ? fdopendir(dfd) : NULL;
+        if (!d && dfd != -1) close(dfd);
+        struct dirent* de;
+        while (d && (de = readdir(d))) {
+            if (de->d_name[0] == '.' || de->d_type == DT_DIR) continue;
+            if (faccessat(dfd, de->d_name, X_OK, 0) != 0) continue;
+            struct stat st;
+            if (de->d_type != DT_REG &&
+                (fstatat(dfd, de->d_name, &st, 0) != 0 || S_ISDIR(st.st_mode))) continue;
+            
+            size_t len = strlen(de->d_name) + 1;
+            if (pool_len + len > pool_cap) {
+                char* grown = realloc(pool, pool_cap * 2);
+                if (!grown) goto fail;
+                pool = grown;
+                pool_cap *= 2;
+            }
+            if (count == cap) {
+                size_t* grown = realloc(offsets, cap * 2 * sizeof(*offsets));
+                if (!grown) goto fail;
+                offsets = grown;
+                cap *= 2;
+            }
+            memcpy(pool + pool_len, de->d_name, len);
+            offsets[count++] = pool_len;
+            pool_len += len;
+        }
+        if (d) closedir(d);
+        if (!colon) break;
+        dir = colon + 1;
+    }
+    
+    idx->names = malloc((count ? count : 1) * sizeof(char*));
+    if (!idx->names) goto fail;
+    for (size_t i = 0; i < count; i++) {
+        idx->names[i] = pool + offsets[i];
+    }
+    qsort(idx->names, count, sizeof(char*), cmp_name);
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (kept == 0 || strcmp(idx->names[kept - 1], idx->names[i]) != 0) {
+            idx->names[kept++] = idx->names[i];
+        }
+    }
+    idx->count = kept;
+    idx->pool = pool;
+    free(offsets);
+    return idx;
+    
+fail:
+    free(pool);
+    free(offsets);
+    if (idx) free(idx->names);
+    free(idx);
+    return NULL;
+}
+
+/**
+ * Indexer thread: scan $PATH, publish the index, then rescan whenever
+ * inotify reports a change in one of its directories, or start over
+ * when the shell's PATH itself changes (g_path_wake)
+ */
+static void* path_indexer(void* arg) {
+    (void)arg;
+    for (int done = 0; !done; ) {
+        pthread_mutex_lock(&g_path_lock);
+        unsigned gen = g_path_gen;
+        char* path = safe_strdup(g_path_dirs);
+        pthread_mutex_unlock(&g_path_lock);
+        if (!path) break;
+        int ino = inotify_init1(IN_CLOEXEC);
+        
+        for (;;) {
+            // (Re)arm watches first so no change between scan and wait is lost;
+            // directories that appeared since the last scan are picked up too
+            for (const char* dir = path; ino != -1; ) {
+                const char* colon = strchr(dir, ':');
+                size_t dir_len = colon ? (size_t)(colon - dir) : strlen(dir);
+                char dir_path[PATH_MAX];
+                if (dir_len == 0) strcpy(dir_path, ".");
+                else snprintf(dir_path, sizeof(dir_path), "%.*s", (int)dir_len, dir);
+                inotify_add_watch(ino, dir_path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                                 IN_ATTRIB | IN_ONLYDIR);
+                if (!colon) break;
+                dir = colon + 1;
+            }
+            
+            // An index of a PATH the shell already left is dropped
+            path_index_t* idx = path_index_build(path);
+            pthread_mutex_lock(&g_path_lock);
+            int current = gen == g_path_gen;
+            path_index_t* old = g_path_index;
+            if (current) {
+                if (idx) g_path_index = idx;
+                g_path_scanned = 1;
+                pthread_cond_broadcast(&g_path_cond);
+            }
+            pthread_mutex_unlock(&g_path_lock);
+            if (current && idx) path_index_free(old);
+            if (!current) {
+                path_index_free(idx);
+                break;
+            }
+            
+            // Wait for a change, then let a burst of them (an install) settle
+            struct pollfd pfds[2] = { { ino, POLLIN, 0 }, { g_path_wake, POLLIN, 0 } };
+            if (ino == -1 && g_path_wake == -1) {
+                done = 1;
+                break;
+            }
+            int r;
+            do {
+                r = poll(pfds, 2, -1);
+            } while (r == -1 && errno == EINTR);
+            if (r <= 0) {
+                done = 1;
+                break;
+            }
+            if (pfds[1].revents & POLLIN) {
+                uint64_t count;
+                if (read(g_path_wake, &count, sizeof(count)) == -1 && errno != EAGAIN) done = 1;
+                break;
+            }
+            char events[4096];
+            if (read(ino, events, sizeof(events)) <= 0) {
+                done = 1;
+                break;
+            }
+            struct pollfd pfd = { ino, POLLIN, 0 };
+            while (poll(&pfd, 1, PATH_SETTLE_MS) > 0 && read(ino, events, sizeof(events)) > 0) {
+            }
+        }
+        if (ino != -1) close(ino);
+        free(path);
+    }
+    
+    // Completion must not wait for a scan that never comes
+    pthread_mutex_lock(&g_path_lock);
+    g_path_indexer = 0;
+    pthread_cond_broadcast(&g_path_cond);
+    pthread_mutex_unlock(&g_path_lock);
+    return NULL;
+}
+
+/**
+ * PATH the index should cover
+ */
+static const char* path_index_dirs(void) {
+    return g_env.path ? g_env.path : "/usr/local/bin:/usr/bin:/bin";
+}
+
+/**
+ * Start the background PATH indexer (once)
+ */
+static void path_index_start(void) {
+    if (g_path_indexer) return;
+    free(g_path_dirs);
+    g_path_dirs = safe_strdup(path_index_dirs());
+    if (!g_path_dirs) return;
+    if (g_path_wake == -1) g_path_wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    g_path_indexer = 1;
+    if (pthread_create(&thread, &attr, path_indexer, NULL) != 0) {
+        g_path_indexer = 0;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/**
+ * In a forked child: the indexer thread was not copied, and its lock may
+ * have been taken at the moment of the fork, so it is never touched again
+ */
+static void path_index_detach(void) {
+    g_path_indexer = 0;
+    if (g_path_wake != -1) close(g_path_wake);
+    g_path_wake = -1;
+}
+
+/**
+ * Point the indexer at a changed PATH ('export PATH=...'): completion
+ * waits for the new scan instead of offering the old directories
+ */
+static void path_index_update(void) {
+    if (!g_path_indexer) return;
+    const char* path = path_index_dirs();
+    pthread_mutex_lock(&g_path_lock);
+    if (g_path_indexer && g_path_wake != -1 && strcmp(path, g_path_dirs) != 0) {
+        char* copy = safe_strdup(path);
+        if (copy) {
+            free(g_path_dirs);
+            g_path_dirs = copy;
+            g_path_gen++;
+            g_path_scanned = 0;
+            uint64_t one = 1;
+            write(g_path_wake, &one, sizeof(one));
+        }
+    }
+    pthread_mutex_unlock(&g_path_lock);
+}
+
+/* Completion candidates for the word under the cursor */
+typedef struct {
+    const char* items[COMPLETE_LIST_MAX];   // First candidates (arena), '/' marks directories
+    size_t shown;
+    size_t count;                           // All candidates
+    const char* common;                     // Longest common prefix of all candidates
+    size_t common_len;
+} completion_t;
+
+/**
+ * Add a candidate: update the common prefix, keep it for listing
+ * @param dir Candidate is a directory
+ */
+static void completion_add(completion_t* c, const char* name, size_t len, int dir) {
+    if (c->count == 0) {
+        c->common = name;
+        c->common_len = len;
+    } else {
+        size_t i = 0;
+        while (i < c->common_len && i < len && c->common[i] == name[i]) i++;
+        c->common_len = i;
+    }
+    if (c->count == 0 || c->shown < COMPLETE_LIST_MAX) {
+        char* copy = arena_alloc(len + 2);
+        if (copy) {
+            memcpy(copy, name, len);
+            copy[len] = dir ? '/' : '\0';
+            copy[len + dir] = '\0';
+            if (c->count == 0) c->common = copy;
+            if (c->shown < COMPLETE_LIST_MAX) c->items[c->shown++] = copy;
+        }
+    }
+    c->count++;
+}
+
+/**
+ * Complete a command name from the built-ins, the prefixes and the PATH
+ * index: a binary search to the first match, then a walk along the run
+ */
+static void complete_command(completion_t* c, const char* word, size_t len) {
+    for (const builtin_t* b = g_builtins; b->name; b++) {
+        if (strncmp(b->name, word, len) == 0) completion_add(c, b->name, strlen(b->name), 0);
+    }
+    for (int i = 0; g_prefixes[i]; i++) {
+        if (strncmp(g_prefixes[i], word, len) == 0) completion_add(c, g_prefixes[i], strlen(g_prefixes[i]), 0);
+    }
+    
+    // The first Tab may arrive while the initial scan is still running
+    pthread_mutex_lock(&g_path_lock);
+    while (g_path_indexer && !g_path_scanned) {
+        pthread_cond_wait(&g_path_cond, &g_path_lock);
+    }
+    const path_index_t* idx = g_path_index;
+    if (idx) {
+        size_t lo = 0, hi = idx->count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (strncmp(idx->names[mid], word, len) < 0) lo = mid + 1;
+            else hi = mid;
+        }
+        for (size_t i = lo; i < idx->count && strncmp(idx->names[i], word, len) == 0; i++) {
+            completion_add(c, idx->names[i], strlen(idx->names[i]), 0);
+        }
+    }
+    pthread_mutex_unlock(&g_path_lock);
+}
+
+/**
+ * Complete a file path: list the directory part, match the last component
+ * @return Offset in word where the completed component starts
+ */
+static size_t complete_file(completion_t* c, const char* word, size_t len) {
+    const char* slash = memrchr(word, '/', len);
+    size_t base = slash ? (size_t)(slash - word) + 1 : 0;
+    char dir_path[PATH_MAX];
+    if (base == 0) strcpy(dir_path, ".");
+    else snprintf(dir_path, sizeof(dir_path), "%.*s", (int)base, word);
+    
+    DIR* d = opendir(dir_path);
+    if (!d) return base;
+    const char* stem = word + base;
+    size_t stem_len = len - base;
+    struct dirent* de;
+    while ((de = readdir(d))) {
+        const char* name = de->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        if (name[0] == '.' && (stem_len == 0 || stem[0] != '.')) continue;
+        if (strncmp(name, stem, stem_len) != 0) continue;
+        int is_dir = de->d_type == DT_DIR;
+        if (de->d_type == DT_LNK || de->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = fstatat(dirfd(d), name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        }
+        completion_add(c, name, strlen(name), is_dir);
+    }
+    closedir(d);
+    return base;
+}
+
+/* Line being edited */
+typedef struct {
+    char* buf;
+    size_t len;
+    size_t pos;             // Cursor
+    size_t cap;
+    const char* prompt;
+} edit_line_t;
+
+static int g_editor = 0;                // Line editor active
+static int g_editor_tty = 0;            // Input is a terminal (raw mode used)
+static struct termios g_editor_saved;   // Terminal mode to restore
+
+/**
+ * Enable the line editor: on a terminal, or on any input with
+ * SHELL_LINE_EDITOR=1 (SHELL_LINE_EDITOR=0 turns it off)
+ */
+static void editor_init(void) {
+    const char* mode = g_env.line_editor;
+    if (mode && strcmp(mode, "0") == 0) return;
+    g_editor_tty = isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &g_editor_saved) == 0;
+    g_editor = g_editor_tty || (mode && strcmp(mode, "1") == 0);
+    if (g_editor) path_index_start();
+}
+
+/**
+ * Redraw the prompt and the line, then place the cursor
+ */
+static void editor_refresh(const edit_line_t* e) {
+    printf("\r%s%.*s\x1b[K", e->prompt, (int)e->len, e->buf);
+    if (e->pos < e->len) printf("\x1b[%zuD", e->len - e->pos);
+    fflush(stdout);
+}
+
+/**
+ * Replace bytes [from, to) of the line with text, leaving the cursor after it
+ * @return SUCCESS or ERROR_MEMORY
+ */
+static int editor_splice(edit_line_t* e, size_t from, size_t to, const char* text, size_t len) {
+    if (e->len - (to - from) + len + 2 > e->cap) {
+        size_t cap = (e->len + len) * 2 + 64;
+        char* buf = realloc(e->buf, cap);
+        if (!buf) return ERROR_MEMORY;
+        e->buf = buf;
+        e->cap = cap;
+    }
+    memmove(e->buf + from + len, e->buf + to, e->len - to);
+    memcpy(e->buf + from, text, len);
+    e->len = e->len - (to - from) + len;
+    e->pos = from + len;
+    return SUCCESS;
+}
+
+/**
+ * Tab: complete the word before the cursor. A unique candidate is inserted
+ * whole; otherwise the common prefix is, and a second Tab lists them.
+ * @param again Previous key was also Tab
+ */
+static void editor_complete(edit_line_t* e, int again) {
+    size_t start = e->pos;
+    while (start > 0 && !strchr(" \t;|&<>()", e->buf[start - 1])) start--;
+    size_t before = start;
+    while (before > 0 && (e->buf[before - 1] == ' ' || e->buf[before - 1] == '\t')) before--;
+    // After any list operator (';', '&&', '||', '|', '&', '(') a command starts
+    int command = before == 0 || strchr(";|&(", e->buf[before - 1]);
+    const char* word = e->buf + start;
+    size_t len = e->pos - start;
+    
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    completion_t c;
+    c.shown = c.count = 0;
+    size_t base = 0;
+    if (command && !memchr(word, '/', len)) {
+        complete_command(&c, word, len);
+    } else {
+        base = complete_file(&c, word, len);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (g_debug_mode) {
+        fprintf(stderr, "\nCompletion: %zu candidates in %.1f us\n", c.count,
+                (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3);
+    }
+    if (c.count == 0) {
+        printf("\a");
+        editor_refresh(e);
+        return;
+    }
+    
+    size_t have = len - base;
+    if (c.count == 1) {
+        // Whole name plus a separator ('/' is already part of a directory)
+        size_t n = strlen(c.common);
+        int dir = n > 0 && c.common[n - 1] == '/';
+        if (editor_splice(e, start + base, e->pos, c.common, n) == SUCCESS && !dir) {
+            editor_splice(e, e->pos, e->pos, " ", 1);
+        }
+    } else if (c.common_len > have) {
+        editor_splice(e, start + base, e->pos, c.common, c.common_len);
+    } else if (again) {
+        struct winsize ws;
+        int width = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col ? ws.ws_col : 80;
+        size_t col_width = 0;
+        for (size_t i = 0; i < c.shown; i++) {
+            size_t n = strlen(c.items[i]);
+            if (n > col_width) col_width = n;
+        }
+        col_width += 2;
+        size_t cols = (size_t)width / col_width ? (size_t)width / col_width : 1;
+        printf("\n");
+        for (size_t i = 0; i < c.shown; i++) {
+            printf("%-*s", (int)col_width, c.items[i]);
+            if ((i + 1) % cols == 0 || i + 1 == c.shown) printf("\n");
+        }
+        if (c.count > c.shown) printf("... and %zu more\n", c.count - c.shown);
+    } else {
+        printf("\a");
+    }
+    editor_refresh(e);
+}
+
+/**
+ * Next input byte for the editor, waiting (and serving events) if needed
+ * @return The byte, or -1 at end of input or shutdown
+ */
+static int editor_byte(input_t* in, int loop_fd) {
+    while (in->start == in->len) {
+        if (!input_fill(in, loop_fd)) return -1;
+    }
+    return (unsigned char)in->buf[in->start++];
+}
+
+/**
+ * Read a line with the line editor: cursor movement, kill commands,
+ * history on the arrow keys and Tab completion
+ * @param in Input buffer
+ * @param loop_fd Event loop set, see input_fill()
+ * @param prompt Prompt to draw (and redraw)
+ * @param line Output: the line with its newline, valid until the next call
+ * @return Line length including the newline, 0 at end of input or shutdown
+ */
+static ssize_t editor_read_line(input_t* in, int loop_fd, const char* prompt, const char** line) {
+    static edit_line_t e = { NULL, 0, 0, 0, NULL };
+    static char* saved = NULL;          // Line being typed while browsing history
+    static size_t saved_len = 0;
+    e.len = e.pos = 0;
+    e.prompt = prompt;
+    if (editor_splice(&e, 0, 0, "", 0) != SUCCESS) return 0;
+    
+    if (g_editor_tty) {
+        struct termios raw = g_editor_saved;
+        raw.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+        raw.c_iflag &= ~(ICRNL | IXON);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+    }
+    editor_refresh(&e);
+    
+    size_t hist_pos = 0;
+    int browsing = 0;
+    int last = 0;
+    ssize_t result = 0;
+    for (;;) {
+        int ch = editor_byte(in, loop_fd);
+        if (ch == -1) {
+            // Input ended mid-line: run what was typed
+            if (e.len > 0 && in->eof) break;
+            goto done;
         }
+        if (ch == '\r' || ch == '\n') break;
         
-        num_commands++;
+        switch (ch) {
+        case '\t':
+            editor_complete(&e, last == '\t');
+            break;
+        case 127:
+        case 8:             // Backspace
+            if (e.pos > 0) editor_splice(&e, e.pos - 1, e.pos, "", 0);
+            break;
+        case 4:             // Ctrl-D: end of input on an empty line
+            if (e.len == 0) {
+                goto done;
+            }
+            if (e.pos < e.len) {
+                size_t pos = e.pos;
+                editor_splice(&e, pos, pos + 1, "", 0);
+                e.pos = pos;
+            }
+            break;
+        case 1:             // Ctrl-A
+            e.pos = 0;
+            break;
+        case 5:             // Ctrl-E
+            e.pos = e.len;
+            break;
+        case 2:             // Ctrl-B
+            if (e.pos > 0) e.pos--;
+            break;
+        case 6:             // Ctrl-F
+            if (e.pos < e.len) e.pos++;
+            break;
+        case 11:            // Ctrl-K
+            e.len = e.pos;
+            break;
+        case 21:            // Ctrl-U
+            editor_splice(&e, 0, e.pos, "", 0);
+            break;
+        case 23: {          // Ctrl-W
+            size_t from = e.pos;
+            while (from > 0 && e.buf[from - 1] == ' ') from--;
+            while (from > 0 && e.buf[from - 1] != ' ') from--;
+            editor_splice(&e, from, e.pos, "", 0);
+            break;
+        }
+        case 12:            // Ctrl-L
+            printf("\x1b[H\x1b[2J");
+            break;
+        case 27: {          // Escape sequences: arrows, Home/End, Delete
+            int c1 = editor_byte(in, loop_fd);
+            int c2 = c1 == '[' || c1 == 'O' ? editor_byte(in, loop_fd) : -1;
+            if (c2 >= '0' && c2 <= '9') {
+                int c3 = editor_byte(in, loop_fd);
+                if (c2 == '3' && c3 == '~' && e.pos < e.len) {
+                    size_t pos = e.pos;
+                    editor_splice(&e, pos, pos + 1, "", 0);
+                    e.pos = pos;
+                } else if ((c2 == '1' || c2 == '7') && c3 == '~') {
+                    e.pos = 0;
+                } else if ((c2 == '4' || c2 == '8') && c3 == '~') {
+                    e.pos = e.len;
+                }
+            } else if (c2 == 'C' && e.pos < e.len) {
+                e.pos++;
+            } else if (c2 == 'D' && e.pos > 0) {
+                e.pos--;
+            } else if (c2 == 'H') {
+                e.pos = 0;
+            } else if (c2 == 'F') {
+                e.pos = e.len;
+            } else if (c2 == 'A' || c2 == 'B') {
+                history_load();
+                if (!browsing) {
+                    // Keep the line being typed for when the user comes back down
+                    char* copy = realloc(saved, e.len + 1);
+                    if (!copy) break;
+                    saved = copy;
+                    memcpy(saved, e.buf, e.len);
+                    saved_len = e.len;
+                    hist_pos = g_hist_count;
+                    browsing = 1;
+                }
+                if (c2 == 'A' && hist_pos > 0) {
+                    hist_pos--;
+                } else if (c2 == 'B' && hist_pos < g_hist_count) {
+                    hist_pos++;
+                } else {
+                    break;
+                }
+                if (hist_pos < g_hist_count) {
+                    editor_splice(&e, 0, e.len, g_hist[hist_pos].text, g_hist[hist_pos].len);
+                } else {
+                    editor_splice(&e, 0, e.len, saved, saved_len);
+                }
+            }
+            break;
+        }
+        default:
+            if (ch >= 32) {
+                char byte = (char)ch;
+                editor_splice(&e, e.pos, e.pos, &byte, 1);
+            }
+            break;
+        }
+        last = ch;
+        if (ch != '\t') editor_refresh(&e);
     }
     
-    commands[num_commands] = NULL;
-    return num_commands;
+    e.buf[e.len] = '\n';
+    *line = e.buf;
+    result = (ssize_t)e.len + 1;
+    printf("\n");
+    fflush(stdout);
+    
+done:
+    if (g_editor_tty) {
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &g_editor_saved);
+    }
+    return result;
 }
 
 /**
  * Main shell loop with interactive prompt
+ * @param argc Argument count
+ * @param argv 'shell [script]': with a script path, run it and exit
  * @return EXIT_SUCCESS or EXIT_FAILURE
  */
-int main() {
-    char* line = NULL;
-    size_t line_size = 0;
+int main(int argc, char** argv) {
+    input_t input = { NULL, 0, 0, 0, 0 };
+    const char* line;
     ssize_t line_length;
     
+    startup_mark(STARTUP_MAIN);
+    env_scan();
+    startup_mark(STARTUP_ENV);
+    
     // Check if we're in test mode
-    g_test_mode = (getenv("SHELL_TEST_MODE") != NULL);
+    g_test_mode = (g_env.test_mode != NULL);
+    g_debug_mode = (g_env.debug != NULL);
     
-    // Detect if we're running interactively (or in test mode)
-    int is_interactive = isatty(STDIN_FILENO) || g_test_mode;
+    // Detect if we're running interactively (or in test mode); scripts never are
+    int is_interactive = argc < 2 && (isatty(STDIN_FILENO) || g_test_mode);
+    g_interactive = is_interactive;
     
-    // Setup signal handlers
+    // Setup signal handlers, then move signals into the event loop
     setup_signal_handlers();
+    events_init();
+    startup_mark(STARTUP_SIGNALS);
+    
+    // SHELL_IO_URING=0 keeps the shell's own I/O on read/write
+    const char* uring_env = g_env.io_uring;
+    if (uring_env && strcmp(uring_env, "0") == 0) {
+        g_io_uring = 0;
+    }
+    
+    // Grace period before producers of a finished consumer are signalled
+    const char* grace_env = g_env.pipe_grace_ms;
+    if (grace_env && *grace_env) {
+        g_pipe_grace_ms = atoi(grace_env);
+    }
+    
+    // Optional pool of pre-forked launch helpers
+    const char* pool_env = g_env.pool;
+    if (pool_env && atoi(pool_env) > 0) {
+        pool_init(atoi(pool_env));
+    }
+    
+    // Interactive lines are recorded; the file itself is read on first use
+    if (is_interactive) {
+        history_init();
+        editor_init();
+    }
+    startup_mark(STARTUP_INIT);
+    
+    // A static stdout buffer spares the first printf an fstat and a malloc;
+    // line buffered on a terminal like the stdio default
+    static char stdout_buf[BUFSIZ];
+    setvbuf(stdout, stdout_buf, isatty(STDOUT_FILENO) ? _IOLBF : _IOFBF, sizeof(stdout_buf));
+    
+    if (argc >= 2) {
+        startup_mark(STARTUP_STDIO);
+        if (g_env.startup_profile) {
+            startup_report();
+        }
+        int status = run_script(argv[1]);
+        pool_shutdown();
+        memo_shutdown();
+        history_shutdown();
+        coproc_shutdown();
+        arena_destroy();
+        return status;
+    }
+    
+    // One epoll set for stdin and the shell events; regular files cannot
+    // be polled and are simply read
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = 0 };
+    int loop_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop_fd != -1 && epoll_ctl(loop_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == -1) {
+        close(loop_fd);
+        loop_fd = -1;
+    }
+    ev.data.u64 = 1;
+    if (loop_fd != -1 && g_event_fd != -1) {
+        epoll_ctl(loop_fd, EPOLL_CTL_ADD, g_event_fd, &ev);
+    }
     
     // Show welcome message in interactive mode or test mode
     if (is_interactive) {
         printf("Shell started. Type 'exit' to quit.\n");
     }
     
+    int first_prompt = 1;
     while (g_shell_running) {
-        // Show prompt in interactive mode or test mode
-        if (is_interactive) {
+        // Report background jobs collected since the last prompt
+        events_dispatch(0);
+        jobs_notify();
+        pool_refill();
+        
+        // Show prompt in interactive mode or test mode (the editor draws its own)
+        if (is_interactive && !g_editor) {
             printf("Shell> ");
             fflush(stdout);
         }
+        if (first_prompt) {
+            first_prompt = 0;
+            startup_mark(STARTUP_STDIO);
+            if (g_env.startup_profile) {
+                startup_report();
+            }
+        }
         
         // Read input line
-        line_length = getline(&line, &line_size, stdin);
+        line_length = g_editor ? editor_read_line(&input, loop_fd, "Shell> ", &line)
+                               : input_read_line(&input, loop_fd, &line);
         
-        if (line_length == -1) {
-            if (feof(stdin)) {
-                if (is_interactive) {
-                    printf("\nGoodbye!\n");
-                }
-                break;
-            } else {
-                perror("getline");
-                continue;
+        if (line_length == 0) {
+            if (is_interactive && g_shell_running) {
+                printf("\nGoodbye!\n");
             }
+            break;
         }
         
-        // Remove trailing newline
-        if (line_length > 0 && line[line_length - 1] == '\n') {
-            line[line_length - 1] = '\0';
+        if (is_interactive) {
+            history_add(line, line_length);
         }
         
         // Skip empty lines
-        char* trimmed_line = trim(line);
-        if (strlen(trimmed_line) == 0) {
-            continue;
-        }
-        
-        // Create a copy for parsing
-        char* line_copy = safe_strdup(trimmed_line);
-        if (!line_copy) {
+        if (run_line(line, line_length, NULL, 0, 1) == 0) {
             continue;
         }
         
-        // Parse pipe commands
-        char* commands[MAX_COMMANDS];
-        int num_commands = parse_pipe_commands(line_copy, commands);
-        
-        if (num_commands > 0) {
-            if (num_commands == 1) {
-                // Single command
-                char* args[MAX_ARGS];
-                char* cmd_copy = safe_strdup(commands[0]);
-                if (cmd_copy) {
-                    int parse_result = parse_args(cmd_copy, args);
-                    if (parse_result > 0) {
-                        execute_command(args);
-                    } else if (parse_result == -1) {
-                        fprintf(stderr, "Error: Too many arguments in command '%s' (maximum %d)\n", cmd_copy, MAX_ARGS);
-                    } else if (parse_result == -2) {
-                        fprintf(stderr, "Error: Unclosed quotes\n");
-                    } else {
-                        fprintf(stderr, "Error: Invalid command\n");
-                    }
-                    free(cmd_copy);
-                }
-            } else {
-                // Pipeline
-                execute_pipe(commands, num_commands);
-            }
-        }
-        
-        free(line_copy);
-        
         // In non-interactive mode, exit after processing one command sequence
         if (!is_interactive) {
             break;
         }
     }
     
-    free(line);
+    free(input.buf);
+    if (loop_fd != -1) close(loop_fd);
+    pool_shutdown();
+    memo_shutdown();
+    history_shutdown();
+    coproc_shutdown();
+    if (g_hist_fd != -1) close(g_hist_fd);
+    arena_destroy();
     if (is_interactive) {
         printf("Shell terminated.\n");
     }
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    return g_last_status;
+}
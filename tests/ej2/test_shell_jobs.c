@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <assert.h>
+#include <signal.h>
+#include <time.h>
+
+// JOB CONTROL AND CONCURRENCY TESTING FRAMEWORK
+// Tests background jobs, the job table and parallel execution features
+
+#define RUN_TEST(test_func) do { \
+    printf(" Running jobs test: %s\n", #test_func); \
+    test_func(); \
+    printf(" %s passed\n", #test_func); \
+} while(0)
+
+#define TEST(name) void name()
+
+// Helper to feed several lines to the shell in test mode (prompt loop active)
+// Input is passed to printf, so use \\n between lines and avoid single quotes
+char* run_shell_session(const char* input, int timeout_sec) {
+    static char output[8192];
+    memset(output, 0, sizeof(output));
+
+    char full_cmd[2048];
+    snprintf(full_cmd, sizeof(full_cmd),
+        "cd ../../src/ej2 && printf '%s' | SHELL_TEST_MODE=1 timeout %d ./shell 2>&1",
+        input, timeout_sec);
+
+    FILE* fp = popen(full_cmd, "r");
+    if (!fp) return output;
+
+    char line[512];
+    while (fgets(line, sizeof(line), fp)) {
+        if (strlen(output) + strlen(line) < sizeof(output) - 1) {
+            strcat(output, line);
+        }
+    }
+    pclose(fp);
+
+    return output;
+}
+
+// Helper to run an arbitrary command line through bash and capture its output
+char* run_capture_jobs(const char* full_cmd) {
+    static char output[8192];
+    memset(output, 0, sizeof(output));
+
+    FILE* fp = popen(full_cmd, "r");
+    if (!fp) return output;
+
+    char line[512];
+    while (fgets(line, sizeof(line), fp)) {
+        if (strlen(output) + strlen(line) < sizeof(output) - 1) {
+            strcat(output, line);
+        }
+    }
+    pclose(fp);
+
+    return output;
+}
+
+// Wall clock helper in seconds
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Test: Background pipelines run and 'wait' collects them
+TEST(test_background_and_wait) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing background pipelines with wait...\n");
+
+    char* output = run_shell_session("echo one | cat & echo two | cat & wait\\nexit\\n", 10);
+
+    assert(strstr(output, "one") != NULL);
+    assert(strstr(output, "two") != NULL);
+    assert(strstr(output, "[1]") != NULL);
+    printf("✓ Background pipelines completed and were waited for\n");
+}
+
+// Test: Background jobs run concurrently, not one after another
+TEST(test_background_jobs_overlap) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing that background jobs overlap in time...\n");
+
+    double start = now_seconds();
+    char* output = run_shell_session("sleep 1 & sleep 1 & sleep 1 & wait\\nexit\\n", 10);
+    double elapsed = now_seconds() - start;
+
+    assert(output != NULL);
+    assert(elapsed < 2.5);
+    printf("✓ Three 1s jobs finished in %.2f seconds\n", elapsed);
+}
+
+// Test: 'jobs' lists running jobs and 'wait %N' targets one of them
+TEST(test_job_table) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing the job table...\n");
+
+    char* output = run_shell_session("sleep 1 &\\njobs\\nwait %%1\\njobs\\nwait %%7\\nexit\\n", 10);
+
+    assert(strstr(output, "Running") != NULL);
+    assert(strstr(output, "sleep 1") != NULL);
+    assert(strstr(output, "no such job") != NULL);
+
+    // Only live processes are listed, never the -1 of an absent sink
+    char* pids = strstr(output, "[pids: ");
+    assert(pids != NULL);
+    assert(memchr(pids, '-', strcspn(pids, "]")) == NULL);
+
+    // A full table rejects the job instead of running it in the foreground
+    output = run_capture_jobs("cd ../../src/ej2 && (for i in $(seq 64); do echo 'sleep 1 &'; done;"
+                              " echo 'echo overflow ran &'; echo wait; echo exit)"
+                              " | SHELL_TEST_MODE=1 timeout 10 ./shell 2>&1");
+    assert(strstr(output, "[64]") != NULL);
+    assert(strstr(output, "Job table full (maximum 64 jobs)") != NULL);
+    assert(strstr(output, "overflow ran") == NULL);
+    printf("✓ Job table lists and waits for jobs\n");
+}
+
+// Test: Finished jobs are reported at the next prompt
+TEST(test_job_completion_notice) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing asynchronous job completion notices...\n");
+
+    char* output = run_shell_session("sleep 0.2 &\\nsleep 0.5\\necho next\\nexit\\n", 10);
+
+    assert(strstr(output, "Done") != NULL);
+    printf("✓ Completed background job was reported\n");
+}
+
+// Helper to run one command line through the shell (non-interactive mode)
+char* run_shell_line(const char* cmd, int timeout_sec) {
+    static char output[8192];
+    memset(output, 0, sizeof(output));
+
+    char full_cmd[2048];
+    snprintf(full_cmd, sizeof(full_cmd),
+        "cd ../../src/ej2 && echo '%s' | timeout %d ./shell 2>&1", cmd, timeout_sec);
+
+    FILE* fp = popen(full_cmd, "r");
+    if (!fp) return output;
+
+    char line[512];
+    while (fgets(line, sizeof(line), fp)) {
+        if (strlen(output) + strlen(line) < sizeof(output) - 1) {
+            strcat(output, line);
+        }
+    }
+    pclose(fp);
+
+    return output;
+}
+
+// Test: fanout keeps input order with -k even when later items finish first
+TEST(test_fanout_ordered) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing ordered parallel fan-out...\n");
+
+    char* output = run_shell_line(
+        "seq 3 -1 1 | fanout -P 3 -k sh -c \"sleep 0.{}; echo item{}\"", 10);
+
+    char* first = strstr(output, "item3");
+    char* second = strstr(output, "item2");
+    char* third = strstr(output, "item1");
+    assert(first && second && third);
+    assert(first < second && second < third);
+    assert(strstr(output, "3 jobs, 0 failed") != NULL);
+
+    // A -P beyond the process limit is clamped; one that is not positive is refused
+    output = run_shell_line("seq 1 3 | fanout -P 2000000 -k echo item", 10);
+    assert(strstr(output, "item 1\nitem 2\nitem 3\n") != NULL);
+    assert(strstr(output, "3 jobs, 0 failed") != NULL);
+    output = run_shell_line("seq 1 3 | fanout -P 0 echo item", 10);
+    assert(strstr(output, "fanout: -P needs a positive number, got '0'") != NULL);
+    assert(strstr(output, "item 1") == NULL);
+    output = run_shell_line("seq 1 3 | fanout -P 2x echo item", 10);
+    assert(strstr(output, "fanout: -P needs a positive number, got '2x'") != NULL);
+    assert(strstr(output, "item 1") == NULL);
+    printf("✓ Output kept in input order\n");
+}
+
+// Test: fanout runs items concurrently and reports failures per job
+TEST(test_fanout_parallel_summary) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing fan-out concurrency and exit status summary...\n");
+
+    double start = now_seconds();
+    char* output = run_shell_line("yes 1 | head -4 | fanout -P 4 sleep", 10);
+    double elapsed = now_seconds() - start;
+    assert(strstr(output, "4 jobs, 0 failed") != NULL);
+    assert(elapsed < 2.5);
+
+    output = run_shell_line("seq 1 2 | fanout -P 2 ls /nonexistent_dir_{}", 10);
+    assert(strstr(output, "exit 2") != NULL);
+    assert(strstr(output, "2 jobs, 2 failed") != NULL);
+    printf("✓ Four 1s jobs took %.2f seconds, failures reported\n", elapsed);
+}
+
+// Test: 'limit' installs rlimits per stage and reports job usage from its cgroup
+TEST(test_resource_limits) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing per-stage rlimits and per-job cgroups...\n");
+
+    // A CPU-bound stage is stopped by RLIMIT_CPU instead of running forever
+    double start = now_seconds();
+    char* output = run_shell_line("limit -t 1 sh -c \"while :; do :; done\"; echo after", 10);
+    double elapsed = now_seconds() - start;
+    assert(elapsed < 5.0);
+
+    // RLIMIT_NOFILE only applies to the limited stage
+    output = run_shell_line("limit -n 3 ls / | wc -l", 10);
+    assert(strstr(output, "Too many open files") != NULL || strstr(output, "Error 24") != NULL);
+    output = run_shell_line("ls / | limit -n 64 wc -l", 10);
+    assert(strstr(output, "Too many") == NULL && strstr(output, "Error 24") == NULL);
+
+    // Background jobs keep their cgroup until they are collected
+    output = run_shell_session("limit -m 64M sleep 0.2 &\nwait\nexit\n", 10);
+    if (strstr(output, "no writable cgroup") == NULL) {
+        assert(strstr(output, "limit: limit -m 64M sleep 0.2: cpu") != NULL);
+    }
+
+    // A directory without cgroup counters reports none instead of -1 values
+    output = run_capture_jobs("rm -rf /tmp/ej2_fake_cgroup && mkdir /tmp/ej2_fake_cgroup && cd ../../src/ej2"
+                              " && printf 'limit -m 64M true &\\nwait\\nexit\\n'"
+                              " | SHELL_CGROUP=/tmp/ej2_fake_cgroup SHELL_TEST_MODE=1 timeout 10 ./shell 2>&1;"
+                              " rm -rf /tmp/ej2_fake_cgroup");
+    assert(strstr(output, "limit: limit -m 64M true: no usage statistics available") != NULL);
+    assert(strstr(output, "-0.000") == NULL && strstr(output, "-1 OOM") == NULL);
+
+    output = run_shell_line("limit -x 1 true", 10);
+    assert(strstr(output, "invalid option") != NULL);
+    printf("✓ CPU-bound stage stopped after %.2fs, usage reported\n", elapsed);
+}
+
+// Test: 'sched' applies affinity, nice, class and I/O priority; 'pin' keeps data intact
+TEST(test_stage_scheduling) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing per-stage CPU placement and scheduling classes...\n");
+
+    char* output = run_shell_session(
+        "sched -C 0 grep Cpus_allowed_list /proc/self/status\nsched -n 5 nice\n"
+        "seq 1 3 | sched -i grep policy /proc/self/sched\nsched -I idle ionice\n"
+        "sched -b sched -n 2 nice\nsched -n 40 true\nexit\n", 10);
+    assert(strstr(output, "Cpus_allowed_list:\t0\n") != NULL);
+    assert(strstr(output, "5\n") != NULL);
+    assert(strstr(output, ": 5") != NULL || strstr(output, ":                    5") != NULL);
+    assert(strstr(output, "idle") != NULL);
+    assert(strstr(output, "2\n") != NULL);
+    assert(strstr(output, "invalid option '-n 40'") != NULL);
+
+    // Automatic placement only changes where stages run, not what they compute
+    output = run_shell_line("pin seq 1 200000 | cat | wc -l", 10);
+    assert(strstr(output, "200000") != NULL);
+
+    // A single pinned command runs on exactly one CPU
+    output = run_shell_line("pin grep Cpus_allowed_list /proc/self/status", 10);
+    char* cpus = strstr(output, "Cpus_allowed_list:\t");
+    assert(cpus != NULL);
+    cpus += strlen("Cpus_allowed_list:\t");
+    assert(strcspn(cpus, ",-\n") == strcspn(cpus, "\n"));
+    printf("✓ Stage attributes applied in the child before exec\n");
+}
+
+// Test: Background stages are reaped as they finish, even during a foreground command
+TEST(test_event_loop_reaping) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing event-loop reaping in completion order...\n");
+
+    // Job 2 finishes first; both are collected while 'sleep 1' still runs
+    char* output = run_shell_session("sleep 0.4 &\nsleep 0.1 &\nsleep 1\nexit\n", 10);
+    double first = 0, second = 0;
+    char* done2 = strstr(output, "[2]  Done (0)\t");
+    char* done1 = strstr(output, "[1]  Done (0)\t");
+    assert(done1 && done2);
+    assert(sscanf(done1, "[1]  Done (0)\t%lfs", &first) == 1);
+    assert(sscanf(done2, "[2]  Done (0)\t%lfs", &second) == 1);
+    assert(first < 0.8 && second < 0.5);
+
+    // SIGINT at the prompt is handled at once, not after the next input line
+    double start = now_seconds();
+    output = run_capture_jobs(
+        "cd ../../src/ej2 && bash -c 'SHELL_TEST_MODE=1 ./shell < <(sleep 5) 2>&1 & sleep 0.3;"
+        " kill -INT $!; wait'");
+    double elapsed = now_seconds() - start;
+    assert(strstr(output, "Shell shutting down") != NULL);
+    assert(elapsed < 4.0);
+
+    // A refilled pool helper must not keep a finished job's pidfd in the
+    // epoll set: the shell would spin while it waits
+    output = run_capture_jobs(
+        "cd ../../src/ej2 && bash -c '(printf \"sleep 0.3 &\\n\"; sleep 1.2) |"
+        " SHELL_POOL=2 SHELL_TEST_MODE=1 ./shell > /dev/null & sleep 1;"
+        " awk \"{ print \\$14 + \\$15 }\" /proc/$!/stat; wait'");
+    int ticks = atoi(output);
+    assert(ticks < 20);
+    printf("✓ Jobs collected after %.2fs / %.2fs, SIGINT handled in %.2fs\n", second, first, elapsed);
+}
+
+// Test: A coprocess stays warm across requests and answers in order
+TEST(test_coprocess) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing coprocesses over a bidirectional socketpair...\n");
+
+    char* output = run_shell_session(
+        "coproc -n up sed -u s/^/up:/\ncoproc -q up 12\ncoproc -w up 3\ncoproc -w up 4\n"
+        "coproc -r up 2\nseq 5 7 | coproc -w up\ncoproc -r up 3 | sort -r\ncoproc\n"
+        "coproc -n up cat\ncoproc -c up\nwait\ncoproc -q nosuch 1\ncoproc -n mute cat\ncoproc -w mute\n"
+        "coproc -t 0.3 -r mute\necho still reading\nexit\n", 10);
+    assert(strstr(output, "up:12\n") != NULL);
+    assert(strstr(output, "up:3\nup:4\n") != NULL);
+    // The pipeline stage read exactly three answers, nothing more
+    assert(strstr(output, "up:7\nup:6\nup:5\n") != NULL);
+    assert(strstr(output, "up\t") != NULL && strstr(output, "Running\tcoproc -n up sed") != NULL);
+    assert(strstr(output, "already running") != NULL);
+    assert(strstr(output, "no such coprocess") != NULL);
+    // A bare -w does not swallow the shell's input, a silent coprocess times out
+    assert(strstr(output, "coproc: -w: no text") != NULL);
+    assert(strstr(output, "coproc: mute: no answer within 300 ms") != NULL);
+    assert(strstr(output, "still reading") != NULL);
+
+    // 2000 requests to one warm process instead of 2000 process starts
+    double start = now_seconds();
+    output = run_capture_jobs(
+        "cd ../../src/ej2 && (echo \"coproc sed -u s/^/re:/\"; seq -f \"coproc -q COPROC %g\" 1 2000)"
+        " > coproc_test.sh && timeout 10 ./shell coproc_test.sh | tail -1; rm -f coproc_test.sh");
+    double elapsed = now_seconds() - start;
+    assert(strstr(output, "re:2000") != NULL);
+    printf("✓ 2000 round trips through one coprocess in %.3fs\n", elapsed);
+}
+
+int main() {
+    printf(" JOB CONTROL & CONCURRENCY TESTING SUITE\n");
+    printf("==========================================\n");
+
+    RUN_TEST(test_background_and_wait);
+    RUN_TEST(test_background_jobs_overlap);
+    RUN_TEST(test_job_table);
+    RUN_TEST(test_job_completion_notice);
+    RUN_TEST(test_fanout_ordered);
+    RUN_TEST(test_fanout_parallel_summary);
+    RUN_TEST(test_resource_limits);
+    RUN_TEST(test_stage_scheduling);
+    RUN_TEST(test_event_loop_reaping);
+    RUN_TEST(test_coprocess);
+
+    printf("\n JOB CONTROL TESTING COMPLETE!\n");
+    printf("================================\n");
+    printf("  Background pipelines\n");
+    printf("  Job table and wait\n");
+    printf("  Asynchronous completion reporting\n");
+    printf("  Parallel fan-out built-in\n");
+    printf("  Resource limits and job cgroups\n");
+    printf("  Per-stage CPU placement and scheduling\n");
+    printf("  Event-loop reaping and signal handling\n");
+    printf("  Coprocesses\n");
+
+    return 0;
+}
@@ -0,0 +1,471 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <assert.h>
+#include <signal.h>
+#include <time.h>
+
+// PERFORMANCE INFRASTRUCTURE TESTING FRAMEWORK
+// Tests allocation behaviour, parsing limits and measurement features
+
+#define RUN_TEST(test_func) do { \
+    printf(" Running performance test: %s\n", #test_func); \
+    test_func(); \
+    printf(" %s passed\n", #test_func); \
+} while(0)
+
+#define TEST(name) void name()
+
+// Helper to run a shell command line through bash and capture all output
+char* run_capture(const char* full_cmd) {
+    static char output[16384];
+    memset(output, 0, sizeof(output));
+
+    FILE* fp = popen(full_cmd, "r");
+    if (!fp) return output;
+
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)) {
+        if (strlen(output) + strlen(line) < sizeof(output) - 1) {
+            strcat(output, line);
+        }
+    }
+    pclose(fp);
+
+    return output;
+}
+
+// Test: The per-line arena stops calling malloc once it has warmed up
+TEST(test_arena_no_malloc_churn) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing per-line arena allocation behaviour...\n");
+
+    char* output = run_capture(
+        "cd ../../src/ej2 && for i in $(seq 1 50); do echo \"echo line $i | cat | wc -c\"; done"
+        " | SHELL_TEST_MODE=1 SHELL_DEBUG=1 ./shell 2>&1 | grep '^Arena:'");
+
+    // Every line reports its allocations; the malloc total must stay flat
+    char* first = strstr(output, "Arena:");
+    char* last = first;
+    for (char* p = first; p; p = strstr(p + 1, "Arena:")) last = p;
+    assert(first != NULL);
+
+    unsigned long allocs, first_mallocs, last_mallocs;
+    size_t bytes, capacity;
+    assert(sscanf(first, "Arena: %lu allocations, %zu bytes, %lu mallocs total, %zu bytes capacity",
+                  &allocs, &bytes, &first_mallocs, &capacity) == 4);
+    assert(allocs > 0);
+    assert(sscanf(last, "Arena: %lu allocations, %zu bytes, %lu mallocs total, %zu bytes capacity",
+                  &allocs, &bytes, &last_mallocs, &capacity) == 4);
+    assert(first_mallocs == last_mallocs);
+    printf("✓ 50 lines served by %lu arena malloc(s)\n", last_mallocs);
+}
+
+// Test: The single-pass lexer handles long words (vector path) and quote spans
+TEST(test_lexer_long_words_and_quotes) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing single-pass lexer on long words and quote spans...\n");
+
+    // 44 + 1 + 4 and 53 bytes: long enough for 16/32-byte scanning steps
+    char* output = run_capture(
+        "cd ../../src/ej2 && echo 'echo \"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa|bbbb\" "
+        "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx|wc -c' | ./shell 2>&1");
+    assert(strstr(output, "104") != NULL);
+
+    // Adjacent quoted and unquoted parts form a single word
+    output = run_capture("cd ../../src/ej2 && echo 'echo a\"b c\"d | cat' | ./shell 2>&1");
+    assert(strstr(output, "ab cd") != NULL);
+
+    output = run_capture("cd ../../src/ej2 && echo 'echo \"unclosed | cat' | ./shell 2>&1");
+    assert(strstr(output, "Unclosed quotes") != NULL);
+    printf("✓ Lexer output matches expected argument splitting\n");
+}
+
+// Test: No fixed ceiling on arguments or pipeline stages
+TEST(test_dynamic_limits) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing commands far beyond the old MAX_ARGS / MAX_COMMANDS limits...\n");
+
+    // 20000 arguments in a single command (old limit: 64)
+    char* output = run_capture(
+        "cd ../../src/ej2 && echo \"echo $(seq 1 20000 | tr '\\n' ' ') | wc -w\" | ./shell 2>&1");
+    assert(strstr(output, "20000") != NULL);
+
+    // 1000-stage pipeline (old limit: 200)
+    output = run_capture(
+        "cd ../../src/ej2 && (printf 'echo deep'; for i in $(seq 1 1000); do printf ' | cat'; done; echo)"
+        " | ./shell 2>&1");
+    assert(strstr(output, "deep") != NULL);
+    printf("✓ Handled 20000 arguments and a 1000-stage pipeline\n");
+}
+
+// Test: Commands launched through the pre-forked helper pool behave normally
+TEST(test_prefork_pool) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing the pre-forked launch helper pool...\n");
+
+    char* output = run_capture(
+        "cd ../../src/ej2 && printf 'echo pooled\\necho a b | tr a-z A-Z\\nnosuchcmd_xyz\\npool\\n'"
+        " | SHELL_POOL=2 SHELL_TEST_MODE=1 ./shell 2>&1");
+
+    assert(strstr(output, "pooled") != NULL);
+    assert(strstr(output, "A B") != NULL);
+    assert(strstr(output, "Error executing 'nosuchcmd_xyz'") != NULL);
+
+    unsigned long launches = 0;
+    char* stats = strstr(output, "pool: 2 helpers");
+    assert(stats != NULL);
+    assert(sscanf(stats, "pool: 2 helpers, %*d idle, %lu launches", &launches) == 1);
+    assert(launches >= 3);
+
+    // Idle helpers hold only stdio and their control socket: no pidfds of
+    // earlier jobs, no other helpers' sockets, no memo store
+    output = run_capture(
+        "cd ../../src/ej2 && bash -c '(printf \"memo true\\nsleep 0.6 &\\ntrue\\n\"; sleep 1) |"
+        " SHELL_POOL=2 SHELL_MEMO_FILE=/tmp/ej2_pool_memo SHELL_TEST_MODE=1 ./shell > /dev/null &"
+        " sleep 0.5; for c in $(pgrep -P $! -x shell); do ls /proc/$c/fd | wc -l; done; wait';"
+        " rm -f /tmp/ej2_pool_memo");
+    assert(strlen(output) >= 4);
+    for (char* line = output; *line; line = strchr(line, '\n') + 1) {
+        assert(atoi(line) == 4);
+    }
+    printf("✓ %lu commands launched through helpers\n", launches);
+}
+
+// Test: 'time' reports wait4 accounting per pipeline stage, as text or JSON
+TEST(test_time_pipeline) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing per-stage resource accounting with time...\n");
+
+    char* output = run_capture(
+        "cd ../../src/ej2 && echo 'time sleep 0.2 | cat' | ./shell 2>&1");
+    assert(strstr(output, "time: [0] sleep 0.2") != NULL);
+    assert(strstr(output, "time: [1] cat") != NULL);
+
+    double real = 0;
+    char* total = strstr(output, "time: total");
+    assert(total != NULL);
+    assert(sscanf(strstr(total, "real"), "real %lfs", &real) == 1);
+    assert(real >= 0.2 && real < 2.0);
+
+    output = run_capture(
+        "cd ../../src/ej2 && echo 'time -j echo hi | wc -c' | ./shell 2>&1");
+    assert(strstr(output, "{\"stages\":[{\"command\":\"echo hi\"") != NULL);
+    assert(strstr(output, "\"maxrss_kb\":") != NULL);
+    assert(strstr(output, "\"total\":{") != NULL);
+
+    // The report starts at the command's own token; process substitutions
+    // still reach the command once the prefix is stripped
+    output = run_capture(
+        "cd ../../src/ej2 && echo 'time \"timeout\" 5 wc -c <(echo hi)' | ./shell 2>&1");
+    assert(strstr(output, "3 /dev/fd/") != NULL);
+    assert(strstr(output, "time: [0] \"timeout\" 5 wc -c <(echo hi)") != NULL);
+
+    // A timed background job is reported once it completes
+    output = run_capture(
+        "cd ../../src/ej2 && printf '%s\\n' 'time sleep 0.2 | cat &' 'wait' 'echo after'"
+        " | SHELL_TEST_MODE=1 ./shell 2>&1");
+    char* bg_total = strstr(output, "time: total");
+    assert(strstr(output, "time: [0] sleep 0.2") != NULL && strstr(output, "time: [1] cat") != NULL);
+    assert(bg_total && strstr(bg_total, "after") != NULL);
+    double bg_real = 0;
+    assert(sscanf(strstr(bg_total, "real"), "real %lfs", &bg_real) == 1);
+    assert(bg_real >= 0.2 && bg_real < 2.0);
+    printf("✓ Pipeline took %.3fs with per-stage rusage\n", real);
+}
+
+// Test: 'profile' relays every pipe and reports bytes and full/empty time
+TEST(test_pipe_profiler) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing the pipeline throughput profiler...\n");
+
+    // 'seq 1 100000' writes 588895 bytes; output must pass through unchanged
+    char* output = run_capture(
+        "cd ../../src/ej2 && echo 'profile seq 1 100000 | cat | wc -c' | ./shell 2>&1");
+    assert(strstr(output, "588895") != NULL);
+
+    unsigned long long bytes = 0;
+    char* pipe0 = strstr(output, "profile: pipe 0 seq 1 100000 -> cat:");
+    assert(pipe0 != NULL);
+    assert(sscanf(pipe0, "profile: pipe 0 seq 1 100000 -> cat: %llu bytes", &bytes) == 1);
+    assert(bytes == 588895);
+    assert(strstr(output, "profile: pipe 1 cat -> wc -c: 588895 bytes") != NULL);
+    assert(strstr(output, "profile: bottleneck: stage") != NULL);
+
+    // A consumer that exits early ends the relay instead of hanging the shell
+    output = run_capture(
+        "cd ../../src/ej2 && echo 'profile yes | head -3' | timeout 10 ./shell 2>&1");
+    assert(strstr(output, "y\ny\ny\n") != NULL);
+    assert(strstr(output, "profile: pipe 0 yes -> head -3") != NULL);
+    printf("✓ %llu bytes accounted on the first pipe\n", bytes);
+}
+
+// Wall clock helper in seconds
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Test: Producers left without a consumer are torn down after a grace period
+TEST(test_pipeline_teardown) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing early teardown of orphaned pipeline producers...\n");
+
+    // A producer that never writes would otherwise keep the pipeline alive
+    double start = now_seconds();
+    run_capture("cd ../../src/ej2 && echo 'sleep 5 | true' | ./shell > /dev/null 2>&1");
+    double elapsed = now_seconds() - start;
+    assert(elapsed < 2.0);
+
+    // SIGTERM is ignored here, so teardown has to escalate to SIGKILL
+    start = now_seconds();
+    char* output = run_capture(
+        "cd ../../src/ej2 && printf '%s\\n' 'perl -e \"%SIG = (TERM => q(IGNORE)); sleep 5\" | true'"
+        " | SHELL_DEBUG=1 ./shell 2>&1");
+    double escalated = now_seconds() - start;
+    assert(strstr(output, "Teardown: SIGTERM to stage 0") != NULL);
+    assert(strstr(output, "Teardown: SIGKILL to stage 0") != NULL);
+    assert(escalated < 2.0);
+
+    // Background jobs get the same teardown, also while 'wait' blocks on them
+    start = now_seconds();
+    output = run_capture(
+        "cd ../../src/ej2 && printf '%s\\n' 'perl -e \"%SIG = (TERM => q(IGNORE)); sleep 5\" | true &'"
+        " 'wait' 'echo waited' | SHELL_DEBUG=1 SHELL_TEST_MODE=1 ./shell 2>&1");
+    double background = now_seconds() - start;
+    char* waited = strstr(output, "Teardown: SIGKILL to stage 0");
+    assert(waited && strstr(waited, "waited") != NULL);
+    assert(background < 2.0);
+
+    // A negative grace period restores plain waiting
+    start = now_seconds();
+    run_capture("cd ../../src/ej2 && echo 'sleep 1 | true' | SHELL_PIPE_GRACE_MS=-1 ./shell > /dev/null 2>&1");
+    assert(now_seconds() - start >= 1.0);
+    printf("✓ Orphaned producers stopped after %.2fs / %.2fs, in the background after %.2fs\n",
+           elapsed, escalated, background);
+}
+
+// Test: 'memo' serves repeated pure commands from the cache, also across sessions
+TEST(test_memo_cache) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing the command result cache...\n");
+
+    // The second run is a hit: same nanoseconds, same exit status, no fork
+    char* output = run_capture(
+        "cd ../../src/ej2 && rm -f memo_test.db"
+        " && printf 'memo date +%%N\\nmemo date +%%N\\nmemo sh -c \"exit 3\"\\nmemo sh -c \"exit 3\"\\nmemo\\n'"
+        " | SHELL_MEMO_FILE=memo_test.db SHELL_TEST_MODE=1 ./shell 2>&1");
+    char first[32] = "", second[32] = "";
+    char* p = strstr(output, "Shell> ");
+    assert(p && sscanf(p, "Shell> %31s", first) == 1);
+    p = strstr(p + 1, "Shell> ");
+    assert(p && sscanf(p, "Shell> %31s", second) == 1);
+    assert(strcmp(first, second) == 0);
+    assert(strstr(output, "memo: 2 hits, 2 misses, 2 entries") != NULL);
+
+    // A new shell maps the on-disk store and serves the same result
+    output = run_capture(
+        "cd ../../src/ej2 && printf 'memo date +%%N\\n' | SHELL_MEMO_FILE=memo_test.db ./shell 2>&1");
+    assert(strncmp(output, first, strlen(first)) == 0);
+
+    // Clearing the store from another shell leaves existing mappings valid
+    output = run_capture(
+        "cd ../../src/ej2 || exit; (printf 'memo date +%%N\\n'; sleep 0.5; printf 'memo date +%%N\\n')"
+        " | SHELL_MEMO_FILE=memo_test.db SHELL_TEST_MODE=1 ./shell 2>&1 & sleep 0.2;"
+        " printf 'memo -c\\n' | SHELL_MEMO_FILE=memo_test.db ./shell; wait;"
+        " printf 'memo date +%%N\\nmemo\\n' | SHELL_MEMO_FILE=memo_test.db SHELL_TEST_MODE=1 ./shell 2>&1;"
+        " rm -f memo_test.db");
+    p = strstr(output, first);
+    assert(p && strstr(p + 1, first) != NULL);
+    assert(strstr(output, "memo: 0 hits, 1 misses") != NULL);
+
+    // Expired entries are recomputed
+    output = run_capture(
+        "cd ../../src/ej2 && printf 'memo date +%%N\\nsleep 1.1\\nmemo date +%%N\\nmemo\\n'"
+        " | SHELL_MEMO_TTL=0 SHELL_TEST_MODE=1 ./shell 2>&1");
+    assert(strstr(output, "memo: 0 hits, 2 misses") != NULL);
+    printf("✓ Cached result %s reused in and across sessions\n", first);
+}
+
+// Test: History is appended to a file, mapped lazily and searched through its indexes
+TEST(test_history_search) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing persistent history with prefix and substring search...\n");
+
+    // 300000 entries, 100000 distinct commands
+    system("cd ../../src/ej2 && rm -f hist_test.txt"
+           " && seq 1 300000 | awk '{ print \"cmd\" ($1 % 100000) \" --flag\" }' > hist_test.txt");
+
+    // A huge history file costs nothing until it is searched
+    double start = now_seconds();
+    char* output = run_capture(
+        "cd ../../src/ej2 && printf 'echo started\\n' | SHELL_HISTORY_FILE=hist_test.txt SHELL_TEST_MODE=1 ./shell 2>&1");
+    double startup = now_seconds() - start;
+    assert(strstr(output, "started") != NULL);
+
+    // Each distinct command once, at its latest position; lines from this session included
+    start = now_seconds();
+    output = run_capture(
+        "cd ../../src/ej2 && printf 'history -p cmd4242\\nhistory -s 777 --fl\\necho zz_new\\n"
+        "history -s zz_n\\nhistory 2\\n' | SHELL_HISTORY_FILE=hist_test.txt SHELL_TEST_MODE=1 ./shell 2>&1");
+    double search = now_seconds() - start;
+    assert(strstr(output, "204242  cmd4242 --flag\n") != NULL);
+    assert(strstr(output, "104242  cmd4242") == NULL);
+    assert(strstr(output, "  cmd42420 --flag\n") != NULL);
+    assert(strstr(output, "277777  cmd77777 --flag\n") != NULL);
+    assert(strstr(output, "  cmd777 --flag") != NULL);
+    assert(strstr(output, "cmd7770 --flag") == NULL);
+    assert(strstr(output, "300004  echo zz_new\n") != NULL);
+    assert(strstr(output, "300006  history 2\n") != NULL);
+
+    // The next session sees the appended lines; -c empties the file
+    output = run_capture(
+        "cd ../../src/ej2 && printf 'history -p echo z\\nhistory -c\\nhistory\\n'"
+        " | SHELL_HISTORY_FILE=hist_test.txt SHELL_TEST_MODE=1 ./shell 2>&1;"
+        " rm -f hist_test.txt");
+    assert(strstr(output, "300004  echo zz_new\n") != NULL);
+    assert(strstr(output, "    1  history\n") != NULL);
+
+    // Clearing it from another shell leaves the mapping of a running one valid
+    output = run_capture(
+        "cd ../../src/ej2 || exit; seq 1 1000 | sed 's/^/cmd/' > hist_test.txt;"
+        " (printf 'history -p cmd42\\n'; sleep 0.5; printf 'history -s md999\\n')"
+        " | SHELL_HISTORY_FILE=hist_test.txt SHELL_TEST_MODE=1 ./shell 2>&1 & sleep 0.2;"
+        " printf 'history -c\\n' | SHELL_HISTORY_FILE=hist_test.txt SHELL_TEST_MODE=1 ./shell > /dev/null; wait; rm -f hist_test.txt");
+    assert(strstr(output, "  999  cmd999\n") != NULL);
+    assert(startup < 0.5);
+    printf("✓ Started in %.3fs, indexed and searched 300000 entries in %.3fs\n", startup, search);
+}
+
+// Test: Tab completion from the background PATH index stays under a millisecond
+TEST(test_line_editor_completion) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing the line editor and PATH completion...\n");
+
+    // 30000 executables on PATH; the editor reads keystrokes from a pipe
+    system("rm -rf /tmp/ej2_complete_bin && mkdir /tmp/ej2_complete_bin && cd /tmp/ej2_complete_bin"
+           " && seq -f 'zzbin%g' 1 30000 | xargs touch && chmod +x zzbin*"
+           " && printf '#!/bin/sh\\necho unique tool ran\\n' > zzonly && chmod +x zzonly"
+           " && rm -rf /tmp/ej2_complete_bin2 && mkdir /tmp/ej2_complete_bin2"
+           " && printf '#!/bin/sh\\necho exported tool ran\\n' > /tmp/ej2_complete_bin2/zzexported"
+           " && chmod +x /tmp/ej2_complete_bin2/zzexported");
+    char* output = run_capture(
+        "cd ../../src/ej2 && (sleep 0.5; printf 'zzon\\t\\nzzbin1234\\t\\t\\ncat Makef\\t| head -1\\n';"
+        " printf 'cp /tmp/ej2_complete_bin/zzonly /tmp/ej2_complete_bin/zzlater\\n'; sleep 0.5;"
+        " printf 'zzlat\\t\\n'; sleep 0.3; printf 'export PATH=/tmp/ej2_complete_bin2:$PATH\\n';"
+        " sleep 0.3; printf 'zzexp\\t\\n';"
+        " printf 'true;zzon\\t\\ntrue && zzon\\t\\nfalse || zzon\\t\\necho x | zzon\\t\\ntrue & zzon\\t\\n(zzon\\t\\n')"
+        " | PATH=/tmp/ej2_complete_bin:$PATH SHELL_LINE_EDITOR=1 SHELL_DEBUG=1"
+        " SHELL_TEST_MODE=1 timeout 10 ./shell 2>&1 | tr '\\r' '\\n';"
+        " rm -rf /tmp/ej2_complete_bin /tmp/ej2_complete_bin2");
+
+    // A unique command is completed and run; an ambiguous one lists candidates
+    assert(strstr(output, "unique tool ran") != NULL);
+    assert(strstr(output, "zzbin12345  zzbin12346") != NULL);
+    assert(strstr(output, "CC = gcc") != NULL);
+
+    // A binary added after startup is found through inotify
+    char* later = strstr(output, "zzlater");
+    assert(later && strstr(later, "unique tool ran") != NULL);
+
+    // 'export PATH=' moves the index to the new directories
+    assert(strstr(output, "exported tool ran") != NULL);
+
+    // Every list operator starts a new command
+    assert(strstr(output, "true;zzonly ") != NULL);
+    assert(strstr(output, "true && zzonly ") != NULL);
+    assert(strstr(output, "false || zzonly ") != NULL);
+    assert(strstr(output, "echo x | zzonly ") != NULL);
+    assert(strstr(output, "true & zzonly ") != NULL);
+    assert(strstr(output, "(zzonly ") != NULL);
+
+    double worst = 0;
+    int lookups = 0;
+    for (char* p = strstr(output, "Completion: "); p; p = strstr(p + 1, "Completion: ")) {
+        unsigned long count;
+        double us;
+        assert(sscanf(p, "Completion: %lu candidates in %lf us", &count, &us) == 2);
+        if (us > worst) worst = us;
+        lookups++;
+    }
+    assert(lookups == 12);
+    assert(worst < 1000.0);
+    printf("✓ %d completions over 30000 binaries, slowest %.1f us\n", lookups, worst);
+}
+
+// Test: Startup profile phases, and a static build that spawns about as fast as 'true'
+TEST(test_startup_profile) {
+    system("cd ../../src/ej2 && make clean && make && make static");
+
+    printf("Testing the startup profile and the lean static build...\n");
+
+    char* output = run_capture("cd ../../src/ej2 && SHELL_STARTUP_PROFILE=1 ./shell < /dev/null 2>&1");
+    double total = 0;
+    char* report = strstr(output, "startup: ");
+    assert(report && sscanf(report, "startup: %lf us to first prompt", &total) == 1);
+    assert(strstr(output, "exec + dynamic linking") != NULL);
+    assert(strstr(output, "environment scan") != NULL);
+    assert(strstr(output, "signal setup") != NULL);
+    assert(strstr(output, "stdio setup") != NULL);
+
+    output = run_capture("cd ../../src/ej2 && echo 'echo static | tr a-z A-Z' | ./shell-static 2>&1");
+    assert(strstr(output, "STATIC") != NULL);
+
+    // 300 spawns each; the static shell stays close to a bare 'true'
+    double start = now_seconds();
+    system("cd ../../src/ej2 && for i in $(seq 300); do ./shell-static < /dev/null; done");
+    double shell_time = now_seconds() - start;
+    start = now_seconds();
+    system("for i in $(seq 300); do /bin/true < /dev/null; done");
+    double true_time = now_seconds() - start;
+    system("cd ../../src/ej2 && rm -f shell-static");
+    assert(shell_time < true_time * 2 + 0.2);
+    printf("✓ %.0f us to first prompt; 300 spawns: shell %.3fs, true %.3fs\n",
+           total, shell_time, true_time);
+}
+
+int main() {
+    printf(" PERFORMANCE INFRASTRUCTURE TESTING SUITE\n");
+    printf("===========================================\n");
+
+    RUN_TEST(test_arena_no_malloc_churn);
+    RUN_TEST(test_lexer_long_words_and_quotes);
+    RUN_TEST(test_dynamic_limits);
+    RUN_TEST(test_prefork_pool);
+    RUN_TEST(test_time_pipeline);
+    RUN_TEST(test_pipe_profiler);
+    RUN_TEST(test_pipeline_teardown);
+    RUN_TEST(test_memo_cache);
+    RUN_TEST(test_history_search);
+    RUN_TEST(test_line_editor_completion);
+    RUN_TEST(test_startup_profile);
+
+    printf("\n PERFORMANCE TESTING COMPLETE!\n");
+    printf("================================\n");
+    printf("  Per-line arena allocation\n");
+    printf("  Single-pass vectorized lexer\n");
+    printf("  Growable argument and stage vectors\n");
+    printf("  Pre-forked launch helper pool\n");
+    printf("  Per-stage time accounting\n");
+    printf("  Pipe throughput profiler\n");
+    printf("  Early pipeline teardown\n");
+    printf("  Command result cache\n");
+    printf("  Persistent indexed history\n");
+    printf("  Line editor with PATH completion\n");
+    printf("  Startup profile and static build\n");
+
+    return 0;
+}
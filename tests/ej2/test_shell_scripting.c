@@ -0,0 +1,417 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <assert.h>
+#include <signal.h>
+#include <time.h>
+
+// SCRIPTING FEATURES TESTING FRAMEWORK
+// Tests redirections and other shell language features
+
+#define RUN_TEST(test_func) do { \
+    printf(" Running scripting test: %s\n", #test_func); \
+    test_func(); \
+    printf(" %s passed\n", #test_func); \
+} while(0)
+
+#define TEST(name) void name()
+
+// Helper to run a shell command line through bash and capture all output
+char* run_capture(const char* full_cmd) {
+    static char output[16384];
+    memset(output, 0, sizeof(output));
+
+    FILE* fp = popen(full_cmd, "r");
+    if (!fp) return output;
+
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)) {
+        if (strlen(output) + strlen(line) < sizeof(output) - 1) {
+            strcat(output, line);
+        }
+    }
+    pclose(fp);
+
+    return output;
+}
+
+// Test: <, >, >> and 2> are wired straight into the stage descriptors
+TEST(test_redirections) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing file redirections...\n");
+
+    char* output = run_capture(
+        "cd ../../src/ej2 && rm -f redir_test.txt redir_err.txt"
+        " && printf 'seq 1 5 > redir_test.txt\\necho six >> redir_test.txt\\n"
+        "sort -rn < redir_test.txt | head -2\\nls /nonexistent_dir 2> redir_err.txt\\n'"
+        " | SHELL_TEST_MODE=1 ./shell 2>&1; cat redir_test.txt redir_err.txt");
+    assert(strstr(output, "5\n4\n") != NULL);
+    assert(strstr(output, "1\n2\n3\n4\n5\nsix\n") != NULL);
+    assert(strstr(output, "nonexistent_dir") != NULL);
+
+    // Quoted operators are plain text; missing files and targets are reported
+    output = run_capture(
+        "cd ../../src/ej2 && printf 'echo \"a>b\"\\ncat < /nonexistent_file | wc -l\\necho x >\\n'"
+        " | SHELL_TEST_MODE=1 ./shell 2>&1");
+    assert(strstr(output, "a>b") != NULL);
+    assert(strstr(output, "cannot open '/nonexistent_file'") != NULL);
+    assert(strstr(output, "Missing redirection target") != NULL);
+
+    system("cd ../../src/ej2 && rm -f redir_test.txt redir_err.txt");
+    printf("✓ Redirections behave like bash\n");
+}
+
+// Test: 'bulk' redirections (readahead hints, O_DIRECT writer) keep data intact
+TEST(test_bulk_redirections) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing bulk redirections...\n");
+
+    // 1988895 bytes: several aligned O_DIRECT chunks plus an unaligned tail
+    char* output = run_capture(
+        "cd ../../src/ej2 && rm -f bulk_test.txt"
+        " && printf 'bulk seq 1 300000 > bulk_test.txt\\nbulk seq 1 10 >> bulk_test.txt\\n"
+        "bulk wc -l < bulk_test.txt\\n' | SHELL_TEST_MODE=1 ./shell 2>&1;"
+        " (seq 1 300000; seq 1 10) | cmp - bulk_test.txt && echo BULK_SAME; rm -f bulk_test.txt");
+    assert(strstr(output, "300010") != NULL);
+    assert(strstr(output, "BULK_SAME") != NULL);
+    printf("✓ Bulk output identical to the buffered result\n");
+}
+
+// Test: The io_uring bulk writer and the read/write fallback produce the same file
+TEST(test_bulk_io_uring) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing the io_uring bulk writer against the read/write fallback...\n");
+
+    // 22888896 + 21 bytes: rotating registered buffers, '>>' after the end
+    char* output = run_capture(
+        "cd ../../src/ej2 && for u in 1 0; do rm -f uring_test.txt;"
+        " printf 'bulk seq 1 3000000 > uring_test.txt\\nbulk seq 1 10 >> uring_test.txt\\n'"
+        " | SHELL_IO_URING=$u SHELL_DEBUG=1 SHELL_TEST_MODE=1 ./shell 2>&1 | grep '^Bulk:';"
+        " (seq 1 3000000; seq 1 10) | cmp - uring_test.txt && echo SAME_$u; done; rm -f uring_test.txt");
+    assert(strstr(output, "SAME_1") != NULL);
+    assert(strstr(output, "SAME_0") != NULL);
+
+    // Where the kernel offers io_uring, the writer reports batched submissions
+    char* report = strstr(output, "Bulk: io_uring");
+    if (report) {
+        unsigned long long bytes = 0;
+        unsigned long enters = 0;
+        assert(sscanf(strchr(report, ',') + 2, "%llu bytes in %lu", &bytes, &enters) == 2);
+        assert(bytes == 22888896ULL);
+        printf("✓ %llu bytes written with %lu io_uring_enter calls\n", bytes, enters);
+    } else {
+        printf("✓ io_uring unavailable, read/write fallback used\n");
+    }
+    // The fallback never reports the io_uring engine
+    assert(strstr(strstr(output, "SAME_1"), "Bulk: io_uring") == NULL);
+
+    // Two concurrent '>>' writers: O_APPEND stays set, so neither overwrites the other
+    output = run_capture(
+        "cd ../../src/ej2 && rm -f append_test.txt;"
+        " (echo 'bulk seq 1 2000000 >> append_test.txt' | ./shell) &"
+        " (echo 'bulk seq 2000001 4000000 >> append_test.txt' | ./shell) & wait;"
+        " echo appended=$(wc -c < append_test.txt); rm -f append_test.txt");
+    assert(strstr(output, "appended=30888896\n") != NULL);
+    printf("✓ Concurrent bulk appends keep every byte\n");
+}
+
+// Wall clock helper in seconds
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Test: 'shell script' runs every line of a mapped script file
+TEST(test_script_file) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing script file execution...\n");
+
+    char* output = run_capture(
+        "cd ../../src/ej2 && printf '#!./shell\\n# comment\\necho first | tr a-z A-Z\\n\\n"
+        "echo \"open\\nseq 1 3 | wc -l\\necho last' > script_test.sh"
+        " && ./shell script_test.sh 2>&1; echo rc=$?; rm -f script_test.sh");
+    char* first = strstr(output, "FIRST");
+    char* count = strstr(output, "3\n");
+    char* last = strstr(output, "last");
+    assert(first && count && last && first < count && count < last);
+    assert(strstr(output, "script_test.sh: line 5: Error: Unclosed quotes") != NULL);
+    assert(strstr(output, "Shell>") == NULL);
+
+    output = run_capture("cd ../../src/ej2 && ./shell /nonexistent_script.sh 2>&1; echo rc=$?");
+    assert(strstr(output, "cannot open script") != NULL);
+    assert(strstr(output, "rc=1") != NULL);
+    printf("✓ Script lines ran in order without prompts\n");
+}
+
+// Test: Startup cost does not depend on script size (lines parsed lazily)
+TEST(test_script_lazy_parsing) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing lazy parsing of a large script...\n");
+
+    // ~60 MB script whose second line exits
+    system("cd ../../src/ej2 && (echo 'echo early'; echo exit;"
+           " yes 'echo never reached | cat | cat' | head -2000000) > big_script.sh");
+
+    double start = now_seconds();
+    char* output = run_capture("cd ../../src/ej2 && ./shell big_script.sh 2>&1");
+    double elapsed = now_seconds() - start;
+    system("cd ../../src/ej2 && rm -f big_script.sh");
+
+    assert(strstr(output, "early") != NULL);
+    assert(strstr(output, "never reached") == NULL);
+    assert(elapsed < 1.0);
+    printf("✓ Exited from a 60 MB script after %.3fs\n", elapsed);
+}
+
+// Test: >( ) fan-out through the zero-copy tee stage and <( ) fan-in
+TEST(test_pipeline_dag) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing fan-out / fan-in pipelines...\n");
+
+    // One producer, two analyzers and a main consumer see the same stream
+    char* output = run_capture(
+        "cd ../../src/ej2 && rm -f dag_count.txt dag_max.txt"
+        " && echo 'seq 1 100000 | tee >(wc -l > dag_count.txt) >(sort -rn | head -1 > dag_max.txt)"
+        " | tail -1' | ./shell 2>&1; cat dag_count.txt dag_max.txt; rm -f dag_count.txt dag_max.txt");
+    assert(strstr(output, "100000\n100000\n100000\n") != NULL);
+
+    // Byte-exact copies of a large stream on every edge
+    output = run_capture(
+        "cd ../../src/ej2 && echo 'yes | head -c 50000000 | tee >(md5sum) | md5sum' | ./shell 2>&1");
+    char* first = strstr(output, "  -");
+    assert(first != NULL);
+    assert(strncmp(output, first + 4, 32) == 0);
+
+    // Fan-in: producers merged into one consumer, generic /dev/fd arguments
+    output = run_capture(
+        "cd ../../src/ej2 && echo 'cat <(echo a) <(seq 1 3) | wc -l' | ./shell 2>&1;"
+        " echo 'paste <(seq 1 2) <(seq 3 4)' | ./shell 2>&1");
+    assert(strstr(output, "4\n") != NULL);
+    assert(strstr(output, "1\t3\n2\t4\n") != NULL);
+
+    // A branch that exits early does not stall the others
+    output = run_capture(
+        "cd ../../src/ej2 && echo 'seq 1 1000000 | tee >(head -1 > /dev/null) | wc -l' | timeout 10 ./shell 2>&1");
+    assert(strstr(output, "1000000") != NULL);
+
+    output = run_capture("cd ../../src/ej2 && echo 'cat <(echo x' | ./shell 2>&1");
+    assert(strstr(output, "Unclosed process substitution") != NULL);
+    printf("✓ Fan-out and fan-in edges carry identical data\n");
+}
+
+// Test: $( ) substitution, field splitting, nesting and the in-process fast path
+TEST(test_command_substitution) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing command substitution...\n");
+
+    system("cd ../../src/ej2 && echo from-file > subst_test.txt");
+    char* output = run_capture(
+        "cd ../../src/ej2 && printf '%s\\n'"
+        " 'echo a$(echo \" x  y \")b'"
+        " 'echo \"[$(echo \" x  y \")]\"'"
+        " 'echo n=$(seq 1 1000 | wc -l) $(seq 3 -1 1)'"
+        " 'echo \"$(seq 1 3)\" | wc -l'"
+        " 'echo $(echo $(echo nested) \"a)b\") end'"
+        " 'echo x $(true) y'"
+        " 'cat < $(echo subst_test.txt)'"
+        " 'echo $(echo x'"
+        " | SHELL_TEST_MODE=1 ./shell 2>&1; rm -f subst_test.txt");
+    assert(strstr(output, "a x y b\n") != NULL);
+    assert(strstr(output, "[ x  y ]\n") != NULL);
+    assert(strstr(output, "n=1000 3 2 1\n") != NULL);
+    assert(strstr(output, "3\n") != NULL);
+    assert(strstr(output, "nested a)b end\n") != NULL);
+    assert(strstr(output, "x y\n") != NULL);
+    assert(strstr(output, "from-file\n") != NULL);
+    assert(strstr(output, "Unclosed command substitution") != NULL);
+
+    // echo-like commands never fork; others are captured through a memfd
+    output = run_capture(
+        "cd ../../src/ej2 && echo 'true $(echo a) $(seq 1 2)' | SHELL_DEBUG=1 SHELL_TEST_MODE=1 ./shell 2>&1");
+    assert(strstr(output, "Subst: 'echo a' evaluated in-process") != NULL);
+    assert(strstr(output, "Subst: 'seq 1 2' captured") != NULL);
+    assert(strstr(output, "Subst: 'echo a' captured") == NULL);
+    printf("✓ Substituted output split into arguments like bash\n");
+}
+
+// Test: $VAR expansion, export, VAR=x cmd and lazy envp rebuilds
+TEST(test_variables) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing variables and the environment...\n");
+
+    char* output = run_capture(
+        "cd ../../src/ej2 && printf '%s\\n'"
+        " 'X=1'"
+        " 'echo x=$X \"[${X}]\" $X$X'"
+        " 'printenv X'"
+        " 'export X'"
+        " 'printenv X'"
+        " 'X=2 printenv X'"
+        " 'echo after=$X'"
+        " 'Z=\"p  q\"'"
+        " 'echo $Z | wc -w'"
+        " 'echo \"$Z\" end'"
+        " 'export W=$(echo sub value)'"
+        " 'printenv W'"
+        " 'PATH=/nonexistent ls'"
+        " 'echo ${X'"
+        " 'export 1x' > vars_test.sh && ./shell vars_test.sh 2>&1; rm -f vars_test.sh");
+    char* p = strstr(output, "x=1 [1] 11\n");
+    assert(p != NULL);
+    assert((p = strstr(p, "1\n2\nafter=1\n2\np  q end\nsub value\n")) != NULL);
+    assert(strstr(output, "Error executing 'ls'") != NULL);
+    assert(strstr(output, "Bad substitution") != NULL);
+    assert(strstr(output, "'1x': not a valid identifier") != NULL);
+
+    // Per-command assignments patch the child's envp: one rebuild, after 'export'
+    output = run_capture(
+        "cd ../../src/ej2 && printf '%s\\n' 'export X=1' 'X=2 printenv X' 'X=3 printenv X' 'printenv X'"
+        " > vars_test.sh && SHELL_DEBUG=1 ./shell vars_test.sh 2>&1; rm -f vars_test.sh");
+    p = strstr(output, "Env: envp rebuilt");
+    assert(p != NULL && strstr(p + 1, "Env: envp rebuilt") == NULL);
+    assert(strstr(p, "2\n") && strstr(p, "3\n") && strstr(p, "1\n"));
+    printf("✓ Variables expanded and exported like bash\n");
+}
+
+// Test: ';', '&&' and '||' lists with short-circuit evaluation
+TEST(test_command_lists) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing command lists...\n");
+
+    char* output = run_capture(
+        "cd ../../src/ej2 && printf '%s\\n'"
+        " 'true && echo and1; false && echo and2'"
+        " 'false || echo or1; true || echo or2'"
+        " 'false || echo a && echo b; true || echo c && echo d'"
+        " 'echo s1; echo s2 ;; echo s3;'"
+        " 'ls /nonexistent 2> /dev/null || echo status=$?'"
+        " 'seq 1 3 | grep -q 2 && echo found; seq 1 3 | grep -q 9 || echo notfound'"
+        " 'echo x=$(false || echo fallback; echo two)'"
+        " '&& echo bad'"
+        " 'echo bad ||'"
+        " 'echo last; exit; echo after' > list_test.sh && ./shell list_test.sh 2>&1; rm -f list_test.sh");
+    assert(strstr(output, "and1\nor1\na\nb\nd\ns1\ns2\ns3\nstatus=2\nfound\nnotfound\n"
+                          "x=fallback two\n") != NULL);
+    assert(strstr(output, "and2") == NULL && strstr(output, "or2") == NULL);
+    assert(strstr(output, "line 8: Error: Syntax error near '&&'") != NULL);
+    assert(strstr(output, "line 9: Error: Syntax error: missing command at end of line") != NULL);
+    assert(strstr(output, "\nbad\n") == NULL);
+    assert(strstr(output, "last\n") != NULL && strstr(output, "after") == NULL);
+    printf("✓ Lists short-circuit on the pipeline status\n");
+
+    output = run_capture(
+        "cd ../../src/ej2 && printf 'kill -9 $$\\n' > /tmp/ej2_killed.sh && printf '%s\\n'"
+        " 'yes | grep -q y && echo found'"
+        " 'seq 1 1000000 | head -1; echo head=$?'"
+        " 'sleep 5 | true && echo torn'"
+        " 'false | true && echo last_ok; true | false || echo last_failed'"
+        " 'sh /tmp/ej2_killed.sh && echo killed_ok; echo killed=$?' > status_test.sh"
+        " && ./shell status_test.sh 2>&1; rm -f status_test.sh /tmp/ej2_killed.sh");
+    assert(strstr(output, "found\n1\nhead=0\ntorn\nlast_ok\nlast_failed\nkilled=137\n") != NULL);
+    assert(strstr(output, "killed_ok") == NULL);
+    printf("✓ Pipelines report the last stage; signals report 128+N\n");
+
+    // A script exits with its last status or the argument of 'exit', cached or not
+    output = run_capture(
+        "cd ../../src/ej2 && rm -rf /tmp/ej2_rc_cache && echo false > rc_false.sh"
+        " && printf 'echo one\\nexit 7\\necho two\\n' > rc_exit.sh"
+        " && for run in 1 2; do for s in rc_false.sh rc_exit.sh; do"
+        " SHELL_SCRIPT_CACHE=/tmp/ej2_rc_cache ./shell $s; echo \"$s=$?\"; done; done;"
+        " ./shell rc_exit.sh | ./shell rc_false.sh; echo piped=$?;"
+        " echo 'exit abc' > rc_bad.sh && ./shell rc_bad.sh 2>&1; echo bad=$?;"
+        " rm -rf rc_false.sh rc_exit.sh rc_bad.sh /tmp/ej2_rc_cache");
+    assert(strstr(output, "rc_false.sh=1\none\nrc_exit.sh=7\nrc_false.sh=1\none\nrc_exit.sh=7\n") != NULL);
+    assert(strstr(output, "two") == NULL && strstr(output, "piped=1\n") != NULL);
+    assert(strstr(output, "exit: abc: numeric argument required\nbad=2\n") != NULL);
+    printf("✓ Scripts exit with their last status or 'exit N'\n");
+}
+
+TEST(test_script_cache) {
+    system("cd ../../src/ej2 && make clean && make");
+
+    printf("Testing the compiled script cache...\n");
+
+    const char* run = "PATH=/tmp/ej2_script_bin:$PATH SHELL_DEBUG=1 SHELL_SCRIPT_CACHE=/tmp/ej2_script_cache"
+                      " ./shell cache_test.sh 2>&1 | grep -a 'Script cache\\|^value_\\|^[0-9]*$\\|changed'";
+    char command[1024];
+    snprintf(command, sizeof(command),
+             "cd ../../src/ej2 && rm -rf /tmp/ej2_script_cache /tmp/ej2_script_bin && mkdir /tmp/ej2_script_bin"
+             " && seq 1 10000 | sed 's/^/V=value_/' > cache_test.sh"
+             " && printf '%%s\\n' 'echo $V' 'seq 1 3 | wc -l' >> cache_test.sh && %s; echo ---; %s", run, run);
+    char* output = run_capture(command);
+    assert(strstr(output, "Script cache: wrote 10002 lines (3 commands)") != NULL);
+    assert(strstr(output, "---\nScript cache: loaded 10002 lines (3 commands) in ") != NULL);
+    char* second = strstr(output, "---\n");
+    assert(second && strstr(second, "value_10000\n3\n") != NULL);
+    printf("✓ Second run executes from the cache\n");
+
+    // A program that appears earlier on PATH is not bypassed by a stale path
+    snprintf(command, sizeof(command),
+             "cd ../../src/ej2 && printf '#!/bin/sh\\necho 42\\n' > /tmp/ej2_script_bin/wc"
+             " && chmod +x /tmp/ej2_script_bin/wc && %s; rm -rf /tmp/ej2_script_bin", run);
+    output = run_capture(command);
+    assert(strstr(output, "Script cache: loaded 10002 lines (0 commands) in ") != NULL);
+    assert(strstr(output, "value_10000\n42\n") != NULL);
+    printf("✓ Resolved paths are dropped when a PATH directory changes\n");
+
+    snprintf(command, sizeof(command),
+             "cd ../../src/ej2 && echo 'echo changed' >> cache_test.sh && %s; rm -f cache_test.sh;"
+             " rm -rf /tmp/ej2_script_cache", run);
+    output = run_capture(command);
+    assert(strstr(output, "loaded") == NULL);
+    assert(strstr(output, "changed\n") != NULL);
+    assert(strstr(output, "Script cache: wrote 10003 lines") != NULL);
+    printf("✓ An edited script is compiled again\n");
+
+    // The cache is opt-in: nothing is written without SHELL_SCRIPT_CACHE
+    output = run_capture("cd ../../src/ej2 && rm -rf /tmp/ej2_script_home && mkdir /tmp/ej2_script_home"
+                         " && echo 'echo uncached' > cache_test.sh && env -u SHELL_SCRIPT_CACHE"
+                         " HOME=/tmp/ej2_script_home SHELL_DEBUG=1 ./shell cache_test.sh 2>&1"
+                         " | grep -a 'Script cache\\|uncached'; ls -A /tmp/ej2_script_home;"
+                         " rm -rf cache_test.sh /tmp/ej2_script_home");
+    assert(strstr(output, "uncached\n") != NULL);
+    assert(strstr(output, "Script cache") == NULL && strstr(output, ".cache") == NULL);
+    printf("✓ No cache without SHELL_SCRIPT_CACHE\n");
+}
+
+int main() {
+    printf(" SCRIPTING FEATURES TESTING SUITE\n");
+    printf("===================================\n");
+
+    RUN_TEST(test_redirections);
+    RUN_TEST(test_bulk_redirections);
+    RUN_TEST(test_bulk_io_uring);
+    RUN_TEST(test_script_file);
+    RUN_TEST(test_script_lazy_parsing);
+    RUN_TEST(test_pipeline_dag);
+    RUN_TEST(test_command_substitution);
+    RUN_TEST(test_variables);
+    RUN_TEST(test_command_lists);
+    RUN_TEST(test_script_cache);
+
+    printf("\n SCRIPTING TESTING COMPLETE!\n");
+    printf("==============================\n");
+    printf("  File redirections\n");
+    printf("  Bulk I/O options\n");
+    printf("  io_uring bulk writer with fallback\n");
+    printf("  Memory-mapped script files\n");
+    printf("  Fan-out / fan-in process substitution\n");
+    printf("  Command substitution\n");
+    printf("  Variables and export\n");
+    printf("  Command lists with && and ||\n");
+    printf("  Compiled script cache\n");
+
+    return 0;
+}